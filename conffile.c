@@ -0,0 +1,164 @@
+/*
+ * Greybus Simulator: configuration files
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbsim.h"
+
+#define CONF_DELIM	" \t\r\n"
+
+/*
+ * Hand each line of path to parse, skipping blank lines and comments.
+ * Returns -EINVAL if parse failed on any line.
+ */
+int conf_file(const char *path, int (*parse)(char *line, void *data),
+	      void *data)
+{
+	char line[CONF_MAXLINE];
+	char *p;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		gbsim_error("failed opening %s\n", path);
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		p = line + strspn(line, CONF_DELIM);
+		if (!*p || *p == '#')
+			continue;
+		if (parse(line, data) < 0)
+			ret = -EINVAL;
+	}
+
+	fclose(f);
+	return ret;
+}
+
+/*
+ * Split the words of a line from str, or left in save when str is NULL,
+ * into an optional leading argument and up to max_opts key=value options.
+ * Words that are neither are reported against who. Returns the number of
+ * options.
+ */
+int conf_args(char *str, char **save, char **arg, char **opts, int max_opts,
+	      const char *who)
+{
+	int num_opts = 0;
+	char *tok;
+
+	*arg = NULL;
+	for (tok = strtok_r(str, CONF_DELIM, save); tok;
+	     tok = strtok_r(NULL, CONF_DELIM, save)) {
+		if (!strchr(tok, '=')) {
+			if (!*arg && !num_opts) {
+				*arg = tok;
+				continue;
+			}
+		} else if (num_opts < max_opts) {
+			opts[num_opts++] = tok;
+			continue;
+		}
+		gbsim_error("%s: bad option %s\n", who, tok);
+	}
+
+	return num_opts;
+}
+
+/* The value of key in opts, NULL if not given */
+const char *conf_opt(char **opts, int num_opts, const char *key)
+{
+	size_t len = strlen(key);
+	int i;
+
+	for (i = 0; i < num_opts; i++)
+		if (!strncmp(opts[i], key, len) && opts[i][len] == '=')
+			return opts[i] + len + 1;
+
+	return NULL;
+}
+
+/* <reg> <value> [<value>...], values after the first are scripted */
+static int regs_line(char *line, void *data)
+{
+	struct gbsim_regs *regs = data;
+	uint8_t values[GBSIM_REGS_SIZE];
+	char *tok, *save;
+	unsigned long reg;
+	int count;
+
+	tok = strtok_r(line, CONF_DELIM, &save);
+	if (!tok)
+		return 0;
+
+	reg = strtoul(tok, NULL, 0);
+	if (reg >= GBSIM_REGS_SIZE) {
+		gbsim_error("register 0x%lx out of range\n", reg);
+		return -EINVAL;
+	}
+
+	count = 0;
+	while ((tok = strtok_r(NULL, CONF_DELIM, &save)) &&
+	       count < GBSIM_REGS_SIZE - 1)
+		values[count++] = strtoul(tok, NULL, 0);
+	if (!count)
+		return 0;
+
+	regs->reg[reg] = values[0];
+	if (count == 1)
+		return 0;
+
+	free(regs->script[reg]);
+	regs->script[reg] = malloc(count);
+	if (!regs->script[reg])
+		return -ENOMEM;
+	memcpy(regs->script[reg], values, count);
+	regs->script_len[reg] = count;
+	regs->script_pos[reg] = 0;
+
+	return 0;
+}
+
+/* Only a file that can't be read fails, bad lines are reported */
+int regs_load(struct gbsim_regs *regs, const char *path)
+{
+	int ret;
+
+	ret = conf_file(path, regs_line, regs);
+	return ret == -EINVAL ? 0 : ret;
+}
+
+void regs_free(struct gbsim_regs *regs)
+{
+	int i;
+
+	for (i = 0; i < GBSIM_REGS_SIZE; i++)
+		free(regs->script[i]);
+}
+
+/* A scripted register cycles through its values until written */
+uint8_t regs_read(struct gbsim_regs *regs, uint8_t reg)
+{
+	uint8_t val;
+
+	if (!regs->script_len[reg])
+		return regs->reg[reg];
+
+	val = regs->script[reg][regs->script_pos[reg]];
+	regs->script_pos[reg] = (regs->script_pos[reg] + 1) %
+				regs->script_len[reg];
+	return val;
+}
+
+void regs_write(struct gbsim_regs *regs, uint8_t reg, uint8_t val)
+{
+	regs->reg[reg] = val;
+	regs->script_len[reg] = 0;
+}
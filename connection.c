@@ -13,19 +13,41 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "gbsim.h"
 #include "gbsim_usb.h"
 
-#define ES1_MSG_SIZE	(2 * 1024)
-
 /* Receive buffer for all data arriving from the AP */
 static char cport_rbuf[ES1_MSG_SIZE];
 static char cport_tbuf[ES1_MSG_SIZE];
 
 extern struct gbsim_svc *svc;
 
+/*
+ * The APB stops and drains a CPort over ARPC before the AP tears its
+ * connection down. Messages to the AP are written whole and in one go,
+ * so what can be in flight on a CPort is the messages other threads are
+ * writing at the time; tx_busy counts them and cport_cond is signalled
+ * as each one completes.
+ */
+static pthread_mutex_t cport_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cport_cond;
+static pthread_once_t cport_once = PTHREAD_ONCE_INIT;
+
+static void cport_cond_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cport_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
 /*
  * We (ab)use the operation-message header pad bytes to transfer the
  * cport id in order to minimise overhead.
@@ -50,28 +72,39 @@ static uint16_t gbsim_message_cport_unpack(struct gb_operation_msg_hdr *header)
 
 struct gbsim_connection *connection_find(uint16_t cport_id)
 {
-	struct gbsim_connection *connection;
+	struct gbsim_connection *connection = NULL;
 	struct gbsim_interface *intf;
 
+	pthread_mutex_lock(&svc->intf_lock);
 	TAILQ_FOREACH(intf, &svc->intfs, intf_node)
 		TAILQ_FOREACH(connection, &intf->connections, cnode)
 			if (connection->hd_cport_id == cport_id)
-				return connection;
+				goto out;
+out:
+	pthread_mutex_unlock(&svc->intf_lock);
 
-	return NULL;
+	return connection;
 }
 
 uint16_t find_hd_cport_for_protocol(int protocol_id)
 {
 	struct gbsim_connection *connection;
 	struct gbsim_interface *intf;
+	uint16_t hd_cport_id = 0;
+
+	pthread_mutex_lock(&svc->intf_lock);
+	TAILQ_FOREACH(intf, &svc->intfs, intf_node) {
+		TAILQ_FOREACH(connection, &intf->connections, cnode) {
+			if (connection->protocol == protocol_id) {
+				hd_cport_id = connection->hd_cport_id;
+				goto out;
+			}
+		}
+	}
+out:
+	pthread_mutex_unlock(&svc->intf_lock);
 
-	TAILQ_FOREACH(intf, &svc->intfs, intf_node)
-		TAILQ_FOREACH(connection, &intf->connections, cnode)
-			if (connection->protocol == protocol_id)
-				return connection->hd_cport_id;
-
-	return 0;
+	return hd_cport_id;
 }
 
 void connection_set_protocol(struct gbsim_connection *connection,
@@ -100,7 +133,9 @@ struct gbsim_connection *allocate_connection(struct gbsim_interface *intf,
 
 	connection->hd_cport_id = hd_cport_id;
 
+	pthread_mutex_lock(&cport_lock);
 	TAILQ_INSERT_TAIL(&intf->connections, connection, cnode);
+	pthread_mutex_unlock(&cport_lock);
 
 	if (cport_id == GB_CONTROL_CPORT_ID)
 		intf->control_conn = connection;
@@ -110,20 +145,207 @@ struct gbsim_connection *allocate_connection(struct gbsim_interface *intf,
 	return connection;
 }
 
+/* Release per-connection protocol state */
+static void connection_exit(struct gbsim_connection *connection)
+{
+	switch (connection->protocol) {
+	case GREYBUS_PROTOCOL_SPI:
+		spi_connection_exit(connection);
+		break;
+	default:
+		break;
+	}
+}
+
 void free_connection(struct gbsim_connection *connection)
 {
 	struct gbsim_interface *intf = connection->intf;
 
+	/*
+	 * Let the messages being sent on it go out first, and unlist it in
+	 * the same section so no sender can find it again.
+	 */
+	pthread_once(&cport_once, cport_cond_init);
+	pthread_mutex_lock(&cport_lock);
+	connection->tx_disabled = true;
+	while (connection->tx_busy)
+		pthread_cond_wait(&cport_cond, &cport_lock);
 	TAILQ_REMOVE(&intf->connections, connection, cnode);
+	pthread_mutex_unlock(&cport_lock);
+
+	connection_exit(connection);
+	operation_cancel(connection->hd_cport_id);
 	free(connection);
 }
 
-static void get_protocol_operation(uint16_t cport_id, char **protocol,
-				   char **operation, uint8_t type)
+/* Open the CPort to traffic again, after a clear */
+int connection_connected(uint16_t hd_cport_id)
 {
 	struct gbsim_connection *connection;
 
-	connection = connection_find(cport_id);
+	pthread_mutex_lock(&cport_lock);
+	connection = connection_find(hd_cport_id);
+	if (connection) {
+		connection->tx_disabled = false;
+		connection->rx_disabled = false;
+	}
+	pthread_mutex_unlock(&cport_lock);
+
+	return connection ? 0 : -ENODEV;
+}
+
+/*
+ * Called with cport_lock held. Wait up to timeout_ms for the messages
+ * being written on hd_cport_id to go out; a connection that goes away
+ * meanwhile has nothing left to drain.
+ */
+static int connection_drain(uint16_t hd_cport_id, unsigned int timeout_ms)
+{
+	struct gbsim_connection *connection;
+	struct timespec ts;
+	int ret = 0;
+
+	pthread_once(&cport_once, cport_cond_init);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	while ((connection = connection_find(hd_cport_id)) &&
+	       connection->tx_busy) {
+		if (ret == ETIMEDOUT)
+			return -ETIMEDOUT;
+		ret = pthread_cond_timedwait(&cport_cond, &cport_lock, &ts);
+	}
+
+	return 0;
+}
+
+/*
+ * Stop the module sending on hd_cport_id and wait for the AP to have
+ * peer_space bytes free on it. The AP takes each message whole, so it
+ * has room for a full one once nothing is being written, and never for
+ * more.
+ */
+int connection_quiesce(uint16_t hd_cport_id, uint16_t peer_space,
+		       unsigned int timeout_ms)
+{
+	struct gbsim_connection *connection;
+	int ret;
+
+	if (peer_space > ES1_MSG_SIZE)
+		return -EINVAL;
+
+	pthread_mutex_lock(&cport_lock);
+	connection = connection_find(hd_cport_id);
+	if (connection)
+		connection->tx_disabled = true;
+	ret = connection_drain(hd_cport_id, timeout_ms);
+	pthread_mutex_unlock(&cport_lock);
+
+	return ret;
+}
+
+/* Wait for what is being sent on hd_cport_id, leaving the CPort open */
+int connection_flush(uint16_t hd_cport_id, unsigned int timeout_ms)
+{
+	int ret;
+
+	pthread_mutex_lock(&cport_lock);
+	ret = connection_drain(hd_cport_id, timeout_ms);
+	pthread_mutex_unlock(&cport_lock);
+
+	return ret;
+}
+
+/*
+ * Drop whatever is still pending on hd_cport_id: no response will come
+ * to its requests now. It stays closed until connected again.
+ */
+int connection_clear(uint16_t hd_cport_id)
+{
+	struct gbsim_connection *connection;
+
+	pthread_mutex_lock(&cport_lock);
+	connection = connection_find(hd_cport_id);
+	if (connection) {
+		connection->tx_disabled = true;
+		connection->rx_disabled = true;
+	}
+	pthread_mutex_unlock(&cport_lock);
+
+	operation_cancel(hd_cport_id);
+
+	return 0;
+}
+
+/*
+ * Phase 1 of a CPort shutdown stops the module sending and waits for
+ * its last messages to go out, phase 2 stops it receiving.
+ */
+int connection_shutdown(uint16_t hd_cport_id, uint8_t phase,
+			unsigned int timeout_ms)
+{
+	struct gbsim_connection *connection;
+	int ret = 0;
+
+	if (phase != 1 && phase != 2)
+		return -EINVAL;
+
+	pthread_mutex_lock(&cport_lock);
+	connection = connection_find(hd_cport_id);
+	if (connection && phase == 1) {
+		connection->tx_disabled = true;
+		ret = connection_drain(hd_cport_id, timeout_ms);
+	} else if (connection) {
+		connection->rx_disabled = true;
+	}
+	pthread_mutex_unlock(&cport_lock);
+
+	return ret;
+}
+
+/*
+ * Look up the connection of hd_cport_id and count a message to the AP in
+ * flight on it, unless the CPort is closed. The connection, or NULL if
+ * there is none, then stays valid until connection_tx_end().
+ */
+static int connection_tx_begin(uint16_t hd_cport_id,
+			       struct gbsim_connection **connection)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&cport_lock);
+	*connection = connection_find(hd_cport_id);
+	if (*connection) {
+		if ((*connection)->tx_disabled)
+			ret = -ESHUTDOWN;
+		else
+			(*connection)->tx_busy++;
+	}
+	pthread_mutex_unlock(&cport_lock);
+
+	return ret;
+}
+
+static void connection_tx_end(struct gbsim_connection *connection)
+{
+	pthread_once(&cport_once, cport_cond_init);
+
+	pthread_mutex_lock(&cport_lock);
+	if (!--connection->tx_busy)
+		pthread_cond_broadcast(&cport_cond);
+	pthread_mutex_unlock(&cport_lock);
+}
+
+static void get_protocol_operation(struct gbsim_connection *connection,
+				   char **protocol, char **operation,
+				   uint8_t type)
+{
 	if (!connection) {
 		*protocol = "N/A";
 		*operation = "N/A";
@@ -166,22 +388,41 @@ static void get_protocol_operation(uint16_t cport_id, char **protocol,
 	}
 }
 
+/*
+ * Send message_size bytes of message followed by data_size bytes of
+ * data in one write, without copying data into the message buffer.
+ */
 static int send_msg_to_ap(uint16_t hd_cport_id,
 			struct op_msg *message, uint16_t message_size,
+			const void *data, size_t data_size,
 			uint16_t operation_id, uint8_t type, uint8_t result)
 {
 	struct gb_operation_msg_hdr *header = &message->header;
+	struct gbsim_connection *connection;
 	char *protocol, *operation;
+	struct iovec iov[2];
 	ssize_t nbytes;
 
-	header->size = htole16(message_size);
+	if (message_size + data_size > ES1_MSG_SIZE) {
+		gbsim_error("message too big (%zu)\n",
+			    message_size + data_size);
+		return -EMSGSIZE;
+	}
+
+	header->size = htole16(message_size + data_size);
 	header->operation_id = operation_id;
 	header->type = type;
 	header->result = result;
 
 	gbsim_message_cport_pack(header, hd_cport_id);
 
-	get_protocol_operation(hd_cport_id, &protocol, &operation,
+	if (connection_tx_begin(hd_cport_id, &connection)) {
+		gbsim_debug("CPort %hu closed, message %02x dropped\n",
+			    hd_cport_id, type);
+		return -ESHUTDOWN;
+	}
+
+	get_protocol_operation(connection, &protocol, &operation,
 			       type & ~OP_RESPONSE);
 	if (type & OP_RESPONSE)
 		gbsim_debug("Module -> AP CPort %hu %s %s response\n",
@@ -191,21 +432,42 @@ static int send_msg_to_ap(uint16_t hd_cport_id,
 			    hd_cport_id, protocol, operation);
 
 	/* Send the response to the AP */
-	if (verbose)
+	if (verbose) {
 		gbsim_dump(message, message_size);
+		if (data_size)
+			gbsim_dump((void *)data, data_size);
+	}
 
-	nbytes = write(to_ap, message, message_size);
-	if (nbytes < 0)
-		return nbytes;
+	iov[0].iov_base = message;
+	iov[0].iov_len = message_size;
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = data_size;
 
-	return 0;
+	nbytes = writev(to_ap, iov, data_size ? 2 : 1);
+	if (nbytes >= 0 && connection)
+		power_count(connection, type, nbytes);
+	if (connection)
+		connection_tx_end(connection);
+
+	return nbytes < 0 ? nbytes : 0;
 }
 
 int send_response(uint16_t hd_cport_id,
 			struct op_msg *message, uint16_t message_size,
 			uint16_t operation_id, uint8_t type, uint8_t result)
+{
+	return send_msg_to_ap(hd_cport_id, message, message_size, NULL, 0,
+				operation_id, type | OP_RESPONSE, result);
+}
+
+/* As send_response(), with the payload taken from data instead */
+int send_response_data(uint16_t hd_cport_id,
+			struct op_msg *message, uint16_t message_size,
+			const void *data, size_t data_size,
+			uint16_t operation_id, uint8_t type, uint8_t result)
 {
 	return send_msg_to_ap(hd_cport_id, message, message_size,
+				data, data_size,
 				operation_id, type | OP_RESPONSE, result);
 }
 
@@ -213,7 +475,7 @@ int send_request(uint16_t hd_cport_id,
 			struct op_msg *message, uint16_t message_size,
 			uint16_t operation_id, uint8_t type)
 {
-	return send_msg_to_ap(hd_cport_id, message, message_size,
+	return send_msg_to_ap(hd_cport_id, message, message_size, NULL, 0,
 				operation_id, type, 0);
 }
 
@@ -271,7 +533,7 @@ static void recv_handler(void *rbuf, size_t rsize)
 	}
 
 	type = hdr->type & OP_RESPONSE ? "response" : "request";
-	get_protocol_operation(hd_cport_id, &protocol, &operation,
+	get_protocol_operation(connection, &protocol, &operation,
 			       hdr->type & ~OP_RESPONSE);
 
 	/* FIXME: can identify module from our cport connection */
@@ -282,7 +544,24 @@ static void recv_handler(void *rbuf, size_t rsize)
 	if (verbose)
 		gbsim_dump(rbuf, rsize);
 
+	if (connection->rx_disabled) {
+		gbsim_debug("CPort %hu closed, message dropped\n", hd_cport_id);
+		return;
+	}
+
 	gbsim_message_cport_clear(hdr);
+	power_count(connection, hdr->type, rsize);
+
+	if (hdr->type & OP_RESPONSE) {
+		ret = operation_response(hd_cport_id, rbuf, rsize);
+		if (ret < 0) {
+			gbsim_error("unexpected response %hu on cport %u\n",
+				    le16toh(hdr->operation_id), hd_cport_id);
+			return;
+		}
+		if (ret)
+			return;
+	}
 
 	ret = connection_recv_handler(connection, rbuf, rsize);
 	if (ret)
@@ -26,16 +26,21 @@
 #define GBSIM_CONTROL_VERSION_MINOR	1
 
 
-int control_handler(struct gbsim_connection *connection, void *rbuf,
-		    size_t rsize, void *tbuf, size_t tsize)
+static int control_request(struct gbsim_connection *connection, void *rbuf,
+			   size_t rsize, void *tbuf, size_t tsize)
 {
 	struct op_msg *op_req = rbuf;
 	struct op_msg *op_rsp = tbuf;
 	struct gb_operation_msg_hdr *oph = &op_req->header;
 	struct gbsim_interface *intf = connection->intf;
+	struct gb_control_timesync_enable_request *timesync_enable_req;
+	uint64_t frame_time[GB_TIMESYNC_MAX_STROBES];
 	size_t payload_size;
 	uint16_t message_size = sizeof(*oph);
 	uint16_t hd_cport_id = connection->hd_cport_id;
+	uint8_t result = GB_OP_SUCCESS;
+	char name[16];
+	int i;
 
 	switch (oph->type) {
 	case GB_REQUEST_TYPE_CPORT_SHUTDOWN:
@@ -51,10 +56,11 @@ int control_handler(struct gbsim_connection *connection, void *rbuf,
 		op_rsp->control_msize_rsp.size = htole16(intf->manifest_size);
 		break;
 	case GB_CONTROL_TYPE_GET_MANIFEST:
-		payload_size = intf->manifest_size;
-		memcpy(&op_rsp->control_manifest_rsp.data, intf->manifest,
-		       payload_size);
-		break;
+		/* Sent straight from the shared manifest, sized to fit at parse */
+		return send_response_data(hd_cport_id, op_rsp, message_size,
+					  intf->manifest, intf->manifest_size,
+					  oph->operation_id, oph->type,
+					  GB_OP_SUCCESS);
 	case GB_CONTROL_TYPE_CONNECTED:
 		payload_size = 0;
 		break;
@@ -80,6 +86,35 @@ int control_handler(struct gbsim_connection *connection, void *rbuf,
 	case GB_CONTROL_TYPE_DISCONNECTING:
 		payload_size = 0;
 		break;
+	case GB_CONTROL_TYPE_TIMESYNC_ENABLE:
+		payload_size = 0;
+		timesync_enable_req = &op_req->control_timesync_enable_req;
+		if (timesync_enable(&intf->timesync, timesync_enable_req->count,
+				    le64toh(timesync_enable_req->frame_time),
+				    le32toh(timesync_enable_req->strobe_delay),
+				    le32toh(timesync_enable_req->refclk)))
+			result = GB_OP_INVALID;
+		break;
+	case GB_CONTROL_TYPE_TIMESYNC_DISABLE:
+		payload_size = 0;
+		timesync_disable(&intf->timesync);
+		break;
+	case GB_CONTROL_TYPE_TIMESYNC_AUTHORITATIVE:
+		payload_size = 0;
+		for (i = 0; i < GB_TIMESYNC_MAX_STROBES; i++)
+			frame_time[i] = le64toh(op_req->control_timesync_auth_req.frame_time[i]);
+		snprintf(name, sizeof(name), "interface %u",
+			 intf->interface_id);
+		if (timesync_authoritative(&intf->timesync, name, frame_time))
+			result = GB_OP_INVALID;
+		break;
+	case GB_CONTROL_TYPE_TIMESYNC_GET_LAST_EVENT:
+		payload_size = sizeof(op_rsp->control_timesync_last_event_rsp);
+		if (timesync_get_last_event(&intf->timesync, frame_time))
+			result = GB_OP_INVALID;
+		op_rsp->control_timesync_last_event_rsp.frame_time =
+			htole64(result ? 0 : frame_time[0]);
+		break;
 	default:
 		gbsim_error("control operation type %02x not supported\n", oph->type);
 		return -EINVAL;
@@ -87,8 +122,20 @@ int control_handler(struct gbsim_connection *connection, void *rbuf,
 
 	message_size += payload_size;
 	return send_response(hd_cport_id, op_rsp, message_size,
-				oph->operation_id, oph->type,
-				PROTOCOL_STATUS_SUCCESS);
+				oph->operation_id, oph->type, result);
+}
+
+int control_handler(struct gbsim_connection *connection, void *rbuf,
+		    size_t rsize, void *tbuf, size_t tsize)
+{
+	struct gb_operation_msg_hdr *oph = rbuf;
+	uint64_t start_us = stress_time_us();
+	int ret;
+
+	ret = control_request(connection, rbuf, rsize, tbuf, tsize);
+	stress_control(connection->intf, oph->type, start_us);
+
+	return ret;
 }
 
 char *control_get_operation(uint8_t type)
@@ -120,6 +167,14 @@ char *control_get_operation(uint8_t type)
 		return "GB_CONTROL_TYPE_BUNDLE_RESUME";
 	case GB_CONTROL_TYPE_INTF_SUSPEND_PREPARE:
 		return "GB_CONTROL_TYPE_INTF_SUSPEND_PREPARE";
+	case GB_CONTROL_TYPE_TIMESYNC_ENABLE:
+		return "GB_CONTROL_TYPE_TIMESYNC_ENABLE";
+	case GB_CONTROL_TYPE_TIMESYNC_DISABLE:
+		return "GB_CONTROL_TYPE_TIMESYNC_DISABLE";
+	case GB_CONTROL_TYPE_TIMESYNC_AUTHORITATIVE:
+		return "GB_CONTROL_TYPE_TIMESYNC_AUTHORITATIVE";
+	case GB_CONTROL_TYPE_TIMESYNC_GET_LAST_EVENT:
+		return "GB_CONTROL_TYPE_TIMESYNC_GET_LAST_EVENT";
 	default:
 		return "(Unknown operation)";
 	}
@@ -268,6 +268,126 @@ static int dump_control_msg(const struct usb_ctrlrequest *setup)
 	return count;
 }
 
+/* Read the data stage of an OUT request, which must hold size bytes */
+static int read_control_data(const struct usb_ctrlrequest *setup, void *data,
+			     size_t size)
+{
+	uint8_t buf[256];
+	size_t len = le16toh(setup->wLength);
+	int count;
+
+	count = read(control, buf, len < sizeof(buf) ? len : sizeof(buf));
+	if (count < 0) {
+		gbsim_error("control request %02x: failed to read data\n",
+			    setup->bRequest);
+		return -errno;
+	}
+	if (count < size) {
+		gbsim_error("control request %02x: short data (%d)\n",
+			    setup->bRequest, count);
+		return -EINVAL;
+	}
+
+	memcpy(data, buf, size);
+	return 0;
+}
+
+/* The APB side of TimeSync */
+static void timesync_request(const struct usb_ctrlrequest *setup)
+{
+	struct gbsim_timesync *ts = timesync_apb_get();
+	struct gb_control_timesync_enable_request enable;
+	struct gb_control_timesync_authoritative_request auth;
+	uint64_t frame_time[GB_TIMESYNC_MAX_STROBES];
+	uint64_t last_event;
+	int i, ret = 0;
+
+	switch (setup->bRequest) {
+	case GB_APB_REQUEST_TIMESYNC_ENABLE:
+		ret = read_control_data(setup, &enable, sizeof(enable));
+		if (!ret)
+			ret = timesync_enable(ts, enable.count,
+					      le64toh(enable.frame_time),
+					      le32toh(enable.strobe_delay),
+					      le32toh(enable.refclk));
+		break;
+	case GB_APB_REQUEST_TIMESYNC_DISABLE:
+		timesync_disable(ts);
+		/* No data stage, complete the status stage */
+		if (read(control, NULL, 0) < 0)
+			ret = -errno;
+		break;
+	case GB_APB_REQUEST_TIMESYNC_AUTHORITATIVE:
+		ret = read_control_data(setup, &auth, sizeof(auth));
+		if (ret)
+			break;
+		for (i = 0; i < GB_TIMESYNC_MAX_STROBES; i++)
+			frame_time[i] = le64toh(auth.frame_time[i]);
+		ret = timesync_authoritative(ts, "APB", frame_time);
+		break;
+	case GB_APB_REQUEST_TIMESYNC_GET_LAST_EVENT:
+		ret = timesync_get_last_event(ts, frame_time);
+		if (ret) {
+			/* Stall the IN request */
+			if (read(control, NULL, 0) < 0)
+				gbsim_debug("timesync get last event stalled\n");
+			break;
+		}
+		last_event = htole64(frame_time[0]);
+		if (write(control, &last_event, sizeof(last_event)) < 0)
+			ret = -errno;
+		break;
+	}
+
+	if (ret)
+		gbsim_error("APB timesync request %02x failed (%d)\n",
+			    setup->bRequest, ret);
+}
+
+/*
+ * Run an ARPC request on the CPort it names, returning a negative errno
+ * on failure. The AP gives up on an ARPC after 500 ms, plus the timeout
+ * of a quiesce, so an unbounded flush has to finish well within that.
+ */
+#define ARPC_FLUSH_TIMEOUT_MS	400
+
+static int arpc_request(struct arpc_request_message *arpc_req, size_t size)
+{
+	struct arpc_cport_quiesce_req *quiesce;
+	struct arpc_cport_shutdown_req *shutdown;
+	size_t len = size - sizeof(*arpc_req);
+	uint16_t cport_id;
+
+	/* Every request starts with the CPort id */
+	if (len < sizeof(__le16))
+		return -EINVAL;
+	cport_id = le16toh(*(__le16 *)arpc_req->data);
+
+	switch (arpc_req->type) {
+	case ARPC_TYPE_CPORT_CONNECTED:
+		return connection_connected(cport_id);
+	case ARPC_TYPE_CPORT_QUIESCE:
+		if (len < sizeof(*quiesce))
+			return -EINVAL;
+		quiesce = (struct arpc_cport_quiesce_req *)arpc_req->data;
+		return connection_quiesce(cport_id,
+					  le16toh(quiesce->peer_space),
+					  le16toh(quiesce->timeout));
+	case ARPC_TYPE_CPORT_CLEAR:
+		return connection_clear(cport_id);
+	case ARPC_TYPE_CPORT_FLUSH:
+		return connection_flush(cport_id, ARPC_FLUSH_TIMEOUT_MS);
+	case ARPC_TYPE_CPORT_SHUTDOWN:
+		if (len < sizeof(*shutdown))
+			return -EINVAL;
+		shutdown = (struct arpc_cport_shutdown_req *)arpc_req->data;
+		return connection_shutdown(cport_id, shutdown->phase,
+					   le16toh(shutdown->timeout));
+	default:
+		return -EINVAL;
+	}
+}
+
 static void arpc_response_send(const struct usb_ctrlrequest *setup)
 {
 	uint8_t buf[256];
@@ -275,11 +395,11 @@ static void arpc_response_send(const struct usb_ctrlrequest *setup)
 	struct arpc_response_message arpc_rsp;
 	uint16_t arpc_size;
 	int count;
+	int ret;
 
 	arpc_size = le16toh(setup->wLength);
-	if (arpc_size < sizeof(*arpc_req))
-		gbsim_debug("arpc run received with the wrong size: %u : %u\n",
-			    arpc_size, sizeof(*arpc_req));
+	if (arpc_size > sizeof(buf))
+		arpc_size = sizeof(buf);
 
 	count = read(control, buf, arpc_size);
 	if (count < 0) {
@@ -288,6 +408,12 @@ static void arpc_response_send(const struct usb_ctrlrequest *setup)
 	}
 
 	arpc_req = (struct arpc_request_message *)buf;
+	if (count < sizeof(*arpc_req)) {
+		gbsim_error("arpc run received with the wrong size: %d : %zu\n",
+			    count, sizeof(*arpc_req));
+		return;
+	}
+
 	if (verbose) {
 		gbsim_debug("AP->ARPC message\n");
 		gbsim_debug("   id	= 0x%04x\n", le16toh(arpc_req->id));
@@ -295,12 +421,29 @@ static void arpc_response_send(const struct usb_ctrlrequest *setup)
 		gbsim_debug("   type	= 0x%02x\n", arpc_req->type);
 	}
 
-	/*
-	 * we reply success to every arpc request, as we are not doing anything
-	 * with the it...yet.
-	 */
+	ret = arpc_request(arpc_req, count);
+	switch (ret) {
+	case 0:
+		arpc_rsp.result = ARPC_SUCCESS;
+		break;
+	case -ETIMEDOUT:
+		arpc_rsp.result = ARPC_TIMEOUT;
+		break;
+	case -ENOMEM:
+		arpc_rsp.result = ARPC_NO_MEMORY;
+		break;
+	case -EINVAL:
+	case -ENODEV:
+		arpc_rsp.result = ARPC_INVALID;
+		break;
+	default:
+		arpc_rsp.result = ARPC_UNKNOWN_ERROR;
+		break;
+	}
+	if (ret)
+		gbsim_error("arpc %02x failed (%d)\n", arpc_req->type, ret);
+
 	arpc_rsp.id = arpc_req->id;
-	arpc_rsp.result = ARPC_SUCCESS;
 
 	count = write(to_ap_arpc, &arpc_rsp,
 		      sizeof(struct arpc_response_message));
@@ -347,7 +490,7 @@ static void handle_setup(const struct usb_ctrlrequest *setup)
 		 * - For a valid response, send the 'hello' message.
 		 */
 		ret = svc_request_send(GB_REQUEST_TYPE_PROTOCOL_VERSION, AP_INTF_ID);
-		if (ret)
+		if (ret < 0)
 			gbsim_error("Failed to send svc version request (%d)\n", ret);
 
 		break;
@@ -370,6 +513,12 @@ static void handle_setup(const struct usb_ctrlrequest *setup)
 		dump_control_msg(setup);
 		gbsim_debug("cport flags request, nothing to do\n");
 		break;
+	case GB_APB_REQUEST_TIMESYNC_ENABLE:
+	case GB_APB_REQUEST_TIMESYNC_DISABLE:
+	case GB_APB_REQUEST_TIMESYNC_AUTHORITATIVE:
+	case GB_APB_REQUEST_TIMESYNC_GET_LAST_EVENT:
+		timesync_request(setup);
+		break;
 	case GB_APB_REQUEST_ARPC_RUN:
 		arpc_response_send(setup);
 		break;
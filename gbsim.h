@@ -14,6 +14,8 @@
 #define __packed  __attribute__((__packed__))
 
 #include <endian.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/queue.h>
@@ -33,11 +35,21 @@
 #define ALIGN(p)		((typeof(p))(((unsigned)(p) + _ALIGNBYTES) & ~_ALIGNBYTES))
 
 extern int bbb_backend;
+extern int gpio_cdev;
+extern int gpio_irq_rate;
+extern int gpio_sim;
 extern int i2c_adapter;
+extern char *i2c_config;
+extern char *pwm_config;
 extern int uart_portno;
 extern int uart_count;
+extern int uart_pty;
+extern int uart_pty_pace;
 extern int spi_busno;
 extern int spi_csno;
+extern char *spi_nor_image;
+extern char *spi_config;
+extern char *stress_config;
 extern int gbsim_id;
 extern int verbose;
 extern char *hotplug_basedir;
@@ -60,18 +72,53 @@ struct gbsim_connection {
 	uint16_t cport_id;
 	uint16_t hd_cport_id;
 	int protocol;
+	uint16_t operation_id;	/* last id used for a request */
+
+	/* Gated by the APB's ARPC requests, see connection_quiesce() */
+	bool tx_disabled;
+	bool rx_disabled;
+	unsigned int tx_busy;	/* messages being written to the AP */
 
 	struct gbsim_interface *intf;
+	void *priv;		/* protocol state, freed on teardown */
 };
 
-/* CPorts */
-
-#define PROTOCOL_STATUS_SUCCESS	0x00
-#define PROTOCOL_STATUS_INVALID	0x01
-#define PROTOCOL_STATUS_NOMEM	0x02
-#define PROTOCOL_STATUS_BUSY	0x03
-#define PROTOCOL_STATUS_RETRY	0x04
-#define PROTOCOL_STATUS_BAD	0xff
+/* Operation results as the AP's greybus core maps them to errno */
+#define GB_OP_SUCCESS		0x00
+#define GB_OP_INTERRUPTED	0x01
+#define GB_OP_TIMEOUT		0x02
+#define GB_OP_NO_MEMORY		0x03
+#define GB_OP_PROTOCOL_BAD	0x04
+#define GB_OP_OVERFLOW		0x05
+#define GB_OP_INVALID		0x06
+#define GB_OP_RETRY		0x07
+#define GB_OP_NONEXISTENT	0x08
+#define GB_OP_UNKNOWN_ERROR	0xfe
+#define GB_OP_MALFUNCTION	0xff
+
+/* Map a failure of the device behind a CPort to its operation result */
+static inline uint8_t gbsim_errno_to_result(int err)
+{
+	switch (err) {
+	case ENODEV:
+	case ENXIO:
+	case EREMOTEIO:
+		/* No such device, or no ACK from it */
+		return GB_OP_NONEXISTENT;
+	case ETIMEDOUT:
+		return GB_OP_TIMEOUT;
+	case EAGAIN:
+		/* Arbitration lost, or the device is busy */
+		return GB_OP_RETRY;
+	case EINVAL:
+	case EOPNOTSUPP:
+		return GB_OP_INVALID;
+	case ENOMEM:
+		return GB_OP_NO_MEMORY;
+	default:
+		return GB_OP_UNKNOWN_ERROR;
+	}
+}
 
 /* Ops */
 struct op_msg {
@@ -82,6 +129,9 @@ struct op_msg {
 		struct gb_control_get_manifest_response control_manifest_rsp;
 		struct gb_control_bundle_pm_response	control_bundle_pm_rsp;
 		struct gb_control_intf_pm_response	control_intf_pm_rsp;
+		struct gb_control_timesync_enable_request	control_timesync_enable_req;
+		struct gb_control_timesync_authoritative_request	control_timesync_auth_req;
+		struct gb_control_timesync_get_last_event_response	control_timesync_last_event_rsp;
 		struct gb_svc_version_request		svc_version_request;
 		struct gb_svc_version_response		svc_version_response;
 		struct gb_svc_hello_request		hello_request;
@@ -98,6 +148,11 @@ struct op_msg {
 		struct gb_svc_route_create_request	svc_route_create_request;
 		struct gb_svc_route_destroy_request	svc_route_destroy_request;
 		struct gb_svc_pwrmon_rail_count_get_response	svc_pwrmon_rail_count_get_response;
+		struct gb_svc_pwrmon_rail_names_get_response	svc_pwrmon_rail_names_get_response;
+		struct gb_svc_pwrmon_sample_get_request	svc_pwrmon_sample_get_request;
+		struct gb_svc_pwrmon_sample_get_response	svc_pwrmon_sample_get_response;
+		struct gb_svc_pwrmon_intf_sample_get_request	svc_pwrmon_intf_sample_get_request;
+		struct gb_svc_pwrmon_intf_sample_get_response	svc_pwrmon_intf_sample_get_response;
 		struct gb_svc_intf_vsys_request		svc_intf_vsys_request;
 		struct gb_svc_intf_vsys_response	svc_intf_vsys_response;
 		struct gb_svc_intf_refclk_response	svc_intf_refclk_response;
@@ -106,6 +161,10 @@ struct op_msg {
 		struct gb_svc_intf_resume_response	svc_intf_resume_response;
 		struct gb_svc_intf_set_pwrm_request     svc_intf_set_pwrm_request;
 		struct gb_svc_intf_set_pwrm_response	svc_intf_set_pwrm_response;
+		struct gb_svc_timesync_enable_request	svc_timesync_enable_request;
+		struct gb_svc_timesync_authoritative_response	svc_timesync_authoritative_response;
+		struct gb_svc_timesync_wake_pins_acquire_request	svc_timesync_wake_pins_acquire_request;
+		struct gb_svc_timesync_ping_response	svc_timesync_ping_response;
 		struct gb_gpio_line_count_response	gpio_lc_rsp;
 		struct gb_gpio_activate_request		gpio_act_req;
 		struct gb_gpio_deactivate_request	gpio_deact_req;
@@ -199,6 +258,11 @@ struct op_msg {
 
 #define OP_RESPONSE			0x80
 
+/* The AP's es2 buffers, nothing larger is accepted in either direction */
+#define ES1_MSG_SIZE			(2 * 1024)
+#define GBSIM_MANIFEST_SIZE_MAX		\
+	(ES1_MSG_SIZE - sizeof(struct gb_operation_msg_hdr))
+
 /* debug/info/error macros */
 #define gbsim_debug(fmt, ...)						\
         do { if (verbose) { fprintf(stdout, "[D] GBSIM: " fmt,  	\
@@ -234,9 +298,79 @@ void connection_set_protocol(struct gbsim_connection *connection,
 			     uint16_t cport_id);
 uint16_t find_hd_cport_for_protocol(int protocol_id);
 void free_connection(struct gbsim_connection *connections);
+int connection_connected(uint16_t hd_cport_id);
+int connection_quiesce(uint16_t hd_cport_id, uint16_t peer_space,
+		       unsigned int timeout_ms);
+int connection_flush(uint16_t hd_cport_id, unsigned int timeout_ms);
+int connection_clear(uint16_t hd_cport_id);
+int connection_shutdown(uint16_t hd_cport_id, uint8_t phase,
+			unsigned int timeout_ms);
+
+/*
+ * A validated manifest, shared read-only by every interface inserted
+ * with the same content. See manifest_get().
+ */
+struct gbsim_manifest {
+	TAILQ_ENTRY(gbsim_manifest) node;
+
+	void *data;
+	size_t size;
+	uint64_t hash;
+	int refcount;
+
+	/* Identity of the file it was last read from */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t file_size;
+	int64_t mtime_ns;
+
+	/* Descriptors indexed by id, built by manifest_parse() */
+	struct greybus_descriptor_interface *intf_desc;
+	struct greybus_descriptor_string **strings;
+	unsigned int num_strings;
+	struct greybus_descriptor_bundle **bundles;
+	unsigned int num_bundles;
+	struct greybus_descriptor_cport **cports;
+	unsigned int num_cports;
+};
+
+/* PWRMON rails: the module supply, then one per protocol */
+#define POWER_RAIL_VSYS		0
+#define POWER_RAIL_GPIO		1
+#define POWER_RAIL_I2C		2
+#define POWER_RAIL_UART		3
+#define POWER_RAIL_PWM		4
+#define POWER_RAIL_SPI		5
+#define POWER_NR_RAILS		6
+
+/*
+ * Activity of an interface, counted with atomic adds from any thread.
+ * The model below it is evaluated by the SVC handler only.
+ */
+struct gbsim_power {
+	uint64_t bytes[POWER_NR_RAILS];
+	uint64_t toggles;
+
+	uint64_t last_us;
+	uint64_t last_bytes[POWER_NR_RAILS];
+	uint64_t last_toggles;
+	uint32_t rail_ua[POWER_NR_RAILS];	/* VSYS is the total */
+};
+
+/* A TimeSync participant: an interface, or the APB */
+struct gbsim_timesync {
+	bool enabled;
+	bool authoritative;
+	uint8_t count;
+	uint32_t refclk;
+	uint64_t enable_ns;
+	uint64_t ref_ns;		/* CLOCK_MONOTONIC_RAW ... */
+	uint64_t ref_frame_time;	/* ... at this frame time */
+};
 
 struct gbsim_interface {
 	TAILQ_ENTRY(gbsim_interface) intf_node;
+	struct gbsim_interface *fname_next;	/* svc->intf_by_fname chain */
 
 	uint8_t interface_id;
 	uint8_t features;
@@ -245,26 +379,75 @@ struct gbsim_interface {
 	char *product_id;
 	uint32_t serial_number;
 
+	struct gbsim_manifest *mnf;
 	void *manifest;
 	size_t manifest_size;
-	unsigned long manifest_fname_hash;
+	char *manifest_fname;	/* hotplug file the interface came from */
 
 	struct gbsim_connection *control_conn;
 	struct gbsim_svc *svc;
+	struct gbsim_power power;
+	struct gbsim_timesync timesync;
 
 	TAILQ_HEAD(chead, gbsim_connection) connections;
 };
 
+#define GBSIM_MAX_INTERFACES	256	/* interface ids are a uint8_t */
+#define GBSIM_FNAME_BUCKETS	256
+
 struct gbsim_svc {
 	struct gbsim_interface *intf;
 
+	/* The list and lookups below, see interface.c */
+	pthread_mutex_t intf_lock;
 	TAILQ_HEAD(intf_head, gbsim_interface) intfs;
+
+	/* Lookups by interface id and by manifest file name */
+	uint32_t intf_id_map[GBSIM_MAX_INTERFACES / 32];
+	struct gbsim_interface *intf_by_id[GBSIM_MAX_INTERFACES];
+	struct gbsim_interface *intf_by_fname[GBSIM_FNAME_BUCKETS];
 };
 
 int inotify_start(struct gbsim_svc *svc, char *base_dir);
 
+void power_count(struct gbsim_connection *connection, uint8_t type,
+		 size_t size);
+uint8_t power_rail_count(void);
+size_t power_rail_names(uint8_t *names, size_t size);
+uint8_t power_sample(struct gbsim_svc *svc, uint8_t rail_id, uint8_t type,
+		     uint32_t *measurement);
+uint8_t power_intf_sample(struct gbsim_svc *svc, uint8_t intf_id,
+			  uint8_t type, uint32_t *measurement);
+
+int timesync_svc_enable(uint8_t count, uint64_t frame_time,
+			uint32_t strobe_delay, uint32_t refclk);
+void timesync_svc_disable(void);
+int timesync_svc_authoritative(uint64_t *frame_time);
+int timesync_svc_wake_pins_acquire(uint32_t strobe_mask);
+void timesync_svc_wake_pins_release(void);
+int timesync_svc_ping(uint64_t *frame_time);
+int timesync_enable(struct gbsim_timesync *ts, uint8_t count,
+		    uint64_t frame_time, uint32_t strobe_delay, uint32_t refclk);
+void timesync_disable(struct gbsim_timesync *ts);
+int timesync_authoritative(struct gbsim_timesync *ts, const char *name,
+			   const uint64_t *frame_time);
+int timesync_get_last_event(struct gbsim_timesync *ts, uint64_t *frame_time);
+struct gbsim_timesync *timesync_apb_get(void);
+
+int stress_start(struct gbsim_svc *svc, const char *config);
+uint64_t stress_time_us(void);
+void stress_control(struct gbsim_interface *intf, uint8_t type,
+		    uint64_t start_us);
+void stress_cleanup(void);
+
+/* status is the response's result, or a negative errno without one */
+typedef void (*gbsim_op_callback)(void *data, struct op_msg *rsp,
+				  size_t rsize, int status);
+
 int svc_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
 int svc_request_send(uint8_t, uint8_t);
+int svc_request_send_cb(uint8_t type, uint8_t intf_id,
+			gbsim_op_callback callback, void *data);
 char *svc_get_operation(uint8_t type);
 int svc_get_next_intf_id(struct gbsim_svc *svc);
 int svc_init(void);
@@ -272,8 +455,11 @@ void svc_exit(void);
 
 struct gbsim_interface *interface_alloc(struct gbsim_svc *svc, uint8_t id);
 struct gbsim_interface *interface_get_by_id(struct gbsim_svc *svc, uint8_t id);
-struct gbsim_interface *interface_get_by_hash(struct gbsim_svc *svc,
-					      uint32_t hash);
+struct gbsim_interface *interface_get_by_fname(struct gbsim_svc *svc,
+					       const char *fname);
+int interface_set_fname(struct gbsim_svc *svc, struct gbsim_interface *intf,
+			const char *fname);
+void interface_del_fname(struct gbsim_svc *svc, struct gbsim_interface *intf);
 
 void interface_free(struct gbsim_svc *svc, struct gbsim_interface *intf);
 
@@ -288,13 +474,41 @@ char *gpio_get_operation(uint8_t type);
 void gpio_init(void);
 void gpio_cleanup(void);
 
+/* Configuration files: "<id> <model> [arg] [key=value ...]" lines */
+#define CONF_MAXLINE		256
+#define CONF_MAX_OPTS		8
+
+int conf_file(const char *path, int (*parse)(char *line, void *data),
+	      void *data);
+int conf_args(char *str, char **save, char **arg, char **opts, int max_opts,
+	      const char *who);
+const char *conf_opt(char **opts, int num_opts, const char *key);
+
+/* Register map of the i2c and spi models, with scripted reads */
+#define GBSIM_REGS_SIZE		256
+
+struct gbsim_regs {
+	uint8_t		reg[GBSIM_REGS_SIZE];
+	uint8_t		*script[GBSIM_REGS_SIZE];
+	uint8_t		script_len[GBSIM_REGS_SIZE];
+	uint8_t		script_pos[GBSIM_REGS_SIZE];
+};
+
+int regs_load(struct gbsim_regs *regs, const char *path);
+void regs_free(struct gbsim_regs *regs);
+uint8_t regs_read(struct gbsim_regs *regs, uint8_t reg);
+void regs_write(struct gbsim_regs *regs, uint8_t reg, uint8_t val);
+
 int i2c_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
 char *i2c_get_operation(uint8_t type);
 void i2c_init(void);
+void i2c_cleanup(void);
 
 int pwm_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
 char *pwm_get_operation(uint8_t type);
 void pwm_init(void);
+void pwm_cleanup(void);
+uint32_t pwm_load_ppm(void);
 
 int sdio_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
 char *sdio_get_operation(uint8_t type);
@@ -303,6 +517,8 @@ void sdio_init(void);
 int spi_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
 char *spi_get_operation(uint8_t type);
 void spi_init(void);
+void spi_cleanup(void);
+void spi_connection_exit(struct gbsim_connection *);
 
 int lights_handler(struct gbsim_connection *,  void *, size_t, void *, size_t);
 char *lights_get_operation(uint8_t type);
@@ -314,6 +530,7 @@ int uart_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
 char *uart_get_operation(uint8_t type);
 void uart_init(void);
 void uart_cleanup(void);
+uint32_t uart_rate(uint16_t hd_cport_id);
 
 int loopback_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
 char *loopback_get_operation(uint8_t type);
@@ -330,14 +547,39 @@ int fw_download_handler(struct gbsim_connection *, void *, size_t, void *, size_
 char *fw_download_get_operation(uint8_t type);
 int download_firmware(char *tag, uint16_t hd_cport_id, void (*func)(void));
 
-bool manifest_parse(struct gbsim_svc *svc, int intf_id, void *data,
-		    size_t size);
+bool manifest_parse(struct gbsim_manifest *mnf);
+uint64_t manifest_hash(const void *data, size_t size);
+struct gbsim_manifest *manifest_get(const char *path);
+struct gbsim_manifest *manifest_get_data(const void *data, size_t size);
+void manifest_put(struct gbsim_manifest *mnf);
+void manifest_attach(struct gbsim_interface *intf, struct gbsim_manifest *mnf);
+void manifest_cache_cleanup(void);
+struct gbsim_manifest *mnfs_get(const char *path);
+void mnfs_cleanup(void);
 int cport_get_protocol(struct gbsim_interface *intf, uint16_t cport_id);
+struct greybus_descriptor_cport *manifest_get_cport(struct gbsim_interface *intf,
+						   uint16_t cport_id);
+struct greybus_descriptor_bundle *manifest_get_bundle(struct gbsim_interface *intf,
+						     uint8_t bundle_id);
+struct greybus_descriptor_string *manifest_get_string(struct gbsim_interface *intf,
+						     uint8_t string_id);
 int send_response(uint16_t hd_cport_id,
 			struct op_msg *message, uint16_t message_size,
 			uint16_t operation_id, uint8_t type, uint8_t result);
+int send_response_data(uint16_t hd_cport_id,
+			struct op_msg *message, uint16_t message_size,
+			const void *data, size_t data_size,
+			uint16_t operation_id, uint8_t type, uint8_t result);
 int send_request(uint16_t hd_cport_id,
 			struct op_msg *message, uint16_t message_size,
 			uint16_t operation_id, uint8_t type);
 
+int send_request_async(uint16_t hd_cport_id, struct op_msg *message,
+		       uint16_t message_size, uint8_t type,
+		       unsigned int timeout_ms, int retries,
+		       gbsim_op_callback callback, void *data);
+int operation_response(uint16_t hd_cport_id, struct op_msg *rsp,
+		       size_t rsize);
+void operation_cancel(uint16_t hd_cport_id);
+
 #endif /* __GBSIM_H */
@@ -9,50 +9,1034 @@
  */
 
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <libsoc_gpio.h>
 #include <linux/fs.h>
+#include <linux/gpio.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 
 #include "gbsim.h"
 
+#define GPIO_MAX_LINES		12
+#define GPIO_CHIP_LINES		32	/* lines per AM335x GPIO bank */
+#define GPIO_MAX_CHIPS		4
+#define GPIO_EVENT_BATCH	16
+#define GPIO_WHEEL_SLOTS	64
+#define GPIO_WHEEL_TICK_US	1000
+#define GPIO_SIM_CLIENTS	4
+#define GPIO_SIM_MAXLINE	128
+
 struct gb_gpio {
 	uint8_t activated;
 	uint8_t direction;
 	uint8_t value;
-	uint8_t irq_type;
-	uint8_t irq_unmasked;
 };
 
-static struct gb_gpio gb_gpios[12];
-static gpio *gpios[12];
+/*
+ * Timer wheel run by gpio_thread(), ticking every GPIO_WHEEL_TICK_US while
+ * a timer is armed. Timers hash into a slot by expiry tick, and a slot
+ * keeps the timers of later rounds until their tick comes around.
+ */
+struct gpio_timer {
+	uint64_t		expires;
+	bool			armed;
+	struct gpio_timer	*next;
+	struct gpio_timer	**pprev;
+	void			(*fn)(void *data, uint64_t now_us);
+	void			*data;
+};
 
-uint8_t gpio_count=5;
+/*
+ * Interrupt state of a line. The event message is built once when the IRQ
+ * type is set and only sent from then on. An event on a masked line is
+ * held as pending and sent when the AP unmasks it, further events
+ * coalesce into it.
+ *
+ * Without native debounce, an edge arms the line's timer for the debounce
+ * period and later edges push it back; when it fires, an event is sent if
+ * the settled level matches the IRQ type. With a rate limit, an edge
+ * closer than the limit to the last event is deferred to the end of the
+ * interval, and further edges until then are dropped.
+ */
+struct gpio_irq {
+	uint8_t		which;
+	uint8_t		type;
+	uint16_t	hd_cport_id;
+	bool		masked;
+	bool		pending;
+	int		level;
+	uint16_t	debounce_us;
+	uint64_t	last_us;
+	struct gpio_timer timer;
+	unsigned long	events;
+	unsigned long	held;
+	unsigned long	suppressed;
+	uint64_t	stim_us;
+	unsigned long	lat_count;
+	uint64_t	lat_sum;
+	uint64_t	lat_min;
+	uint64_t	lat_max;
+	struct op_msg	msg;
+};
+
+/* Line access, 0 or a negative errno */
+struct gpio_backend {
+	const char	*name;
+	int	(*get_direction)(uint8_t which);
+	int	(*direction_in)(uint8_t which);
+	int	(*direction_out)(uint8_t which, uint8_t value);
+	int	(*get_value)(uint8_t which);
+	int	(*set_value)(uint8_t which, uint8_t value);
+	int	(*set_debounce)(uint8_t which, uint16_t usec);
+	int	(*irq_type)(uint8_t which, uint8_t type);
+};
+
+/*
+ * Simulated bank stimulus: an output can be looped back to an input, and
+ * an input can be toggled a number of times at a fixed period by its
+ * stimulus timer.
+ */
+struct gpio_sim_line {
+	int		loop;
+	unsigned int	edges_left;
+	uint64_t	period_us;
+	uint64_t	next_us;
+	struct gpio_timer timer;
+};
+
+struct gpio_sim_client {
+	int		fd;
+	size_t		len;
+	char		buf[GPIO_SIM_MAXLINE];
+};
+
+/*
+ * A line of a /dev/gpiochipN character device, requested once at init and
+ * reconfigured in place. Edge events are read from the request fd by
+ * gpio_thread().
+ */
+struct gpio_cdev_line {
+	int		fd;
+	uint64_t	flags;
+	uint8_t		value;
+	uint16_t	debounce_us;
+};
+
+static struct gb_gpio gb_gpios[GPIO_MAX_LINES];
+static struct gpio_irq gpio_irqs[GPIO_MAX_LINES];
+static pthread_mutex_t gpio_irq_lock = PTHREAD_MUTEX_INITIALIZER;
+static gpio *gpios[GPIO_MAX_LINES];
+static struct gpio_cdev_line cdev_lines[GPIO_MAX_LINES];
+static int cdev_chips[GPIO_MAX_CHIPS] = { -1, -1, -1, -1 };
+static const struct gpio_backend *backend;
 
-uint8_t current_which;
-uint16_t current_hd_cport_id;
+static pthread_t gpio_pthread;
+static bool gpio_thread_started;
+static bool gpio_thread_exit;
+static int gpio_sig_pipe[2] = { -1, -1 };
+
+static struct gpio_sim_line sim_lines[GPIO_MAX_LINES];
+static struct gpio_sim_client sim_clients[GPIO_SIM_CLIENTS];
+static int gpio_sim_sock = -1;
+static char gpio_sim_path[108];
+
+static struct gpio_timer *gpio_wheel[GPIO_WHEEL_SLOTS];
+static uint64_t gpio_wheel_tick;
+static int gpio_timers_armed;
+
+uint8_t gpio_count=5;
 
 unsigned int mikrobus_gpios[18] = {89,23,50,45,26,110,60,48,50,49,116,51,26,65,22,46,27,23};
 
-int int_event_callback(void *args)
+static uint64_t gpio_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void gpio_thread_wake(void)
+{
+	if (gpio_sig_pipe[1] >= 0 && write(gpio_sig_pipe[1], "", 1) < 0 &&
+	    errno != EAGAIN)
+		gbsim_error("Write to signal pipe fail %d\n", errno);
+}
+
+/* Called with gpio_irq_lock held, as are all timer wheel functions */
+static void gpio_timer_link(struct gpio_timer *t, struct gpio_timer **head)
+{
+	t->next = *head;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = head;
+	*head = t;
+}
+
+static void gpio_timer_unlink(struct gpio_timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+}
+
+static void gpio_timer_cancel(struct gpio_timer *t)
+{
+	if (!t->armed)
+		return;
+
+	gpio_timer_unlink(t);
+	t->armed = false;
+	gpio_timers_armed--;
+}
+
+static void gpio_timer_arm(struct gpio_timer *t, uint64_t expires_us)
+{
+	uint64_t tick = (expires_us + GPIO_WHEEL_TICK_US - 1) /
+			GPIO_WHEEL_TICK_US;
+
+	gpio_timer_cancel(t);
+	if (tick < gpio_wheel_tick)
+		tick = gpio_wheel_tick;
+
+	t->expires = tick;
+	gpio_timer_link(t, &gpio_wheel[tick % GPIO_WHEEL_SLOTS]);
+	t->armed = true;
+
+	/* gpio_thread() sleeps without a timeout while no timer is armed */
+	if (!gpio_timers_armed++)
+		gpio_thread_wake();
+}
+
+static void gpio_irq_send(struct gpio_irq *irq)
 {
-	size_t payload_size;	  
 	uint16_t message_size;
-	struct op_msg *op_req=malloc(sizeof(struct op_msg));
+	uint64_t lat;
 
-	payload_size = sizeof(struct gb_gpio_irq_event_request);
-	op_req->gpio_irq_event_req.which = current_which;
-	message_size = sizeof(struct gb_operation_msg_hdr) + payload_size;
-	send_request(current_hd_cport_id, op_req, message_size, 0, GB_GPIO_TYPE_IRQ_EVENT);
+	message_size = sizeof(struct gb_operation_msg_hdr) +
+		       sizeof(struct gb_gpio_irq_event_request);
+	/* IRQ events are unidirectional */
+	send_request_async(irq->hd_cport_id, &irq->msg, message_size,
+			   GB_GPIO_TYPE_IRQ_EVENT, 0, 0, NULL, NULL);
+
+	/* Latency from the simulated edge to the event on the wire */
+	if (!irq->stim_us)
+		return;
+	lat = gpio_now_us() - irq->stim_us;
+	irq->stim_us = 0;
+	if (!irq->lat_count || lat < irq->lat_min)
+		irq->lat_min = lat;
+	if (lat > irq->lat_max)
+		irq->lat_max = lat;
+	irq->lat_sum += lat;
+	irq->lat_count++;
+}
+
+static void gpio_irq_deliver(struct gpio_irq *irq, uint64_t now)
+{
+	irq->last_us = now;
+	if (irq->masked) {
+		irq->pending = true;
+		irq->held++;
+	} else {
+		gpio_irq_send(irq);
+	}
+}
+
+/* Debounce period or rate limit interval over */
+static void gpio_irq_timer(void *data, uint64_t now)
+{
+	struct gpio_irq *irq = data;
+	int level;
+
+	if (!irq->debounce_us) {
+		gpio_irq_deliver(irq, now);
+		return;
+	}
+
+	level = backend->get_value(irq->which);
+	if (level >= 0) {
+		switch (irq->type) {
+		case GB_GPIO_IRQ_TYPE_EDGE_RISING:
+		case GB_GPIO_IRQ_TYPE_LEVEL_HIGH:
+			if (!level)
+				goto bounce;
+			break;
+		case GB_GPIO_IRQ_TYPE_EDGE_FALLING:
+		case GB_GPIO_IRQ_TYPE_LEVEL_LOW:
+			if (level)
+				goto bounce;
+			break;
+		default:
+			if (level == irq->level)
+				goto bounce;
+			break;
+		}
+		irq->level = level;
+	}
+
+	gpio_irq_deliver(irq, now);
+	return;
+
+bounce:
+	irq->level = level;
+	irq->suppressed++;
+}
+
+/*
+ * Expired timers are moved off the slot before any of them runs, as a
+ * callback may arm or cancel other timers, including ones of the slot.
+ * They stay armed on the expired list until run, so that still works.
+ */
+static void gpio_wheel_run(uint64_t now_us)
+{
+	uint64_t now = now_us / GPIO_WHEEL_TICK_US;
+	struct gpio_timer *expired, *t, *next;
+	struct gpio_timer **slot;
+	int n;
+
+	/* One pass over the slots catches up with any stall */
+	for (n = 0; gpio_wheel_tick <= now && n < GPIO_WHEEL_SLOTS;
+	     n++, gpio_wheel_tick++) {
+		slot = &gpio_wheel[gpio_wheel_tick % GPIO_WHEEL_SLOTS];
+
+		/* Timers armed already due land in this slot, run it again */
+		do {
+			expired = NULL;
+			for (t = *slot; t; t = next) {
+				next = t->next;
+				if (t->expires > now)
+					continue;
+				gpio_timer_unlink(t);
+				gpio_timer_link(t, &expired);
+			}
+			if (!expired)
+				break;
+
+			while ((t = expired)) {
+				gpio_timer_cancel(t);
+				t->fn(t->data, now_us);
+			}
+		} while (1);
+	}
+	gpio_wheel_tick = now + 1;
+}
+
+static void gpio_irq_raise_locked(struct gpio_irq *irq, uint64_t now)
+{
+	if (irq->type == GB_GPIO_IRQ_TYPE_NONE)
+		return;
+
+	irq->events++;
+
+	if (irq->debounce_us) {
+		if (irq->timer.armed)
+			irq->suppressed++;
+		gpio_timer_arm(&irq->timer, now + irq->debounce_us);
+	} else if (irq->timer.armed) {
+		/* An event is already deferred to the end of the interval */
+		irq->suppressed++;
+	} else if (gpio_irq_rate && irq->last_us &&
+		   now - irq->last_us < 1000000 / gpio_irq_rate) {
+		gpio_timer_arm(&irq->timer,
+			       irq->last_us + 1000000 / gpio_irq_rate);
+	} else {
+		gpio_irq_deliver(irq, now);
+	}
+}
+
+/* Called from the backend's event context for an edge on a line */
+static void gpio_irq_raise(struct gpio_irq *irq)
+{
+	pthread_mutex_lock(&gpio_irq_lock);
+	gpio_irq_raise_locked(irq, gpio_now_us());
+	pthread_mutex_unlock(&gpio_irq_lock);
+}
+
+static void gpio_irq_set_type(uint8_t which, uint8_t type,
+			      uint16_t hd_cport_id)
+{
+	struct gpio_irq *irq = &gpio_irqs[which];
+
+	pthread_mutex_lock(&gpio_irq_lock);
+	irq->type = type;
+	irq->hd_cport_id = hd_cport_id;
+	irq->pending = false;
+	gpio_timer_cancel(&irq->timer);
+	memset(&irq->msg, 0, sizeof(irq->msg));
+	irq->msg.gpio_irq_event_req.which = which;
+	pthread_mutex_unlock(&gpio_irq_lock);
+}
+
+static void gpio_irq_mask(uint8_t which, bool masked)
+{
+	struct gpio_irq *irq = &gpio_irqs[which];
+
+	pthread_mutex_lock(&gpio_irq_lock);
+	irq->masked = masked;
+	if (!masked && irq->pending) {
+		irq->pending = false;
+		gpio_irq_send(irq);
+	}
+	pthread_mutex_unlock(&gpio_irq_lock);
+}
+
+/* Prefer the backend's debounce, fall back to debouncing in gpio_thread() */
+static int gpio_set_debounce(uint8_t which, uint16_t usec)
+{
+	struct gpio_irq *irq = &gpio_irqs[which];
+	int level = backend->get_value(which);
+
+	if (backend->set_debounce && !backend->set_debounce(which, usec))
+		usec = 0;
+
+	pthread_mutex_lock(&gpio_irq_lock);
+	irq->debounce_us = usec;
+	irq->level = level;
+	if (!usec)
+		gpio_timer_cancel(&irq->timer);
+	pthread_mutex_unlock(&gpio_irq_lock);
+
+	return 0;
+}
+
+static int int_event_callback(void *args)
+{
+	gpio_irq_raise(args);
 	return EXIT_SUCCESS;
 }
 
+/* Drive a simulated line, an edge matching its IRQ type raises it */
+static void sim_drive(uint8_t which, uint8_t level, uint64_t now)
+{
+	struct gpio_irq *irq = &gpio_irqs[which];
+	uint8_t edge;
+
+	if (gb_gpios[which].value == level)
+		return;
+	gb_gpios[which].value = level;
+
+	edge = level ? GB_GPIO_IRQ_TYPE_EDGE_RISING | GB_GPIO_IRQ_TYPE_LEVEL_HIGH :
+		       GB_GPIO_IRQ_TYPE_EDGE_FALLING | GB_GPIO_IRQ_TYPE_LEVEL_LOW;
+	if (!(irq->type & edge))
+		return;
+
+	if (!irq->stim_us)
+		irq->stim_us = now;
+	gpio_irq_raise_locked(irq, now);
+}
+
+static void sim_output(uint8_t which, uint8_t level)
+{
+	int loop = sim_lines[which].loop;
+
+	pthread_mutex_lock(&gpio_irq_lock);
+	gb_gpios[which].value = level;
+	if (loop >= 0 && gb_gpios[loop].direction)
+		sim_drive(loop, level, gpio_now_us());
+	pthread_mutex_unlock(&gpio_irq_lock);
+}
+
+/* Stimulus timer: next edge of a toggle pattern */
+static void sim_timer(void *data, uint64_t now)
+{
+	struct gpio_sim_line *sim = data;
+	uint8_t which = sim - sim_lines;
+
+	sim_drive(which, !gb_gpios[which].value, now);
+	if (!--sim->edges_left)
+		return;
+
+	/* Scheduled from the previous edge, so the pattern does not drift */
+	sim->next_us += sim->period_us;
+	gpio_timer_arm(&sim->timer, sim->next_us);
+}
+
+static int sim_get_direction(uint8_t which)
+{
+	return gb_gpios[which].direction;
+}
+
+static int sim_direction_in(uint8_t which)
+{
+	gb_gpios[which].direction = 1;
+	return 0;
+}
+
+static int sim_direction_out(uint8_t which, uint8_t value)
+{
+	gb_gpios[which].direction = 0;
+	sim_output(which, !!value);
+	return 0;
+}
+
+static int sim_get_value(uint8_t which)
+{
+	return gb_gpios[which].value;
+}
+
+static int sim_set_value(uint8_t which, uint8_t value)
+{
+	if (!gb_gpios[which].direction)
+		sim_output(which, !!value);
+	return 0;
+}
+
+static int sim_irq_type(uint8_t which, uint8_t type)
+{
+	gb_gpios[which].direction = 1;
+	return 0;
+}
+
+static const struct gpio_backend sim_backend = {
+	.name		= "sim",
+	.get_direction	= sim_get_direction,
+	.direction_in	= sim_direction_in,
+	.direction_out	= sim_direction_out,
+	.get_value	= sim_get_value,
+	.set_value	= sim_set_value,
+	.irq_type	= sim_irq_type,
+};
+
+static int libsoc_get_direction(uint8_t which)
+{
+	return libsoc_gpio_get_direction(gpios[which]);
+}
+
+static int libsoc_direction_in(uint8_t which)
+{
+	libsoc_gpio_set_direction(gpios[which], INPUT);
+	return 0;
+}
+
+static int libsoc_direction_out(uint8_t which, uint8_t value)
+{
+	libsoc_gpio_set_direction(gpios[which], OUTPUT);
+	return 0;
+}
+
+static int libsoc_get_value(uint8_t which)
+{
+	return libsoc_gpio_get_level(gpios[which]);
+}
+
+static int libsoc_set_value(uint8_t which, uint8_t value)
+{
+	libsoc_gpio_set_level(gpios[which], value);
+	return 0;
+}
+
+static int libsoc_irq_type(uint8_t which, uint8_t type)
+{
+	libsoc_gpio_set_direction(gpios[which], INPUT);
+	if (type == GB_GPIO_IRQ_TYPE_EDGE_RISING)
+		libsoc_gpio_set_edge(gpios[which], RISING);
+	else if (type == GB_GPIO_IRQ_TYPE_EDGE_FALLING)
+		libsoc_gpio_set_edge(gpios[which], FALLING);
+	else if (type == GB_GPIO_IRQ_TYPE_EDGE_BOTH)
+		libsoc_gpio_set_edge(gpios[which], BOTH);
+	libsoc_gpio_callback_interrupt(gpios[which], &int_event_callback,
+				       &gpio_irqs[which]);
+	return 0;
+}
+
+static const struct gpio_backend libsoc_backend = {
+	.name		= "libsoc",
+	.get_direction	= libsoc_get_direction,
+	.direction_in	= libsoc_direction_in,
+	.direction_out	= libsoc_direction_out,
+	.get_value	= libsoc_get_value,
+	.set_value	= libsoc_set_value,
+	.irq_type	= libsoc_irq_type,
+};
+
+/* Push the cached flags, output value and debounce period to the line */
+static int cdev_line_config(uint8_t which)
+{
+	struct gpio_cdev_line *line = &cdev_lines[which];
+	struct gpio_v2_line_config config;
+	int n = 0;
+
+	memset(&config, 0, sizeof(config));
+	config.flags = line->flags;
+
+	if (line->flags & GPIO_V2_LINE_FLAG_OUTPUT) {
+		config.attrs[n].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+		config.attrs[n].attr.values = line->value;
+		config.attrs[n].mask = 1;
+		n++;
+	} else if (line->debounce_us) {
+		config.attrs[n].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+		config.attrs[n].attr.debounce_period_us = line->debounce_us;
+		config.attrs[n].mask = 1;
+		n++;
+	}
+	config.num_attrs = n;
+
+	if (ioctl(line->fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &config) < 0) {
+		gbsim_error("GPIO %d set config failed: %s\n", which,
+			    strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int cdev_line_request(uint8_t which, unsigned int gpio_num)
+{
+	struct gpio_cdev_line *line = &cdev_lines[which];
+	struct gpio_v2_line_request req;
+	unsigned int chip = gpio_num / GPIO_CHIP_LINES;
+	char path[32];
+
+	if (chip >= GPIO_MAX_CHIPS)
+		return -EINVAL;
+
+	if (cdev_chips[chip] < 0) {
+		snprintf(path, sizeof(path), "/dev/gpiochip%u", chip);
+		cdev_chips[chip] = open(path, O_RDWR | O_CLOEXEC);
+		if (cdev_chips[chip] < 0) {
+			gbsim_error("failed opening %s\n", path);
+			return -errno;
+		}
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.offsets[0] = gpio_num % GPIO_CHIP_LINES;
+	req.num_lines = 1;
+	req.config.flags = GPIO_V2_LINE_FLAG_INPUT;
+	req.event_buffer_size = GPIO_EVENT_BATCH;
+	snprintf(req.consumer, sizeof(req.consumer), "gbsim");
+
+	if (ioctl(cdev_chips[chip], GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+		gbsim_error("failed requesting gpiochip%u line %u: %s\n",
+			    chip, req.offsets[0], strerror(errno));
+		return -errno;
+	}
+
+	line->fd = req.fd;
+	line->flags = req.config.flags;
+
+	return 0;
+}
+
+static int cdev_get_direction(uint8_t which)
+{
+	return !(cdev_lines[which].flags & GPIO_V2_LINE_FLAG_OUTPUT);
+}
+
+static int cdev_direction_in(uint8_t which)
+{
+	struct gpio_cdev_line *line = &cdev_lines[which];
+
+	line->flags &= ~GPIO_V2_LINE_FLAG_OUTPUT;
+	line->flags |= GPIO_V2_LINE_FLAG_INPUT;
+	return cdev_line_config(which);
+}
+
+static int cdev_direction_out(uint8_t which, uint8_t value)
+{
+	struct gpio_cdev_line *line = &cdev_lines[which];
+
+	/* Edge detection is only valid on inputs */
+	line->flags &= ~(GPIO_V2_LINE_FLAG_INPUT |
+			 GPIO_V2_LINE_FLAG_EDGE_RISING |
+			 GPIO_V2_LINE_FLAG_EDGE_FALLING);
+	line->flags |= GPIO_V2_LINE_FLAG_OUTPUT;
+	line->value = !!value;
+	return cdev_line_config(which);
+}
+
+static int cdev_get_value(uint8_t which)
+{
+	struct gpio_v2_line_values values = { .mask = 1 };
+
+	if (ioctl(cdev_lines[which].fd, GPIO_V2_LINE_GET_VALUES_IOCTL,
+		  &values) < 0)
+		return -errno;
+
+	return values.bits & 1;
+}
+
+static int cdev_set_value(uint8_t which, uint8_t value)
+{
+	struct gpio_v2_line_values values = { .mask = 1, .bits = !!value };
+
+	cdev_lines[which].value = !!value;
+	if (!(cdev_lines[which].flags & GPIO_V2_LINE_FLAG_OUTPUT))
+		return 0;
+
+	if (ioctl(cdev_lines[which].fd, GPIO_V2_LINE_SET_VALUES_IOCTL,
+		  &values) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int cdev_set_debounce(uint8_t which, uint16_t usec)
+{
+	cdev_lines[which].debounce_us = usec;
+	if (cdev_lines[which].flags & GPIO_V2_LINE_FLAG_OUTPUT)
+		return 0;
+
+	return cdev_line_config(which);
+}
+
+/* Level types are approximated by the edge entering the level */
+static int cdev_irq_type(uint8_t which, uint8_t type)
+{
+	struct gpio_cdev_line *line = &cdev_lines[which];
+
+	line->flags &= ~(GPIO_V2_LINE_FLAG_OUTPUT |
+			 GPIO_V2_LINE_FLAG_EDGE_RISING |
+			 GPIO_V2_LINE_FLAG_EDGE_FALLING);
+	line->flags |= GPIO_V2_LINE_FLAG_INPUT;
+
+	if (type & (GB_GPIO_IRQ_TYPE_EDGE_RISING | GB_GPIO_IRQ_TYPE_LEVEL_HIGH))
+		line->flags |= GPIO_V2_LINE_FLAG_EDGE_RISING;
+	if (type & (GB_GPIO_IRQ_TYPE_EDGE_FALLING | GB_GPIO_IRQ_TYPE_LEVEL_LOW))
+		line->flags |= GPIO_V2_LINE_FLAG_EDGE_FALLING;
+
+	return cdev_line_config(which);
+}
+
+static const struct gpio_backend cdev_backend = {
+	.name		= "cdev",
+	.get_direction	= cdev_get_direction,
+	.direction_in	= cdev_direction_in,
+	.direction_out	= cdev_direction_out,
+	.get_value	= cdev_get_value,
+	.set_value	= cdev_set_value,
+	.set_debounce	= cdev_set_debounce,
+	.irq_type	= cdev_irq_type,
+};
+
+static int cdev_line_events(uint8_t which)
+{
+	struct gpio_v2_line_event ev[GPIO_EVENT_BATCH];
+	struct timespec now;
+	uint64_t now_ns;
+	ssize_t nbytes;
+	int i;
+
+	nbytes = read(cdev_lines[which].fd, ev, sizeof(ev));
+	if (nbytes < 0)
+		return errno == EAGAIN ? 0 : -errno;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	for (i = 0; i < nbytes / sizeof(ev[0]); i++) {
+		/* Stamped by the kernel's interrupt handler */
+		gbsim_debug("GPIO %d %s edge seqno %u, %llu us after the edge\n",
+			    which,
+			    ev[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE ?
+			    "rising" : "falling", ev[i].line_seqno,
+			    (unsigned long long)(now_ns - ev[i].timestamp_ns) /
+			    1000);
+		gpio_irq_raise(&gpio_irqs[which]);
+	}
+
+	return 0;
+}
+
+static int sim_parse_line(char **save, bool input)
+{
+	char *tok = strtok_r(NULL, " \t\r\n", save);
+	unsigned long which;
+
+	if (!tok)
+		return -1;
+	which = strtoul(tok, NULL, 0);
+	if (which >= gpio_count || which >= GPIO_MAX_LINES)
+		return -1;
+	if (input && !gb_gpios[which].direction)
+		return -1;
+
+	return which;
+}
+
+/*
+ * One stimulus command, the reply goes to the client:
+ *   set LINE 0|1		drive an input
+ *   pulse LINE USEC		invert an input for USEC
+ *   toggle LINE HZ COUNT	COUNT edges at HZ edges per second, 0 stops
+ *   loop OUT IN|off		drive input IN from output OUT
+ *   get LINE			read a line
+ *   stats			edge to IRQ event latency per line
+ */
+static void sim_command(int fd, char *line)
+{
+	struct gpio_sim_line *sim;
+	struct gpio_irq *irq;
+	char reply[GPIO_SIM_MAXLINE];
+	char *cmd, *tok, *save;
+	unsigned long hz;
+	uint64_t now;
+	int which, in, i, len;
+
+	cmd = strtok_r(line, " \t\r\n", &save);
+	if (!cmd)
+		return;
+
+	pthread_mutex_lock(&gpio_irq_lock);
+	now = gpio_now_us();
+	snprintf(reply, sizeof(reply), "ok\n");
+
+	if (!strcmp(cmd, "set")) {
+		which = sim_parse_line(&save, true);
+		tok = strtok_r(NULL, " \t\r\n", &save);
+		if (which < 0 || !tok)
+			goto bad;
+		sim_drive(which, !!strtoul(tok, NULL, 0), now);
+	} else if (!strcmp(cmd, "pulse") || !strcmp(cmd, "toggle")) {
+		which = sim_parse_line(&save, true);
+		tok = strtok_r(NULL, " \t\r\n", &save);
+		if (which < 0 || !tok)
+			goto bad;
+		sim = &sim_lines[which];
+		if (!strcmp(cmd, "pulse")) {
+			sim->period_us = strtoull(tok, NULL, 0);
+			sim->edges_left = 1;
+		} else {
+			hz = strtoul(tok, NULL, 0);
+			tok = strtok_r(NULL, " \t\r\n", &save);
+			/* Above 1 MHz the period would round to 0 us */
+			if (!hz || hz > 1000000 || !tok)
+				goto bad;
+			sim->period_us = 1000000 / hz;
+			sim->edges_left = strtoul(tok, NULL, 0);
+			if (!sim->edges_left) {
+				gpio_timer_cancel(&sim->timer);
+				goto out;
+			}
+			sim->edges_left--;
+		}
+		sim_drive(which, !gb_gpios[which].value, now);
+		if (sim->edges_left) {
+			sim->next_us = now + sim->period_us;
+			gpio_timer_arm(&sim->timer, sim->next_us);
+		} else {
+			gpio_timer_cancel(&sim->timer);
+		}
+	} else if (!strcmp(cmd, "loop")) {
+		which = sim_parse_line(&save, false);
+		tok = strtok_r(NULL, " \t\r\n", &save);
+		if (which < 0 || !tok)
+			goto bad;
+		if (!strcmp(tok, "off")) {
+			sim_lines[which].loop = -1;
+			goto out;
+		}
+		in = strtoul(tok, NULL, 0);
+		if (in >= gpio_count || in >= GPIO_MAX_LINES || in == which)
+			goto bad;
+		sim_lines[which].loop = in;
+	} else if (!strcmp(cmd, "get")) {
+		which = sim_parse_line(&save, false);
+		if (which < 0)
+			goto bad;
+		snprintf(reply, sizeof(reply), "%d\n", gb_gpios[which].value);
+	} else if (!strcmp(cmd, "stats")) {
+		len = 0;
+		for (i = 0; i < gpio_count && i < GPIO_MAX_LINES; i++) {
+			irq = &gpio_irqs[i];
+			if (!irq->lat_count)
+				continue;
+			len += snprintf(reply + len, sizeof(reply) - len,
+					"%d %lu %llu %llu %llu\n", i,
+					irq->lat_count,
+					(unsigned long long)irq->lat_min,
+					(unsigned long long)(irq->lat_sum /
+							     irq->lat_count),
+					(unsigned long long)irq->lat_max);
+			if (len >= sizeof(reply))
+				break;
+		}
+		if (!len)
+			snprintf(reply, sizeof(reply), "none\n");
+	} else {
+		goto bad;
+	}
+	goto out;
+
+bad:
+	snprintf(reply, sizeof(reply), "error\n");
+out:
+	pthread_mutex_unlock(&gpio_irq_lock);
+	if (write(fd, reply, strlen(reply)) < 0)
+		gbsim_debug("GPIO stimulus reply failed %d\n", errno);
+}
+
+static void sim_client_read(struct gpio_sim_client *client)
+{
+	ssize_t nbytes;
+	char *nl;
+
+	nbytes = read(client->fd, client->buf + client->len,
+		      sizeof(client->buf) - client->len - 1);
+	if (nbytes <= 0) {
+		close(client->fd);
+		client->fd = -1;
+		client->len = 0;
+		return;
+	}
+	client->len += nbytes;
+	client->buf[client->len] = '\0';
+
+	while ((nl = strchr(client->buf, '\n'))) {
+		*nl++ = '\0';
+		sim_command(client->fd, client->buf);
+		client->len -= nl - client->buf;
+		memmove(client->buf, nl, client->len + 1);
+	}
+
+	/* Drop a line too long to be a command */
+	if (client->len == sizeof(client->buf) - 1)
+		client->len = 0;
+}
+
+static void sim_client_accept(void)
+{
+	int fd, i;
+
+	fd = accept(gpio_sim_sock, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	for (i = 0; i < GPIO_SIM_CLIENTS; i++) {
+		if (sim_clients[i].fd < 0) {
+			sim_clients[i].fd = fd;
+			sim_clients[i].len = 0;
+			return;
+		}
+	}
+
+	gbsim_error("too many GPIO stimulus clients\n");
+	close(fd);
+}
+
+static void sim_init(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int i;
+
+	for (i = 0; i < GPIO_MAX_LINES; i++) {
+		sim_lines[i].loop = -1;
+		sim_lines[i].timer.fn = sim_timer;
+		sim_lines[i].timer.data = &sim_lines[i];
+	}
+	for (i = 0; i < GPIO_SIM_CLIENTS; i++)
+		sim_clients[i].fd = -1;
+
+	if (snprintf(gpio_sim_path, sizeof(gpio_sim_path), "%s/gpio",
+		     hotplug_basedir) >= sizeof(addr.sun_path)) {
+		gbsim_error("GPIO stimulus socket path %s/gpio too long\n",
+			    hotplug_basedir);
+		return;
+	}
+	memcpy(addr.sun_path, gpio_sim_path, strlen(gpio_sim_path) + 1);
+	unlink(gpio_sim_path);
+
+	gpio_sim_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (gpio_sim_sock < 0 ||
+	    bind(gpio_sim_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(gpio_sim_sock, GPIO_SIM_CLIENTS) < 0) {
+		gbsim_error("cannot create GPIO stimulus socket %s errno=%d\n",
+			    gpio_sim_path, errno);
+		if (gpio_sim_sock >= 0)
+			close(gpio_sim_sock);
+		gpio_sim_sock = -1;
+		return;
+	}
+
+	gbsim_info("GPIO stimulus socket %s\n", gpio_sim_path);
+}
+
+/* Reads cdev line events and stimulus commands, runs the timer wheel */
+static void *gpio_thread(void *param)
+{
+	struct pollfd fds[2 + GPIO_SIM_CLIENTS + GPIO_MAX_LINES];
+	int which[2 + GPIO_SIM_CLIENTS + GPIO_MAX_LINES];
+	char buf[16];
+	int i, n, ret, timeout;
+
+	while (1) {
+		/* Signal pipe, stimulus socket and clients, cdev lines */
+		n = 0;
+		fds[n].fd = gpio_sig_pipe[0];
+		fds[n++].events = POLLIN;
+		if (gpio_sim_sock >= 0) {
+			which[n] = -1;
+			fds[n].fd = gpio_sim_sock;
+			fds[n++].events = POLLIN;
+		}
+		for (i = 0; i < GPIO_SIM_CLIENTS; i++) {
+			if (sim_clients[i].fd < 0)
+				continue;
+			which[n] = -2 - i;
+			fds[n].fd = sim_clients[i].fd;
+			fds[n++].events = POLLIN;
+		}
+		for (i = 0; i < GPIO_MAX_LINES; i++) {
+			if (cdev_lines[i].fd < 0)
+				continue;
+			which[n] = i;
+			fds[n].fd = cdev_lines[i].fd;
+			fds[n++].events = POLLIN;
+		}
+
+		pthread_mutex_lock(&gpio_irq_lock);
+		timeout = gpio_timers_armed ? GPIO_WHEEL_TICK_US / 1000 : -1;
+		pthread_mutex_unlock(&gpio_irq_lock);
+
+		ret = poll(fds, n, timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			gbsim_error("%s : poll errno=%d\n", __func__, errno);
+			break;
+		}
+
+		if (fds[0].revents) {
+			while (read(gpio_sig_pipe[0], buf, sizeof(buf)) > 0)
+				;
+			if (gpio_thread_exit)
+				break;
+		}
+
+		for (i = 1; i < n; i++) {
+			if (!fds[i].revents)
+				continue;
+			if (which[i] == -1)
+				sim_client_accept();
+			else if (which[i] < -1)
+				sim_client_read(&sim_clients[-2 - which[i]]);
+			else if (cdev_line_events(which[i]) < 0)
+				gbsim_error("GPIO %d event read failed\n",
+					    which[i]);
+		}
+
+		pthread_mutex_lock(&gpio_irq_lock);
+		gpio_wheel_run(gpio_now_us());
+		pthread_mutex_unlock(&gpio_irq_lock);
+	}
+
+	gbsim_info("GPIO thread exit\n");
+	return NULL;
+}
+
 int gpio_handler(struct gbsim_connection *connection, void *rbuf,
 		 size_t rsize, void *tbuf, size_t tsize)
 {
@@ -63,11 +1047,25 @@ int gpio_handler(struct gbsim_connection *connection, void *rbuf,
 	ssize_t nbytes;
 	uint16_t message_size;
 	uint16_t hd_cport_id = connection->hd_cport_id;
+	uint8_t result = GB_OP_SUCCESS;
 	uint8_t which = 0;
+	int ret = 0;
 
 	op_rsp = (struct op_msg *)tbuf;
 	oph = (struct gb_operation_msg_hdr *)&op_req->header;
 
+	/* Every request but LINE_COUNT starts with the line number */
+	if (oph->type != GB_GPIO_TYPE_LINE_COUNT &&
+	    oph->type != GB_REQUEST_TYPE_CPORT_SHUTDOWN) {
+		which = op_req->gpio_act_req.which;
+		if (which >= gpio_count || which >= GPIO_MAX_LINES) {
+			gbsim_error("GPIO %d out of range\n", which);
+			payload_size = 0;
+			result = GB_OP_INVALID;
+			goto out;
+		}
+	}
+
 	switch (oph->type) {
 	case GB_GPIO_TYPE_LINE_COUNT:
 		payload_size = sizeof(struct gb_gpio_line_count_response);
@@ -75,95 +1073,73 @@ int gpio_handler(struct gbsim_connection *connection, void *rbuf,
 		break;
 	case GB_GPIO_TYPE_ACTIVATE:
 		payload_size = 0;
-		which = op_req->gpio_act_req.which;
 		gbsim_debug("GPIO %d activate request\n", which);
 		gb_gpios[which].activated = 1;
 		break;
 	case GB_GPIO_TYPE_DEACTIVATE:
 		payload_size = 0;
-		which = op_req->gpio_deact_req.which;
 		gbsim_debug("GPIO %d deactivate request\n", which);
 		gb_gpios[which].activated = 0;
 		break;
 	case GB_GPIO_TYPE_GET_DIRECTION:
 		payload_size = sizeof(struct gb_gpio_get_direction_response);
-		which = op_req->gpio_get_dir_req.which;
-		if (bbb_backend)
-			op_rsp->gpio_get_dir_rsp.direction = libsoc_gpio_get_direction(gpios[which]);
-		else
-			op_rsp->gpio_get_dir_rsp.direction = gb_gpios[which].direction;
+		ret = backend->get_direction(which);
+		op_rsp->gpio_get_dir_rsp.direction = ret;
 		gbsim_debug("GPIO %d get direction (%d) response\n",
 			    which, op_rsp->gpio_get_dir_rsp.direction);
 		break;
 	case GB_GPIO_TYPE_DIRECTION_IN:
 		payload_size = 0;
-		which = op_req->gpio_dir_input_req.which;
 		gbsim_debug("GPIO %d direction input request\n", which);
-		if (bbb_backend)
-			libsoc_gpio_set_direction(gpios[which], INPUT);
-		else
-			gb_gpios[which].direction = 1;
+		ret = backend->direction_in(which);
 		break;
 	case GB_GPIO_TYPE_DIRECTION_OUT:
 		payload_size = 0;
-		which = op_req->gpio_dir_output_req.which;
 		gbsim_debug("GPIO %d direction output request\n", which);
-		if (bbb_backend)
-			libsoc_gpio_set_direction(gpios[which], OUTPUT);
-		else
-			gb_gpios[which].direction = 0;
+		ret = backend->direction_out(which,
+					     op_req->gpio_dir_output_req.value);
 		break;
 	case GB_GPIO_TYPE_GET_VALUE:
 		payload_size = sizeof(struct gb_gpio_get_value_response);
-		which = op_req->gpio_get_val_req.which;
-		if (bbb_backend)
-			op_rsp->gpio_get_val_rsp.value = libsoc_gpio_get_level(gpios[which]);
-		else
-			op_rsp->gpio_get_val_rsp.value = gb_gpios[which].value;
+		ret = backend->get_value(which);
+		op_rsp->gpio_get_val_rsp.value = ret;
 		gbsim_debug("GPIO %d get value (%d) response\n  ",
 			    which, op_rsp->gpio_get_val_rsp.value);
 		break;
 	case GB_GPIO_TYPE_SET_VALUE:
 		payload_size = 0;
-		which = op_req->gpio_set_val_req.which;
 		gbsim_debug("GPIO %d set value (%d) request\n  ",
 			    which, op_req->gpio_set_val_req.value);
-		if (bbb_backend)
-			libsoc_gpio_set_level(gpios[which], op_req->gpio_set_val_req.value);
+		if (backend->set_value)
+			ret = backend->set_value(which,
+						 op_req->gpio_set_val_req.value);
 		break;
 	case GB_GPIO_TYPE_SET_DEBOUNCE:
 		payload_size = 0;
 		gbsim_debug("GPIO %d set debounce (%d us) request\n  ",
-			    op_req->gpio_set_db_req.which, op_req->gpio_set_db_req.usec);
+			    which, le16toh(op_req->gpio_set_db_req.usec));
+		ret = gpio_set_debounce(which,
+					le16toh(op_req->gpio_set_db_req.usec));
 		break;
 	case GB_GPIO_TYPE_IRQ_TYPE:
 		payload_size = 0;
-		which = op_req->gpio_irq_type_req.which;
 		gbsim_debug("GPIO %d set IRQ type %d request\n  ",
 			    which, op_req->gpio_irq_type_req.type);
-		gb_gpios[which].irq_type = op_req->gpio_irq_type_req.type;
-		if(bbb_backend) {
-			libsoc_gpio_set_direction(gpios[which], INPUT);
-			if(gb_gpios[which].irq_type == GB_GPIO_IRQ_TYPE_EDGE_RISING)
-				libsoc_gpio_set_edge(gpios[which], RISING);
-			else if(gb_gpios[which].irq_type == GB_GPIO_IRQ_TYPE_EDGE_FALLING)
-				libsoc_gpio_set_edge(gpios[which], FALLING);
-			else if(gb_gpios[which].irq_type == GB_GPIO_IRQ_TYPE_EDGE_BOTH)
-				libsoc_gpio_set_edge(gpios[which], BOTH);
-			current_which=which;
-			current_hd_cport_id=hd_cport_id;
-			libsoc_gpio_callback_interrupt(gpios[which], &int_event_callback, NULL);
-		}
+		gpio_irq_set_type(which, op_req->gpio_irq_type_req.type,
+				  hd_cport_id);
+		if (backend->irq_type)
+			ret = backend->irq_type(which,
+						op_req->gpio_irq_type_req.type);
 		break;
 	case GB_GPIO_TYPE_IRQ_MASK:
 		payload_size = 0;
-		which = op_req->gpio_irq_mask_req.which;
-		gb_gpios[which].irq_unmasked = 0;
+		gbsim_debug("GPIO %d IRQ mask request\n", which);
+		gpio_irq_mask(which, true);
 		break;
 	case GB_GPIO_TYPE_IRQ_UNMASK:
 		payload_size = 0;
-		which = op_req->gpio_irq_unmask_req.which;
-		gb_gpios[which].irq_unmasked = 1;
+		gbsim_debug("GPIO %d IRQ unmask request\n", which);
+		gpio_irq_mask(which, false);
 		break;
 	case GB_REQUEST_TYPE_CPORT_SHUTDOWN:
 		payload_size = 0;
@@ -172,10 +1148,17 @@ int gpio_handler(struct gbsim_connection *connection, void *rbuf,
 		return -EINVAL;
 	}
 
+	if (ret < 0) {
+		gbsim_error("GPIO %d %s failed: %s\n", which, backend->name,
+			    strerror(-ret));
+		payload_size = 0;
+		result = GB_OP_UNKNOWN_ERROR;
+	}
+
+out:
 	message_size = sizeof(struct gb_operation_msg_hdr) + payload_size;
 	nbytes = send_response(hd_cport_id, op_rsp, message_size,
-				oph->operation_id, oph->type,
-				PROTOCOL_STATUS_SUCCESS);
+				oph->operation_id, oph->type, result);
 	if (nbytes)
 		return nbytes;
 	return 0;
@@ -221,11 +1204,92 @@ char *gpio_get_operation(uint8_t type)
 
 void gpio_cleanup(void)
 {
+	struct gpio_irq *irq;
 	int i;
 
+	if (gpio_thread_started) {
+		/* signal termination */
+		gpio_thread_exit = true;
+		gpio_thread_wake();
+		pthread_join(gpio_pthread, NULL);
+		gpio_thread_started = false;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (gpio_sig_pipe[i] != -1)
+			close(gpio_sig_pipe[i]);
+		gpio_sig_pipe[i] = -1;
+	}
+
+	for (i = 0; i < GPIO_MAX_LINES; i++) {
+		if (cdev_lines[i].fd >= 0)
+			close(cdev_lines[i].fd);
+		cdev_lines[i].fd = -1;
+	}
+
+	for (i = 0; i < GPIO_SIM_CLIENTS; i++) {
+		if (sim_clients[i].fd >= 0)
+			close(sim_clients[i].fd);
+		sim_clients[i].fd = -1;
+	}
+	if (gpio_sim_sock >= 0) {
+		close(gpio_sim_sock);
+		unlink(gpio_sim_path);
+		gpio_sim_sock = -1;
+	}
+
+	for (i = 0; i < GPIO_MAX_CHIPS; i++) {
+		if (cdev_chips[i] >= 0)
+			close(cdev_chips[i]);
+		cdev_chips[i] = -1;
+	}
+
 	for(i=0;i<12;i++)
 		if(gpios[i])
 			libsoc_gpio_free(gpios[i]);
+
+	for (i = 0; i < GPIO_MAX_LINES; i++) {
+		irq = &gpio_irqs[i];
+		if (irq->events)
+			gbsim_info("GPIO %d %lu IRQ events, %lu suppressed, %lu held while masked\n",
+				   i, irq->events, irq->suppressed, irq->held);
+		if (irq->lat_count)
+			gbsim_info("GPIO %d edge to IRQ event latency min %llu avg %llu max %llu us\n",
+				   i, (unsigned long long)irq->lat_min,
+				   (unsigned long long)(irq->lat_sum /
+							irq->lat_count),
+				   (unsigned long long)irq->lat_max);
+	}
+}
+
+static void gpio_thread_init(void)
+{
+	int ret, i;
+
+	ret = pipe(gpio_sig_pipe);
+	if (ret < 0) {
+		gbsim_error("failed creating GPIO signal pipe\n");
+		return;
+	}
+	for (i = 0; i < 2; i++)
+		fcntl(gpio_sig_pipe[i], F_SETFL, O_NONBLOCK);
+
+	gpio_wheel_tick = gpio_now_us() / GPIO_WHEEL_TICK_US;
+
+	ret = pthread_create(&gpio_pthread, NULL, gpio_thread, NULL);
+	if (ret) {
+		gbsim_error("failed creating GPIO thread\n");
+		return;
+	}
+	gpio_thread_started = true;
+}
+
+static void gpio_line_request(uint8_t which, unsigned int gpio_num)
+{
+	if (gpio_cdev)
+		cdev_line_request(which, gpio_num);
+	else
+		gpios[which] = libsoc_gpio_request(gpio_num, LS_GPIO_SHARED);
 }
 
 void gpio_init(void)
@@ -233,22 +1297,37 @@ void gpio_init(void)
 	int i;
 	char platform[60];
 
-	if (bbb_backend) {
+	for (i = 0; i < GPIO_MAX_LINES; i++) {
+		cdev_lines[i].fd = -1;
+		gpio_irqs[i].which = i;
+		gpio_irqs[i].masked = true;
+		gpio_irqs[i].timer.fn = gpio_irq_timer;
+		gpio_irqs[i].timer.data = &gpio_irqs[i];
+	}
+
+	if (gpio_sim || !bbb_backend) {
+		backend = &sim_backend;
+		sim_init();
+	} else {
 		FILE* modelfile;
-		modelfile = fopen("/proc/device-tree/model","r");		 
+
+		backend = gpio_cdev ? &cdev_backend : &libsoc_backend;
+		modelfile = fopen("/proc/device-tree/model","r");
 		fscanf (modelfile,"%s",platform);
 		if(strcmp(platform,"TI AM335x PocketBeagle")!=0)
-		{	
+		{
 			gbsim_debug("Initalizing PocketBeagle GPIOs \n");
 			for (i=0; i<6; i++)
-			gpios[i] = libsoc_gpio_request(mikrobus_gpios[i], LS_GPIO_SHARED);
+			gpio_line_request(i, mikrobus_gpios[i]);
 		}
 		else
 		{
 			gbsim_debug("Initalizing Beaglebone Black GPIOs \n");
 			gpio_count=11;
 			for (i=6; i<18; i++)
-			gpios[i-6] = libsoc_gpio_request(mikrobus_gpios[i], LS_GPIO_SHARED);
+			gpio_line_request(i-6, mikrobus_gpios[i]);
 		}
 	}
-}
\ No newline at end of file
+
+	gpio_thread_init();
+}
@@ -8,6 +8,7 @@
  * Provided under the three clause BSD license found in the LICENSE file.
  */
 
+#include <ctype.h>
 #include <fcntl.h>
 #include <linux/fs.h>
 #include <linux/i2c.h>
@@ -15,15 +16,934 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 
 #include "gbsim.h"
 
+#define I2C_MAX_ADDR		128
+#define I2C_MAXLINE		256
+
 static __u8 data_byte;
 static int ifd;
+static struct i2c_msg i2c_msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+
+/*
+ * Submit all ops of a Greybus transfer as one combined I2C_RDWR
+ * transaction, ops are joined by repeated STARTs and a single STOP ends
+ * the transfer, as the AP's i2c_transfer() intends.
+ */
+static uint8_t i2c_rdwr_xfer(struct gb_i2c_transfer_op *ops, int op_count,
+			     __u8 *write_data, __u8 *read_data)
+{
+	struct i2c_rdwr_ioctl_data rdwr = {
+		.msgs = i2c_msgs,
+		.nmsgs = op_count,
+	};
+	struct i2c_msg *msg;
+	int i;
+
+	for (i = 0; i < op_count; i++) {
+		msg = &i2c_msgs[i];
+		msg->addr = le16toh(ops[i].addr);
+		msg->flags = le16toh(ops[i].flags);
+		msg->len = le16toh(ops[i].size);
+		if (msg->flags & I2C_M_RD) {
+			msg->buf = read_data;
+			read_data += msg->len;
+		} else {
+			msg->buf = write_data;
+			write_data += msg->len;
+		}
+	}
+
+	if (ioctl(ifd, I2C_RDWR, &rdwr) < 0) {
+		gbsim_error("i2c transfer of %d ops to 0x%02x failed: %s\n",
+			    op_count, i2c_msgs[0].addr, strerror(errno));
+		return gbsim_errno_to_result(errno);
+	}
+
+	return GB_OP_SUCCESS;
+}
+
+/*
+ * Slave addresses answered by the simulated devices of -I, all models run
+ * at memory speed. An address without a device NAKs.
+ */
+struct i2c_dev;
+
+struct i2c_model {
+	const char	*name;
+	int	(*open)(struct i2c_dev *dev, const char *arg);
+	void	(*close)(struct i2c_dev *dev);
+	/* Return 0, or -ENXIO to NAK the op */
+	int	(*write)(struct i2c_dev *dev, uint8_t addr, uint8_t *buf,
+			 size_t len);
+	int	(*read)(struct i2c_dev *dev, uint8_t addr, uint8_t *buf,
+			size_t len);
+	/* STOP condition at the end of a transfer addressing the device */
+	void	(*stop)(struct i2c_dev *dev);
+};
+
+struct i2c_dev {
+	uint8_t	addr;
+	uint8_t	naddr;
+	bool	active;
+	const struct i2c_model *model;
+	void	*priv;
+	char	arg[I2C_MAXLINE];
+	char	*opts[CONF_MAX_OPTS];
+	int	num_opts;
+};
+
+static struct i2c_dev *i2c_devs[I2C_MAX_ADDR];
+static int i2c_num_devs;
+
+/* 24Cxx geometry, as the AP's at24 driver knows the parts */
+struct at24_chip {
+	const char	*name;
+	size_t		size;
+	size_t		page;
+	int		addrlen;
+};
+
+static const struct at24_chip at24_chips[] = {
+	{ "24c01",	128,	8,	1 },
+	{ "24c02",	256,	8,	1 },
+	{ "24c04",	512,	16,	1 },
+	{ "24c08",	1024,	16,	1 },
+	{ "24c16",	2048,	16,	1 },
+	{ "24c32",	4096,	32,	2 },
+	{ "24c64",	8192,	32,	2 },
+	{ "24c128",	16384,	64,	2 },
+	{ "24c256",	32768,	64,	2 },
+	{ "24c512",	65536,	128,	2 },
+};
+
+/*
+ * Parts with one address byte and more than 256 bytes answer one slave
+ * address per 256 byte block. A page write wraps within its page, and the
+ * part NAKs for twr microseconds after the STOP that starts the write
+ * cycle, which the AP polls for.
+ */
+struct i2c_eeprom {
+	const struct at24_chip *chip;
+	uint8_t		*mem;
+	uint32_t	ptr;
+	bool		written;
+	bool		dirty;
+	long		twr_us;
+	struct timespec	busy_until;
+	char		*image;
+};
+
+static bool eeprom_busy(struct i2c_eeprom *ee)
+{
+	struct timespec now;
+
+	if (!ee->twr_us)
+		return false;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec < ee->busy_until.tv_sec ||
+	       (now.tv_sec == ee->busy_until.tv_sec &&
+		now.tv_nsec < ee->busy_until.tv_nsec);
+}
+
+static int eeprom_open(struct i2c_dev *dev, const char *arg)
+{
+	const struct at24_chip *chip = NULL;
+	struct i2c_eeprom *ee;
+	const char *val;
+	FILE *f;
+	int i;
+
+	for (i = 0; arg && i < sizeof(at24_chips) / sizeof(at24_chips[0]); i++)
+		if (!strcmp(at24_chips[i].name, arg))
+			chip = &at24_chips[i];
+	if (!chip) {
+		gbsim_error("unknown eeprom %s\n", arg ? arg : "(none)");
+		return -EINVAL;
+	}
+
+	ee = calloc(1, sizeof(*ee));
+	if (!ee)
+		return -ENOMEM;
+	ee->mem = malloc(chip->size);
+	if (!ee->mem) {
+		free(ee);
+		return -ENOMEM;
+	}
+	memset(ee->mem, 0xff, chip->size);
+	ee->chip = chip;
+
+	val = conf_opt(dev->opts, dev->num_opts, "twr");
+	if (val)
+		ee->twr_us = strtol(val, NULL, 0);
+
+	val = conf_opt(dev->opts, dev->num_opts, "image");
+	if (val) {
+		ee->image = strdup(val);
+		f = fopen(val, "r");
+		if (f) {
+			if (fread(ee->mem, 1, chip->size, f) < chip->size)
+				gbsim_info("eeprom image %s is short\n", val);
+			fclose(f);
+		}
+	}
+
+	if (chip->addrlen == 1 && chip->size > 256)
+		dev->naddr = chip->size / 256;
+	dev->priv = ee;
+
+	return 0;
+}
+
+static void eeprom_close(struct i2c_dev *dev)
+{
+	struct i2c_eeprom *ee = dev->priv;
+	FILE *f;
+
+	if (ee->image && ee->dirty) {
+		f = fopen(ee->image, "w");
+		if (f) {
+			if (fwrite(ee->mem, 1, ee->chip->size, f) <
+			    ee->chip->size)
+				gbsim_error("failed writing eeprom image %s\n",
+					    ee->image);
+			fclose(f);
+		} else {
+			gbsim_error("failed opening eeprom image %s\n",
+				    ee->image);
+		}
+	}
+
+	free(ee->image);
+	free(ee->mem);
+	free(ee);
+}
+
+static int eeprom_write(struct i2c_dev *dev, uint8_t addr, uint8_t *buf,
+			size_t len)
+{
+	struct i2c_eeprom *ee = dev->priv;
+	const struct at24_chip *chip = ee->chip;
+	uint32_t page_base;
+	size_t i;
+
+	if (eeprom_busy(ee))
+		return -ENXIO;
+
+	/* Word address, high byte first, after the block select bits */
+	if (len < chip->addrlen)
+		return 0;
+	ee->ptr = addr - dev->addr;
+	for (i = 0; i < chip->addrlen; i++)
+		ee->ptr = ee->ptr << 8 | buf[i];
+	ee->ptr %= chip->size;
+
+	if (i == len)
+		return 0;
+
+	page_base = ee->ptr & ~(chip->page - 1);
+	for (; i < len; i++) {
+		ee->mem[ee->ptr] = buf[i];
+		ee->ptr = page_base + ((ee->ptr + 1) & (chip->page - 1));
+	}
+	ee->written = true;
+	ee->dirty = true;
+
+	return 0;
+}
+
+static int eeprom_read(struct i2c_dev *dev, uint8_t addr, uint8_t *buf,
+		       size_t len)
+{
+	struct i2c_eeprom *ee = dev->priv;
+	size_t size = ee->chip->size;
+	size_t n;
+
+	if (eeprom_busy(ee))
+		return -ENXIO;
+
+	/* Sequential reads roll over at the end of the array */
+	while (len) {
+		n = size - ee->ptr;
+		if (n > len)
+			n = len;
+		memcpy(buf, ee->mem + ee->ptr, n);
+		buf += n;
+		len -= n;
+		ee->ptr = (ee->ptr + n) % size;
+	}
+
+	return 0;
+}
+
+static void eeprom_stop(struct i2c_dev *dev)
+{
+	struct i2c_eeprom *ee = dev->priv;
+
+	if (!ee->written)
+		return;
+	ee->written = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &ee->busy_until);
+	ee->busy_until.tv_nsec += (ee->twr_us % 1000000) * 1000;
+	ee->busy_until.tv_sec += ee->twr_us / 1000000 +
+				 ee->busy_until.tv_nsec / 1000000000;
+	ee->busy_until.tv_nsec %= 1000000000;
+}
+
+/*
+ * Register file behind an 8-bit register pointer, the usual sensor layout:
+ * the first byte written sets the pointer, further bytes are stored and
+ * reads continue from the pointer, which auto-increments. A register can
+ * be scripted with values that successive reads cycle through until it is
+ * written.
+ */
+struct i2c_regfile {
+	uint8_t		ptr;
+	struct gbsim_regs regs;
+};
+
+static void regfile_close(struct i2c_dev *dev)
+{
+	struct i2c_regfile *rf = dev->priv;
+
+	regs_free(&rf->regs);
+	free(rf);
+}
+
+static int regfile_open(struct i2c_dev *dev, const char *arg)
+{
+	struct i2c_regfile *rf;
+
+	rf = calloc(1, sizeof(*rf));
+	if (!rf)
+		return -ENOMEM;
+	dev->priv = rf;
+
+	if (arg && regs_load(&rf->regs, arg) < 0) {
+		regfile_close(dev);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int regfile_write(struct i2c_dev *dev, uint8_t addr, uint8_t *buf,
+			 size_t len)
+{
+	struct i2c_regfile *rf = dev->priv;
+	size_t i;
+
+	if (!len)
+		return 0;
+
+	rf->ptr = buf[0];
+	for (i = 1; i < len; i++)
+		regs_write(&rf->regs, rf->ptr++, buf[i]);
+
+	return 0;
+}
+
+static int regfile_read(struct i2c_dev *dev, uint8_t addr, uint8_t *buf,
+			size_t len)
+{
+	struct i2c_regfile *rf = dev->priv;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = regs_read(&rf->regs, rf->ptr++);
+
+	return 0;
+}
+
+/*
+ * Scripted responder: every op of a transfer takes the next step of the
+ * script, which restarts at the end. A step is "w BYTES" to expect a
+ * write, "r BYTES" to answer a read (padded with 0xff) or "nak" to NAK
+ * whatever op comes next. An unexpected write is logged and NAKed.
+ */
+#define I2C_SCRIPT_NAK		0
+#define I2C_SCRIPT_WRITE	1
+#define I2C_SCRIPT_READ		2
+
+struct i2c_script_step {
+	int		type;
+	uint8_t		*data;
+	size_t		len;
+};
+
+struct i2c_script {
+	struct i2c_script_step	*steps;
+	int			count;
+	int			pos;
+};
+
+static void script_close(struct i2c_dev *dev)
+{
+	struct i2c_script *s = dev->priv;
+	int i;
+
+	for (i = 0; i < s->count; i++)
+		free(s->steps[i].data);
+	free(s->steps);
+	free(s);
+}
+
+static int script_open(struct i2c_dev *dev, const char *arg)
+{
+	char line[I2C_MAXLINE];
+	struct i2c_script_step *step;
+	struct i2c_script *s;
+	char *tok, *save;
+	void *steps;
+	FILE *f;
+
+	if (!arg) {
+		gbsim_error("i2c script file required\n");
+		return -EINVAL;
+	}
+
+	f = fopen(arg, "r");
+	if (!f) {
+		gbsim_error("failed opening i2c script %s\n", arg);
+		return -errno;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		fclose(f);
+		return -ENOMEM;
+	}
+	dev->priv = s;
+
+	while (fgets(line, sizeof(line), f)) {
+		tok = strtok_r(line, " \t\r\n", &save);
+		if (!tok || *tok == '#')
+			continue;
+
+		steps = realloc(s->steps, (s->count + 1) * sizeof(*step));
+		if (!steps)
+			break;
+		s->steps = steps;
+		step = &s->steps[s->count];
+		memset(step, 0, sizeof(*step));
+
+		if (!strcmp(tok, "w")) {
+			step->type = I2C_SCRIPT_WRITE;
+		} else if (!strcmp(tok, "r")) {
+			step->type = I2C_SCRIPT_READ;
+		} else if (!strcmp(tok, "nak")) {
+			step->type = I2C_SCRIPT_NAK;
+		} else {
+			gbsim_error("i2c script %s: bad step %s\n", arg, tok);
+			continue;
+		}
+
+		step->data = malloc(I2C_MAXLINE / 2);
+		if (!step->data)
+			break;
+		while ((tok = strtok_r(NULL, " \t\r\n", &save)) &&
+		       step->len < I2C_MAXLINE / 2)
+			step->data[step->len++] = strtoul(tok, NULL, 0);
+		s->count++;
+	}
+
+	fclose(f);
+
+	if (!s->count) {
+		gbsim_error("i2c script %s has no steps\n", arg);
+		script_close(dev);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static struct i2c_script_step *script_next(struct i2c_script *s)
+{
+	struct i2c_script_step *step = &s->steps[s->pos];
+
+	s->pos = (s->pos + 1) % s->count;
+	return step;
+}
+
+static int script_write(struct i2c_dev *dev, uint8_t addr, uint8_t *buf,
+			size_t len)
+{
+	struct i2c_script *s = dev->priv;
+	int pos = s->pos;
+	struct i2c_script_step *step = script_next(s);
+
+	if (step->type == I2C_SCRIPT_NAK)
+		return -ENXIO;
+
+	if (step->type != I2C_SCRIPT_WRITE || step->len != len ||
+	    memcmp(step->data, buf, len)) {
+		gbsim_error("i2c 0x%02x: write of %zu bytes does not match step %d\n",
+			    addr, len, pos);
+		return -ENXIO;
+	}
+
+	return 0;
+}
+
+static int script_read(struct i2c_dev *dev, uint8_t addr, uint8_t *buf,
+		       size_t len)
+{
+	struct i2c_script *s = dev->priv;
+	int pos = s->pos;
+	struct i2c_script_step *step = script_next(s);
+	size_t n;
+
+	if (step->type == I2C_SCRIPT_NAK)
+		return -ENXIO;
+
+	if (step->type != I2C_SCRIPT_READ) {
+		gbsim_error("i2c 0x%02x: unexpected read at step %d\n",
+			    addr, pos);
+		return -ENXIO;
+	}
+
+	n = len < step->len ? len : step->len;
+	memcpy(buf, step->data, n);
+	memset(buf + n, 0xff, len - n);
+
+	return 0;
+}
+
+static const struct i2c_model i2c_models[] = {
+	{
+		.name		= "eeprom",
+		.open		= eeprom_open,
+		.close		= eeprom_close,
+		.write		= eeprom_write,
+		.read		= eeprom_read,
+		.stop		= eeprom_stop,
+	},
+	{
+		.name		= "regfile",
+		.open		= regfile_open,
+		.close		= regfile_close,
+		.write		= regfile_write,
+		.read		= regfile_read,
+	},
+	{
+		.name		= "script",
+		.open		= script_open,
+		.close		= script_close,
+		.write		= script_write,
+		.read		= script_read,
+	},
+};
+
+/* Run a transfer against the simulated devices, a NAK aborts it */
+static uint8_t i2c_model_xfer(struct gb_i2c_transfer_op *ops, int op_count,
+			      __u8 *write_data, __u8 *read_data)
+{
+	struct i2c_dev *dev;
+	__u16 addr, flags, size;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < op_count; i++) {
+		addr = le16toh(ops[i].addr);
+		flags = le16toh(ops[i].flags);
+		size = le16toh(ops[i].size);
+
+		dev = NULL;
+		if (!(flags & I2C_M_TEN) && addr < I2C_MAX_ADDR)
+			dev = i2c_devs[addr];
+		if (!dev) {
+			ret = -ENXIO;
+			break;
+		}
+
+		dev->active = true;
+		if (flags & I2C_M_RD) {
+			ret = dev->model->read(dev, addr, read_data, size);
+			read_data += size;
+		} else {
+			ret = dev->model->write(dev, addr, write_data, size);
+			write_data += size;
+		}
+		if (ret < 0)
+			break;
+	}
+
+	if (ret < 0)
+		gbsim_debug("i2c op %d to 0x%02x failed: %s\n", i, addr,
+			    strerror(-ret));
+
+	for (i = 0; i < op_count; i++) {
+		addr = le16toh(ops[i].addr);
+		dev = addr < I2C_MAX_ADDR ? i2c_devs[addr] : NULL;
+		if (!dev || !dev->active)
+			continue;
+		dev->active = false;
+		if (dev->model->stop)
+			dev->model->stop(dev);
+	}
+
+	return ret < 0 ? gbsim_errno_to_result(-ret) : GB_OP_SUCCESS;
+}
+
+static const struct i2c_model *i2c_model_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(i2c_models) / sizeof(i2c_models[0]); i++)
+		if (!strcmp(i2c_models[i].name, name))
+			return &i2c_models[i];
+
+	return NULL;
+}
+
+/* <addr> <model> [arg] [key=value ...] */
+static int i2c_dev_config_line(char *line)
+{
+	const struct i2c_model *model;
+	struct i2c_dev *dev;
+	char *tok, *save;
+	char who[16];
+	char *arg;
+	unsigned long addr;
+	int ret, i;
+
+	tok = strtok_r(line, " \t\r\n", &save);
+	if (!tok)
+		return 0;
+
+	addr = strtoul(tok, NULL, 0);
+	if (addr >= I2C_MAX_ADDR) {
+		gbsim_error("i2c address 0x%lx out of range\n", addr);
+		return -EINVAL;
+	}
+
+	tok = strtok_r(NULL, " \t\r\n", &save);
+	model = tok ? i2c_model_find(tok) : NULL;
+	if (!model) {
+		gbsim_error("i2c 0x%02lx: unknown model %s\n", addr,
+			    tok ? tok : "(none)");
+		return -EINVAL;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return -ENOMEM;
+	dev->addr = addr;
+	dev->naddr = 1;
+	dev->model = model;
+
+	/* The line is copied, arg and options point into the copy */
+	tok = strtok_r(NULL, "\r\n", &save);
+	if (tok)
+		strncpy(dev->arg, tok, sizeof(dev->arg) - 1);
+	snprintf(who, sizeof(who), "i2c 0x%02lx", addr);
+	dev->num_opts = conf_args(dev->arg, &save, &arg, dev->opts,
+				  CONF_MAX_OPTS, who);
+
+	ret = model->open(dev, arg);
+	if (ret < 0) {
+		free(dev);
+		return ret;
+	}
+
+	for (i = 0; i < dev->naddr; i++) {
+		if (addr + i >= I2C_MAX_ADDR || i2c_devs[addr + i]) {
+			gbsim_error("i2c address 0x%02lx already in use\n",
+				    addr + i);
+			break;
+		}
+	}
+	if (i < dev->naddr) {
+		model->close(dev);
+		free(dev);
+		return -EBUSY;
+	}
+
+	for (i = 0; i < dev->naddr; i++)
+		i2c_devs[addr + i] = dev;
+	i2c_num_devs++;
+
+	gbsim_info("I2C 0x%02lx %s %s\n", addr, model->name, arg ? arg : "");
+
+	return 0;
+}
+
+/*
+ * Read cache for register ranges of slow devices polled by several AP
+ * clients. A register read is a transfer writing the range's 1 or 2 byte
+ * register address and reading back from the same slave. Each cached byte is
+ * refetched once it is older than the range's TTL, unless the range is
+ * immutable. Any other write to the slave invalidates all its ranges.
+ */
+struct i2c_cache_range {
+	int		adapter;
+	uint8_t		addr;
+	uint16_t	first;
+	uint16_t	last;
+	uint8_t		reg_width;	/* bytes of register address */
+	bool		immutable;
+	uint64_t	ttl_ms;
+	uint8_t		*data;
+	uint64_t	*stamp;
+	unsigned long	hits;
+	unsigned long	misses;
+	unsigned long	invalidations;
+	struct i2c_cache_range *next;
+};
+
+static struct i2c_cache_range *i2c_cache[I2C_MAX_ADDR];
+
+static uint64_t i2c_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	/* Never 0, which marks an empty entry */
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000 + 1;
+}
+
+/* cache <addr> <first>[-<last>] [regw=1|2] ttl=<ms>|immutable */
+static int i2c_cache_config_line(char *line)
+{
+	struct i2c_cache_range *range;
+	unsigned long addr, first, last;
+	char *tok, *save, *end;
+	size_t len;
+
+	tok = strtok_r(line, " \t\r\n", &save);
+	if (!tok)
+		return -EINVAL;
+	addr = strtoul(tok, NULL, 0);
+	if (addr >= I2C_MAX_ADDR) {
+		gbsim_error("i2c cache address 0x%lx out of range\n", addr);
+		return -EINVAL;
+	}
+
+	tok = strtok_r(NULL, " \t\r\n", &save);
+	if (!tok) {
+		gbsim_error("i2c cache 0x%02lx: register range required\n",
+			    addr);
+		return -EINVAL;
+	}
+	first = strtoul(tok, &end, 0);
+	last = *end == '-' ? strtoul(end + 1, NULL, 0) : first;
+	if (last < first || last > 0xffff) {
+		gbsim_error("i2c cache 0x%02lx: bad register range %s\n",
+			    addr, tok);
+		return -EINVAL;
+	}
+
+	range = calloc(1, sizeof(*range));
+	if (!range)
+		return -ENOMEM;
+	len = last - first + 1;
+	range->data = calloc(len, sizeof(*range->data));
+	range->stamp = calloc(len, sizeof(*range->stamp));
+	if (!range->data || !range->stamp) {
+		free(range->data);
+		free(range->stamp);
+		free(range);
+		return -ENOMEM;
+	}
+	range->adapter = i2c_adapter;
+	range->addr = addr;
+	range->first = first;
+	range->last = last;
+	range->reg_width = last > 0xff ? 2 : 1;
+
+	while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+		if (!strcmp(tok, "immutable"))
+			range->immutable = true;
+		else if (!strcmp(tok, "regw=1") && last <= 0xff)
+			range->reg_width = 1;
+		else if (!strcmp(tok, "regw=2"))
+			range->reg_width = 2;
+		else if (!strncmp(tok, "ttl=", 4))
+			range->ttl_ms = strtoull(tok + 4, NULL, 0);
+		else
+			gbsim_error("i2c cache 0x%02lx: bad option %s\n",
+				    addr, tok);
+	}
+
+	range->next = i2c_cache[addr];
+	i2c_cache[addr] = range;
+
+	if (range->immutable)
+		gbsim_info("I2C cache 0x%02lx 0x%04lx-0x%04lx immutable\n",
+			   addr, first, last);
+	else
+		gbsim_info("I2C cache 0x%02lx 0x%04lx-0x%04lx ttl %llu ms\n",
+			   addr, first, last,
+			   (unsigned long long)range->ttl_ms);
+
+	return 0;
+}
+
+static struct i2c_cache_range *i2c_cache_match(struct gb_i2c_transfer_op *ops,
+					       int op_count, __u8 *write_data,
+					       uint16_t *reg)
+{
+	struct i2c_cache_range *range;
+	__u16 addr = le16toh(ops[0].addr);
+	__u16 wr_flags, rd_flags, wr_size, rd_size;
+
+	if (op_count != 2 || addr >= I2C_MAX_ADDR || !i2c_cache[addr] ||
+	    le16toh(ops[1].addr) != addr)
+		return NULL;
+
+	wr_flags = le16toh(ops[0].flags);
+	rd_flags = le16toh(ops[1].flags);
+	wr_size = le16toh(ops[0].size);
+	rd_size = le16toh(ops[1].size);
+	if ((wr_flags & (I2C_M_RD | I2C_M_TEN)) || !(rd_flags & I2C_M_RD) ||
+	    (wr_size != 1 && wr_size != 2) || !rd_size)
+		return NULL;
+
+	*reg = wr_size == 1 ? write_data[0] :
+			      write_data[0] << 8 | write_data[1];
+
+	for (range = i2c_cache[addr]; range; range = range->next)
+		if (range->adapter == i2c_adapter &&
+		    range->reg_width == wr_size && *reg >= range->first &&
+		    *reg + rd_size - 1 <= range->last)
+			return range;
+
+	return NULL;
+}
+
+static bool i2c_cache_read(struct i2c_cache_range *range, uint16_t reg,
+			   __u8 *buf, int len)
+{
+	uint64_t now = i2c_cache_now();
+	int off = reg - range->first;
+	int i;
+
+	for (i = off; i < off + len; i++) {
+		if (!range->stamp[i] ||
+		    (!range->immutable && now - range->stamp[i] > range->ttl_ms)) {
+			range->misses++;
+			return false;
+		}
+	}
+
+	memcpy(buf, range->data + off, len);
+	range->hits++;
+	return true;
+}
+
+static void i2c_cache_fill(struct i2c_cache_range *range, uint16_t reg,
+			   __u8 *buf, int len)
+{
+	uint64_t now = i2c_cache_now();
+	int off = reg - range->first;
+	int i;
+
+	memcpy(range->data + off, buf, len);
+	for (i = off; i < off + len; i++)
+		range->stamp[i] = now;
+}
+
+/*
+ * Drop the ranges of every slave written to, unless the write only sets
+ * a range's register address for a read following in the transfer.
+ */
+static void i2c_cache_invalidate(struct gb_i2c_transfer_op *ops, int op_count)
+{
+	struct i2c_cache_range *range;
+	bool select;
+	__u16 addr;
+	int i;
+
+	for (i = 0; i < op_count; i++) {
+		addr = le16toh(ops[i].addr);
+		if (addr >= I2C_MAX_ADDR || !i2c_cache[addr] ||
+		    (le16toh(ops[i].flags) & I2C_M_RD))
+			continue;
+
+		select = i < op_count - 1 &&
+			 le16toh(ops[i + 1].addr) == addr &&
+			 (le16toh(ops[i + 1].flags) & I2C_M_RD);
+
+		for (range = i2c_cache[addr]; range; range = range->next) {
+			if (select && le16toh(ops[i].size) == range->reg_width)
+				continue;
+			memset(range->stamp, 0, (range->last - range->first + 1) *
+			       sizeof(*range->stamp));
+			range->invalidations++;
+		}
+	}
+}
+
+static void i2c_cache_cleanup(void)
+{
+	struct i2c_cache_range *range;
+	int i;
+
+	for (i = 0; i < I2C_MAX_ADDR; i++) {
+		while ((range = i2c_cache[i])) {
+			gbsim_info("I2C cache 0x%02x 0x%04x-0x%04x: %lu hits %lu misses %lu invalidations\n",
+				   range->addr, range->first, range->last,
+				   range->hits, range->misses,
+				   range->invalidations);
+			i2c_cache[i] = range->next;
+			free(range->data);
+			free(range->stamp);
+			free(range);
+		}
+	}
+}
+
+static int i2c_config_line(char *line, void *data)
+{
+	char *p = line + strspn(line, " \t");
+
+	if (!strncmp(p, "cache", 5) && isspace(p[5]))
+		return i2c_cache_config_line(p + 5);
+
+	return i2c_dev_config_line(line);
+}
+
+static uint8_t i2c_xfer(struct gb_i2c_transfer_op *ops, int op_count,
+			__u8 *write_data, __u8 *read_data, int read_count)
+{
+	struct i2c_cache_range *range;
+	uint16_t reg;
+	uint8_t result = GB_OP_SUCCESS;
+	int i;
+
+	range = i2c_cache_match(ops, op_count, write_data, &reg);
+	if (range && i2c_cache_read(range, reg, read_data, read_count))
+		return GB_OP_SUCCESS;
+
+	if (i2c_num_devs) {
+		result = i2c_model_xfer(ops, op_count, write_data, read_data);
+	} else if (bbb_backend) {
+		result = i2c_rdwr_xfer(ops, op_count, write_data, read_data);
+	} else {
+		for (i = 0; i < read_count; i++)
+			read_data[i] = data_byte++;
+	}
+
+	if (result != GB_OP_SUCCESS)
+		return result;
+
+	if (range)
+		i2c_cache_fill(range, reg, read_data, read_count);
+	else
+		i2c_cache_invalidate(ops, op_count);
+
+	return result;
+}
 
 int i2c_handler(struct gbsim_connection *connection, void *rbuf,
 		size_t rsize, void *tbuf, size_t tsize)
@@ -35,11 +955,12 @@ int i2c_handler(struct gbsim_connection *connection, void *rbuf,
 	__u8 *write_data;
 	bool read_op = false;
 	int read_count = 0;
-	bool write_fail = false;
+	int write_count = 0;
+	struct timespec ts_start, ts_end;
 	size_t payload_size;
 	uint16_t message_size;
 	uint16_t hd_cport_id = connection->hd_cport_id;
-	uint8_t result = PROTOCOL_STATUS_SUCCESS;
+	uint8_t result = GB_OP_SUCCESS;
 
 	op_rsp = (struct op_msg *)tbuf;
 	oph = (struct gb_operation_msg_hdr *)&op_req->header;
@@ -53,6 +974,13 @@ int i2c_handler(struct gbsim_connection *connection, void *rbuf,
 		op_count = le16toh(op_req->i2c_xfer_req.op_count);
 		write_data = (__u8 *)&op_req->i2c_xfer_req.ops[op_count];
 		gbsim_debug("Number of transfer ops %d\n", op_count);
+		payload_size = 0;
+
+		if (!op_count || op_count > I2C_RDWR_IOCTL_MAX_MSGS) {
+			result = GB_OP_INVALID;
+			break;
+		}
+
 		for (i = 0; i < op_count; i++) {
 			struct gb_i2c_transfer_op *op;
 			__u16 addr;
@@ -67,40 +995,35 @@ int i2c_handler(struct gbsim_connection *connection, void *rbuf,
 			gbsim_debug("op %d: %s address %04x size %04x\n",
 				    i, (read_op ? "read" : "write"),
 				    addr, size);
-			/* FIXME: need some error handling */
-			if (bbb_backend)
-				if (ioctl(ifd, I2C_SLAVE, addr) < 0)
-					gbsim_error("failed setting i2c slave address\n");
-			if (read_op) {
-				if (bbb_backend) {
-					int count;
-					ioctl(ifd, BLKFLSBUF);
-					count = read(ifd, &op_rsp->i2c_xfer_rsp.data[read_count], size);
-					if (count != size)
-						gbsim_error("op %d: failed to read %04x bytes\n", i, size);
-				} else {
-					for (i = read_count; i < (read_count + size); i++)
-					op_rsp->i2c_xfer_rsp.data[i] = data_byte++;
-				}
+			if (read_op)
 				read_count += size;
-			} else {
-				if (bbb_backend) {
-					int count;
-					count = write(ifd, write_data, size);
-					if (count != size) {
-						gbsim_debug("op %d: failed to write %04x bytes\n", i, size);
-						write_fail = true;
-					}
-				}
-				write_data += size;
-			}
+			else
+				write_count += size;
+		}
+
+		/* Both the outbound data and the response must fit */
+		if (write_data + write_count > (__u8 *)rbuf + rsize ||
+		    sizeof(*oph) + read_count > tsize) {
+			gbsim_error("i2c transfer too big (write %d read %d)\n",
+				    write_count, read_count);
+			result = GB_OP_INVALID;
+			break;
 		}
 
-		/* FIXME: handle read failure */
-		if (write_fail)
-			result = PROTOCOL_STATUS_RETRY;
+		clock_gettime(CLOCK_MONOTONIC, &ts_start);
+		result = i2c_xfer(op_req->i2c_xfer_req.ops, op_count,
+				  write_data, op_rsp->i2c_xfer_rsp.data,
+				  read_count);
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+
+		gbsim_debug("I2C %d ops write %d read %d in %ld us\n",
+			    op_count, write_count, read_count,
+			    (ts_end.tv_sec - ts_start.tv_sec) * 1000000 +
+			    (ts_end.tv_nsec - ts_start.tv_nsec) / 1000);
 
-		payload_size = read_op ? read_count : 0;
+		/* The response carries the data of every read op */
+		if (result == GB_OP_SUCCESS)
+			payload_size = read_count;
 		break;
 	case GB_REQUEST_TYPE_CPORT_SHUTDOWN:
 		payload_size = 0;
@@ -134,10 +1057,35 @@ void i2c_init(void)
 {
 	char filename[20];
 
-	if (bbb_backend) {
+	if (i2c_config)
+		conf_file(i2c_config, i2c_config_line, NULL);
+
+	if (bbb_backend && !i2c_num_devs) {
 		snprintf(filename, 19, "/dev/i2c-%d", i2c_adapter);
 		ifd = open(filename, O_RDWR);
 		if (ifd < 0)
 			gbsim_error("failed opening i2c-dev node read/write\n");
 	}
-}
\ No newline at end of file
+}
+
+void i2c_cleanup(void)
+{
+	struct i2c_dev *dev;
+	int i, j;
+
+	for (i = 0; i < I2C_MAX_ADDR; i++) {
+		dev = i2c_devs[i];
+		if (!dev)
+			continue;
+		/* Drop every address of the device before freeing it */
+		for (j = 0; j < dev->naddr; j++)
+			i2c_devs[dev->addr + j] = NULL;
+		if (dev->model->close)
+			dev->model->close(dev);
+		free(dev);
+	}
+	memset(i2c_devs, 0, sizeof(i2c_devs));
+	i2c_num_devs = 0;
+
+	i2c_cache_cleanup();
+}
@@ -8,6 +8,7 @@
  */
 
 #include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +16,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <pthread.h>
 
@@ -30,173 +32,330 @@ static pthread_t inotify_pthread;
 int notify_fd = -ENXIO;
 static char root[256];
 
-static struct greybus_manifest_header *get_manifest_blob(char *mnfs)
+static int get_interface_id_from_fname(char *fname)
 {
-	struct greybus_manifest_header *mh;
-	int mnf_fd;
-	ssize_t n;
-	__le16 file_size;
-	uint16_t size;
-
-	if ((mnf_fd = open(mnfs, O_RDONLY)) < 0) {
-		gbsim_error("failed to open manifest blob %s\n", mnfs);
-		return NULL;
-	}
+	char *iid_str;
+	char tmp[256];
 
-	/* First just get the size */
-	if ((n = read(mnf_fd, &file_size, 2)) != 2) {
-		gbsim_error("failed to read manifest size, read %zd\n", n);
-		goto out;
+	/* if manifest name start with IID fetch the interface from there */
+	if (fname) {
+		strcpy(tmp, fname);
+		iid_str = strtok(tmp, "-");
+		if (!strncmp(iid_str, "IID", 3))
+			return strtol(iid_str + 3, NULL, 0);
 	}
-	size = le16toh(file_size);
 
-	/* Size has to cover at least itself */
-	if (size < 2) {
-		gbsim_error("bad manifest size %hu\n", size);
-		goto out;
-	}
+	return -ENOENT;
+}
 
-	/* Allocate a big enough buffer */
-	if (!(mh = malloc(size))) {
-		gbsim_error("failed to allocate manifest buffer\n");
-		goto out;
-	}
+/* Text manifests in manifesto's .mnfs format are compiled in process */
+static bool is_manifest_source(const char *fname)
+{
+	size_t len = strlen(fname);
 
-	/* Now go back and read the whole thing */
-	if (lseek(mnf_fd, 0, SEEK_SET)) {
-		gbsim_error("failed to seek to front of manifest\n");
-		goto out_free;
-	}
-	if (read(mnf_fd, mh, size) != size) {
-		gbsim_error("failed to read manifest\n");
-		goto out_free;
+	return len > 5 && !strcmp(fname + len - 5, ".mnfs");
+}
+
+/*
+ * Hotplug events are not acted upon as they arrive. Events are collected
+ * until the directory has been quiet for HOTPLUG_SETTLE_MS, or for at
+ * most HOTPLUG_MAX_DELAY_MS, keeping only the last event of each file,
+ * except that a file removed and then written again is a replug.
+ * The batch is then validated as a whole before the AP hears of it, and
+ * the resulting MODULE_INSERTED/REMOVED requests are sent with at most
+ * HOTPLUG_MAX_INFLIGHT of them waiting for their response.
+ */
+#define HOTPLUG_SETTLE_MS	50
+#define HOTPLUG_MAX_DELAY_MS	500
+#define HOTPLUG_MAX_INFLIGHT	4
+
+struct hotplug_event {
+	TAILQ_ENTRY(hotplug_event) node;
+	char name[MAX_NAME + 1];
+	bool insert;
+	bool replug;
+	struct gbsim_manifest *mnf;
+};
+
+TAILQ_HEAD(hotplug_head, hotplug_event);
+
+static int hotplug_inflight;
+static pthread_mutex_t hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hotplug_cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t hotplug_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct hotplug_op {
+	uint8_t type;
+	uint8_t intf_id;
+};
+
+static const char *hotplug_op_name(uint8_t type)
+{
+	return type == GB_SVC_TYPE_MODULE_INSERTED ? "insert" : "remove";
+}
+
+/* Response, timeout or teardown of a MODULE_INSERTED/REMOVED request */
+static void hotplug_done(void *data, struct op_msg *rsp, size_t rsize,
+			 int status)
+{
+	struct hotplug_op *op = data;
+
+	if (status < 0)
+		gbsim_error("interface %u %s: no response (%d)\n",
+			    op->intf_id, hotplug_op_name(op->type), status);
+	else if (status)
+		gbsim_error("interface %u %s failed (%d)\n", op->intf_id,
+			    hotplug_op_name(op->type), status);
+	else
+		gbsim_debug("interface %u %s acknowledged\n", op->intf_id,
+			    hotplug_op_name(op->type));
+	free(op);
+
+	pthread_mutex_lock(&hotplug_lock);
+	hotplug_inflight--;
+	pthread_cond_broadcast(&hotplug_cond);
+	pthread_mutex_unlock(&hotplug_lock);
+}
+
+static void hotplug_send(uint8_t type, uint8_t intf_id)
+{
+	struct hotplug_op *op;
+	int ret;
+
+	op = malloc(sizeof(*op));
+	if (!op) {
+		gbsim_error("interface %u %s: out of memory\n", intf_id,
+			    hotplug_op_name(type));
+		return;
 	}
-	close(mnf_fd);
+	op->type = type;
+	op->intf_id = intf_id;
 
-	return mh;
-out_free:
-	free(mh);
-out:
-	close(mnf_fd);
+	/* Timed out requests are completed by the operation layer */
+	pthread_mutex_lock(&hotplug_lock);
+	while (hotplug_inflight == HOTPLUG_MAX_INFLIGHT)
+		pthread_cond_wait(&hotplug_cond, &hotplug_lock);
+	hotplug_inflight++;
+	pthread_mutex_unlock(&hotplug_lock);
 
-	return NULL;
+	ret = svc_request_send_cb(type, intf_id, hotplug_done, op);
+	if (ret < 0) {
+		gbsim_error("interface %u %s: send failed (%d)\n", intf_id,
+			    hotplug_op_name(type), ret);
+		free(op);
+		pthread_mutex_lock(&hotplug_lock);
+		hotplug_inflight--;
+		pthread_mutex_unlock(&hotplug_lock);
+	}
 }
 
-static int get_interface_id_from_fname(char *fname)
+/*
+ * Record an event, replacing any earlier event for the same file. An
+ * insert replacing a removal keeps the removal, as a replug.
+ */
+static void hotplug_queue(struct hotplug_head *pending, const char *name,
+			  bool insert)
 {
-	char *iid_str;
-	char tmp[256];
+	struct hotplug_event *ev;
 
-	/* if manifest name start with IID fetch the interface from there */
-	if (fname) {
-		strcpy(tmp, fname);
-		iid_str = strtok(tmp, "-");
-		if (!strncmp(iid_str, "IID", 3))
-			return strtol(iid_str + 3, NULL, 0);
+	TAILQ_FOREACH(ev, pending, node)
+		if (!strcmp(ev->name, name))
+			break;
+
+	if (!ev) {
+		ev = calloc(1, sizeof(*ev));
+		if (!ev) {
+			gbsim_error("dropping hotplug event for %s\n", name);
+			return;
+		}
+		strncpy(ev->name, name, MAX_NAME);
+		TAILQ_INSERT_TAIL(pending, ev, node);
+	} else if (insert && !ev->insert) {
+		ev->replug = true;
 	}
 
-	return -ENOENT;
+	ev->insert = insert;
 }
 
-/* djb2 string hash function */
-static uint32_t hash_filename(char *fname)
+static void hotplug_load(struct gbsim_svc *svc, struct hotplug_event *ev)
 {
-	uint32_t hash = 5381;
-	int c;
+	struct gbsim_interface *intf;
+	char mnfs[sizeof(root) + MAX_NAME + 2];
+
+	snprintf(mnfs, sizeof(mnfs), "%s/%s", root, ev->name);
+	if (is_manifest_source(ev->name))
+		ev->mnf = mnfs_get(mnfs);
+	else
+		ev->mnf = manifest_get(mnfs);
+	if (!ev->mnf) {
+		gbsim_error("missing or invalid manifest blob, no hotplug event sent\n");
+		return;
+	}
+
+	/* A manifest written again while its module is in */
+	intf = interface_get_by_fname(svc, ev->name);
+	if (intf && !ev->replug) {
+		if (intf->mnf != ev->mnf)
+			gbsim_error("%s changed while interface %u is inserted, remove it first\n",
+				    ev->name, intf->interface_id);
+		manifest_put(ev->mnf);
+		ev->mnf = NULL;
+	}
+}
+
+static void hotplug_process(struct gbsim_svc *svc, struct hotplug_head *pending)
+{
+	struct gbsim_interface *intf;
+	struct hotplug_event *ev;
+	int intf_id;
+
+	/* Validate every manifest before telling the AP about any */
+	TAILQ_FOREACH(ev, pending, node)
+		if (ev->insert)
+			hotplug_load(svc, ev);
 
-	while ((c = *fname++))
-		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	TAILQ_FOREACH(ev, pending, node) {
+		if (ev->insert && !ev->replug)
+			continue;
 
-	return hash;
+		intf = interface_get_by_fname(svc, ev->name);
+		if (!intf) {
+			gbsim_debug("interface not found for file: %s\n",
+				    ev->name);
+			continue;
+		}
+
+		/* The file no longer names it, even before the AP is done */
+		interface_del_fname(svc, intf);
+		hotplug_send(GB_SVC_TYPE_MODULE_REMOVED, intf->interface_id);
+		gbsim_info("%s interface removed\n", ev->name);
+	}
+
+	TAILQ_FOREACH(ev, pending, node) {
+		if (!ev->mnf)
+			continue;
+
+		/* get interface id by filename or next available */
+		intf_id = get_interface_id_from_fname(ev->name);
+		if (intf_id < 0)
+			intf_id = svc_get_next_intf_id(svc);
+		if (intf_id < 0) {
+			gbsim_error("%s: no free interface id\n", ev->name);
+			manifest_put(ev->mnf);
+			continue;
+		}
+
+		/* allocate interface with given interface id */
+		intf = interface_alloc(svc, intf_id);
+		if (!intf) {
+			manifest_put(ev->mnf);
+			continue;
+		}
+
+		if (interface_set_fname(svc, intf, ev->name) < 0)
+			gbsim_error("%s: can't track interface %d by name\n",
+				    ev->name, intf_id);
+		manifest_attach(intf, ev->mnf);
+
+		gbsim_info("%s Interface %d inserted\n", ev->name, intf_id);
+		hotplug_send(GB_SVC_TYPE_MODULE_INSERTED, intf_id);
+	}
+
+	while ((ev = TAILQ_FIRST(pending))) {
+		TAILQ_REMOVE(pending, ev, node);
+		free(ev);
+	}
 }
 
-static void *inotify_thread(void *param)
+static int inotify_read_events(struct hotplug_head *pending)
 {
 	char buffer[16 * INOTIFY_EVENT_BUF];
+	struct inotify_event *event;
 	ssize_t length;
-	struct gbsim_svc *svc = param;
-	struct gbsim_interface *intf;
-	uint32_t hash;
-	int intf_id;
+	size_t size;
 	int i;
 
-	(void) param;
-	do {
-		size_t size;
+	length = read(notify_fd, buffer, sizeof(buffer));
+	if (length < 0) {
+		if (errno == EINTR)
+			return 0;
+		gbsim_error("inotify read: %s\n", strerror(errno));
+		return -errno;
+	}
 
-		length = read(notify_fd, buffer, sizeof(buffer));
-		if (length < 0) {
-			gbsim_error("inotify read: %s\n", strerror(errno));
-			return NULL;
+	for (i = 0; i < length; i += size) {
+		event = (struct inotify_event *)&buffer[i];
+		size = sizeof(*event);
+		if (length - i < size || i + size + event->len > length) {
+			gbsim_error("inotify: short event: %zd\n", length - i);
+			break;
 		}
-		for (i = 0; i < length; i += size) {
-			struct inotify_event *event = (struct inotify_event *)&buffer[i];
-			size = sizeof(*event);
-			if (length - i < size) {
-				gbsim_error("inotify: partial event: %zd < %zu\n",
-					length - i, size);
-				return NULL;
-			}
+		size += event->len;
 
-			if (!event->len)
-				continue;
+		if (event->mask & IN_Q_OVERFLOW)
+			gbsim_error("inotify: queue overflow, events lost\n");
 
-			size += event->len;
-			if (i + size > length) {
-				gbsim_error("inotify: short event: %zd < %zu\n",
-					length - i, size);
-				return NULL;
-			}
+		if (!event->len)
+			continue;
+
+		if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+			hotplug_queue(pending, event->name, true);
+		else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+			hotplug_queue(pending, event->name, false);
+	}
+
+	return 0;
+}
 
-			if (event->mask & IN_CLOSE_WRITE) {
-				char mnfs[256];
-				struct greybus_manifest_header *mh;
-				strcpy(mnfs, root);
-				strcat(mnfs, "/");
-				strcat(mnfs, event->name);
-
-				/* get interface id by filename or next available */
-				intf_id = get_interface_id_from_fname(event->name);
-				if (intf_id < 0)
-					intf_id = svc_get_next_intf_id(svc);
-
-				/* allocate interface with given interface id */
-				intf = interface_alloc(svc, intf_id);
-				if (!intf)
-					return false;
-
-				hash = hash_filename(event->name);
-				intf->manifest_fname_hash = hash;
-
-				mh = get_manifest_blob(mnfs);
-				if (mh) {
-					manifest_parse(svc, intf_id, mh,
-						       le16toh(mh->size));
-
-					gbsim_info("%s Interface %d inserted\n",
-						   event->name, intf_id);
-
-					svc_request_send(GB_SVC_TYPE_MODULE_INSERTED,
-							 intf_id);
-				} else
-					gbsim_error("missing manifest blob, no hotplug event sent\n");
-			} else if (event->mask & IN_DELETE) {
-				/* get interface by filename hash */
-				hash = hash_filename(event->name);
-
-				intf = interface_get_by_hash(svc, hash);
-				if (!intf) {
-					gbsim_error("interface not found for file: %s\n",
-						    event->name);
-					return NULL;
-				}
-
-				svc_request_send(GB_SVC_TYPE_MODULE_REMOVED,
-						 intf->interface_id);
-				gbsim_info("%s interface removed\n", event->name);
+static void *inotify_thread(void *param)
+{
+	struct pollfd pfd = { .fd = notify_fd, .events = POLLIN };
+	struct gbsim_svc *svc = param;
+	struct hotplug_head pending;
+	uint64_t first = 0, last = 0, now, deadline;
+	int timeout;
+	int ret;
+
+	TAILQ_INIT(&pending);
+
+	while (1) {
+		timeout = -1;
+		if (!TAILQ_EMPTY(&pending)) {
+			now = hotplug_now_ms();
+			deadline = last + HOTPLUG_SETTLE_MS;
+			if (deadline > first + HOTPLUG_MAX_DELAY_MS)
+				deadline = first + HOTPLUG_MAX_DELAY_MS;
+			if (now >= deadline) {
+				hotplug_process(svc, &pending);
+				first = 0;
+				continue;
 			}
+			timeout = deadline - now;
 		}
-	} while (length >= 0);
+
+		ret = poll(&pfd, 1, timeout);
+		if (ret < 0 && errno != EINTR) {
+			gbsim_error("inotify poll: %s\n", strerror(errno));
+			return NULL;
+		}
+		if (ret <= 0)
+			continue;
+
+		if (inotify_read_events(&pending) < 0)
+			return NULL;
+
+		now = hotplug_now_ms();
+		if (!first)
+			first = now;
+		last = now;
+	}
 
 	return NULL;
 }
@@ -221,7 +380,9 @@ int inotify_start(struct gbsim_svc *svc, char *base_dir)
 	if ((notify_fd = inotify_init()) < 0)
 		perror("inotify init failed");
 
-	if ((notify_wd = inotify_add_watch(notify_fd, root, IN_CLOSE_WRITE|IN_DELETE)) < 0)
+	if ((notify_wd = inotify_add_watch(notify_fd, root, IN_CLOSE_WRITE |
+					   IN_DELETE | IN_MOVED_TO |
+					   IN_MOVED_FROM)) < 0)
 		perror("inotify add watch failed");
 
 	ret = pthread_create(&inotify_pthread, NULL, inotify_thread, svc);
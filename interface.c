@@ -9,31 +9,111 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/queue.h>
 
 #include "gbsim.h"
 
-struct gbsim_interface *interface_get_by_hash(struct gbsim_svc *svc,
-					      uint32_t hash)
+static unsigned int interface_fname_bucket(const char *fname)
+{
+	return manifest_hash(fname, strlen(fname)) % GBSIM_FNAME_BUCKETS;
+}
+
+/*
+ * svc->intf_lock guards the interface list and its indexes. Interfaces
+ * are only freed on the receive thread, or at exit, so that thread can
+ * keep using what it looked up; other threads must not use an interface
+ * the AP may have disabled.
+ */
+static struct gbsim_interface *
+interface_get_by_fname_locked(struct gbsim_svc *svc, const char *fname)
 {
 	struct gbsim_interface *intf;
 
-	TAILQ_FOREACH(intf, &svc->intfs, intf_node)
-		if (intf->manifest_fname_hash == hash)
+	intf = svc->intf_by_fname[interface_fname_bucket(fname)];
+	for (; intf; intf = intf->fname_next)
+		if (!strcmp(intf->manifest_fname, fname))
 			return intf;
 
 	return NULL;
 }
 
+struct gbsim_interface *interface_get_by_fname(struct gbsim_svc *svc,
+					       const char *fname)
+{
+	struct gbsim_interface *intf;
+
+	pthread_mutex_lock(&svc->intf_lock);
+	intf = interface_get_by_fname_locked(svc, fname);
+	pthread_mutex_unlock(&svc->intf_lock);
+
+	return intf;
+}
+
+static void interface_del_fname_locked(struct gbsim_svc *svc,
+				       struct gbsim_interface *intf)
+{
+	struct gbsim_interface **pp;
+
+	if (!intf->manifest_fname)
+		return;
+
+	pp = &svc->intf_by_fname[interface_fname_bucket(intf->manifest_fname)];
+	for (; *pp; pp = &(*pp)->fname_next) {
+		if (*pp == intf) {
+			*pp = intf->fname_next;
+			break;
+		}
+	}
+
+	free(intf->manifest_fname);
+	intf->manifest_fname = NULL;
+	intf->fname_next = NULL;
+}
+
+void interface_del_fname(struct gbsim_svc *svc, struct gbsim_interface *intf)
+{
+	pthread_mutex_lock(&svc->intf_lock);
+	interface_del_fname_locked(svc, intf);
+	pthread_mutex_unlock(&svc->intf_lock);
+}
+
+int interface_set_fname(struct gbsim_svc *svc, struct gbsim_interface *intf,
+			const char *fname)
+{
+	struct gbsim_interface **head;
+	char *name;
+
+	name = strdup(fname);
+	if (!name)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&svc->intf_lock);
+	if (interface_get_by_fname_locked(svc, fname)) {
+		pthread_mutex_unlock(&svc->intf_lock);
+		free(name);
+		return -EEXIST;
+	}
+
+	interface_del_fname_locked(svc, intf);
+	intf->manifest_fname = name;
+	head = &svc->intf_by_fname[interface_fname_bucket(name)];
+	intf->fname_next = *head;
+	*head = intf;
+	pthread_mutex_unlock(&svc->intf_lock);
+
+	return 0;
+}
+
 struct gbsim_interface *interface_get_by_id(struct gbsim_svc *svc, uint8_t id)
 {
 	struct gbsim_interface *intf;
 
-	TAILQ_FOREACH(intf, &svc->intfs, intf_node)
-		if (intf->interface_id == id)
-			return intf;
+	pthread_mutex_lock(&svc->intf_lock);
+	intf = svc->intf_by_id[id];
+	pthread_mutex_unlock(&svc->intf_lock);
 
-	return NULL;
+	return intf;
 }
 
 void interface_free(struct gbsim_svc *svc, struct gbsim_interface *intf)
@@ -41,11 +121,18 @@ void interface_free(struct gbsim_svc *svc, struct gbsim_interface *intf)
 	struct gbsim_connection *connection;
 
 	gbsim_debug("free interface %u\n", intf->interface_id);
-	TAILQ_FOREACH(connection, &intf->connections, cnode)
+	while ((connection = TAILQ_FIRST(&intf->connections)))
 		free_connection(connection);
 
+	pthread_mutex_lock(&svc->intf_lock);
 	TAILQ_REMOVE(&svc->intfs, intf, intf_node);
-	free(intf->manifest);
+	svc->intf_by_id[intf->interface_id] = NULL;
+	svc->intf_id_map[intf->interface_id / 32] &=
+		~(1U << (intf->interface_id % 32));
+	interface_del_fname_locked(svc, intf);
+	pthread_mutex_unlock(&svc->intf_lock);
+
+	manifest_attach(intf, NULL);
 	free(intf);
 }
 
@@ -53,15 +140,19 @@ struct gbsim_interface *interface_alloc(struct gbsim_svc *svc, uint8_t id)
 {
 	struct gbsim_interface *intf;
 
-	intf = interface_get_by_id(svc, id);
+	pthread_mutex_lock(&svc->intf_lock);
+	intf = svc->intf_by_id[id];
 	if (intf) {
+		pthread_mutex_unlock(&svc->intf_lock);
 		gbsim_error("allocated an already existent interface %u\n", id);
 		return intf;
 	}
 
 	intf = calloc(1, sizeof(*intf));
-	if (!intf)
+	if (!intf) {
+		pthread_mutex_unlock(&svc->intf_lock);
 		return NULL;
+	}
 
 	TAILQ_INIT(&intf->connections);
 	intf->interface_id = id;
@@ -69,6 +160,9 @@ struct gbsim_interface *interface_alloc(struct gbsim_svc *svc, uint8_t id)
 	intf->svc = svc;
 
 	TAILQ_INSERT_TAIL(&svc->intfs, intf, intf_node);
+	svc->intf_by_id[id] = intf;
+	svc->intf_id_map[id / 32] |= 1U << (id % 32);
+	pthread_mutex_unlock(&svc->intf_lock);
 
 	return intf;
 }
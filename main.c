@@ -19,11 +19,21 @@
 #include "gbsim_usb.h"
 
 int bbb_backend = 1;
+int gpio_cdev;
+int gpio_irq_rate;
+int gpio_sim;
 int i2c_adapter = 0;
+char *i2c_config;
+char *pwm_config;
 int spi_busno = 0;
 int spi_csno = 0;
+char *spi_nor_image;
+char *spi_config;
+char *stress_config;
 int uart_portno = 0;
 int uart_count = 0;
+int uart_pty = 0;
+int uart_pty_pace = 0;
 int gbsim_id=0;
 char *hotplug_basedir="/tmp/gbsim";
 int verbose = 0;
@@ -48,9 +58,15 @@ static void cleanup(void)
 		}
 
 	closedir(hotplugdir);
+	stress_cleanup();
 	uart_cleanup();
+	spi_cleanup();
+	i2c_cleanup();
+	pwm_cleanup();
 	gbsim_usb_cleanup();
 	svc_exit();
+	mnfs_cleanup();
+	manifest_cache_cleanup();
 }
 
 static void signal_handler(int sig)
@@ -74,7 +90,7 @@ int main(int argc, char *argv[])
 	int ret = -EINVAL;
 	int o;
 
-	while ((o = getopt(argc, argv, ":bc:g:h:i:s:u:U:v")) != -1) {
+	while ((o = getopt(argc, argv, ":bc:g:Gh:i:I:M:N:pPr:s:S:u:U:vw:x")) != -1) {
 		switch (o) {
 		case 'b':
 			bbb_backend = 1;
@@ -84,6 +100,10 @@ int main(int argc, char *argv[])
 			spi_csno = atoi(optarg);
 			printf("SPI CS No. %d\n", spi_csno);
 			break;
+		case 'G':
+			gpio_cdev = 1;
+			printf("gpio_cdev %d\n", gpio_cdev);
+			break;
 		case 'g':
 			gbsim_id = atoi(optarg);
 			printf("GBSIM ID. %d\n", gbsim_id);
@@ -95,10 +115,38 @@ int main(int argc, char *argv[])
 			i2c_adapter = atoi(optarg);
 			printf("i2c_adapter %d\n", i2c_adapter);
 			break;
+		case 'I':
+			i2c_config = optarg;
+			printf("I2C config %s\n", i2c_config);
+			break;
+		case 'M':
+			stress_config = optarg;
+			printf("stress config %s\n", stress_config);
+			break;
+		case 'N':
+			spi_nor_image = optarg;
+			printf("SPI NOR image %s\n", spi_nor_image);
+			break;
+		case 'p':
+			uart_pty = 1;
+			printf("uart_pty %d\n", uart_pty);
+			break;
+		case 'P':
+			uart_pty_pace = 1;
+			printf("uart_pty_pace %d\n", uart_pty_pace);
+			break;
+		case 'r':
+			gpio_irq_rate = atoi(optarg);
+			printf("gpio_irq_rate %d\n", gpio_irq_rate);
+			break;
 		case 's':
 			spi_busno = atoi(optarg);
 			printf("SPI Bus No. %d\n", spi_busno);
 			break;
+		case 'S':
+			spi_config = optarg;
+			printf("SPI config %s\n", spi_config);
+			break;
 		case 'u':
 			uart_portno = atoi(optarg);
 			printf("uart_portno %d\n", uart_portno);
@@ -111,15 +159,35 @@ int main(int argc, char *argv[])
 			verbose = 1;
 			printf("verbose %d\n", verbose);
 			break;
+		case 'w':
+			pwm_config = optarg;
+			printf("PWM config %s\n", pwm_config);
+			break;
+		case 'x':
+			gpio_sim = 1;
+			printf("gpio_sim %d\n", gpio_sim);
+			break;
 		case ':':
 			if (optopt == 'i')
 				gbsim_error("i2c_adapter required\n");
+			else if (optopt == 'I')
+				gbsim_error("i2c config required\n");
 			else if (optopt == 'h')
 				gbsim_error("hotplug_basedir required\n");
 			else if (optopt == 'u')
 				gbsim_error("uart_portno required\n");
 			else if (optopt == 'U')
 				gbsim_error("uart_count required\n");
+			else if (optopt == 'N')
+				gbsim_error("spi nor image required\n");
+			else if (optopt == 'r')
+				gbsim_error("gpio irq rate required\n");
+			else if (optopt == 'S')
+				gbsim_error("spi config required\n");
+			else if (optopt == 'w')
+				gbsim_error("pwm config required\n");
+			else if (optopt == 'M')
+				gbsim_error("stress config required\n");
 			else
 				gbsim_error("-%c requires an argument\n",
 					optopt);
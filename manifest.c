@@ -8,9 +8,14 @@
  */
 
 #include <errno.h>
-
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <linux/types.h>
 
 #include "gbsim.h"
@@ -25,7 +30,7 @@
  * Returns the number of bytes consumed by the descriptor, or a
  * negative errno.
  */
-static int identify_descriptor(struct gbsim_interface *intf,
+static int identify_descriptor(struct gbsim_manifest *mnf,
 			       struct greybus_descriptor *desc, size_t size)
 {
 	struct greybus_descriptor_header *desc_header = &desc->header;
@@ -84,6 +89,81 @@ static int identify_descriptor(struct gbsim_interface *intf,
 	return desc_size;
 }
 
+/*
+ * Store a descriptor in a table indexed by its id, growing the table to
+ * cover the id. Ids must be unique within a manifest.
+ */
+static int manifest_index_add(void ***table, unsigned int *num,
+			      unsigned int id, void *desc)
+{
+	void **t;
+
+	if (id >= *num) {
+		t = realloc(*table, (id + 1) * sizeof(*t));
+		if (!t)
+			return -ENOMEM;
+		memset(t + *num, 0, (id + 1 - *num) * sizeof(*t));
+		*table = t;
+		*num = id + 1;
+	}
+
+	if ((*table)[id])
+		return -EEXIST;
+
+	(*table)[id] = desc;
+	return 0;
+}
+
+static int manifest_index_descriptor(struct gbsim_manifest *mnf,
+				     struct greybus_descriptor *desc)
+{
+	int ret = 0;
+
+	switch (desc->header.type) {
+	case GREYBUS_TYPE_STRING:
+		ret = manifest_index_add((void ***)&mnf->strings,
+					 &mnf->num_strings, desc->string.id,
+					 &desc->string);
+		break;
+	case GREYBUS_TYPE_INTERFACE:
+		if (mnf->intf_desc) {
+			gbsim_error("duplicate interface descriptor\n");
+			return -EINVAL;
+		}
+		mnf->intf_desc = &desc->interface;
+		break;
+	case GREYBUS_TYPE_BUNDLE:
+		ret = manifest_index_add((void ***)&mnf->bundles,
+					 &mnf->num_bundles, desc->bundle.id,
+					 &desc->bundle);
+		break;
+	case GREYBUS_TYPE_CPORT:
+		ret = manifest_index_add((void ***)&mnf->cports,
+					 &mnf->num_cports,
+					 le16toh(desc->cport.id), &desc->cport);
+		break;
+	}
+
+	if (ret == -EEXIST)
+		gbsim_error("duplicate %d descriptor id\n", desc->header.type);
+
+	return ret;
+}
+
+static void manifest_free_index(struct gbsim_manifest *mnf)
+{
+	free(mnf->strings);
+	free(mnf->bundles);
+	free(mnf->cports);
+	mnf->intf_desc = NULL;
+	mnf->strings = NULL;
+	mnf->num_strings = 0;
+	mnf->bundles = NULL;
+	mnf->num_bundles = 0;
+	mnf->cports = NULL;
+	mnf->num_cports = 0;
+}
+
 /*
  * Parse a buffer containing a Interface manifest.
  *
@@ -105,11 +185,14 @@ static int identify_descriptor(struct gbsim_interface *intf,
  * After that we look for the interface's bundles--there must be at
  * least one of those.
  *
+ * The same pass indexes the string, bundle and CPort descriptors by id,
+ * so later lookups don't rescan the manifest.
+ *
  * Returns true if parsing was successful, false otherwise.
  */
-bool manifest_parse(struct gbsim_svc *svc, int intf_id, void *data, size_t size)
+bool manifest_parse(struct gbsim_manifest *mnf)
 {
-	struct gbsim_interface *intf;
+	size_t size = mnf->size;
 	struct greybus_manifest *manifest;
 	struct greybus_manifest_header *header;
 	struct greybus_descriptor *desc;
@@ -121,8 +204,15 @@ bool manifest_parse(struct gbsim_svc *svc, int intf_id, void *data, size_t size)
 		return false;
 	}
 
+	/* The AP reads it back in a single GET_MANIFEST response */
+	if (size > GBSIM_MANIFEST_SIZE_MAX) {
+		gbsim_error("manifest too big (%zu > %zu)\n", size,
+			    GBSIM_MANIFEST_SIZE_MAX);
+		return false;
+	}
+
 	/* Make sure the size is right */
-	manifest = data;
+	manifest = mnf->data;
 	header = &manifest->header;
 	manifest_size = le16toh(header->size);
 	if (manifest_size != size) {
@@ -143,64 +233,65 @@ bool manifest_parse(struct gbsim_svc *svc, int intf_id, void *data, size_t size)
 	desc = (struct greybus_descriptor *)(header + 1);
 	size -= sizeof(*header);
 
-	intf = interface_get_by_id(svc, intf_id);
-	if (!intf)
-		return false;
-
-	intf->manifest = manifest;
-	intf->manifest_size = manifest_size;
+	manifest_free_index(mnf);
 
 	while (size) {
 		int desc_size;
 
-		desc_size = identify_descriptor(intf, desc, size);
+		desc_size = identify_descriptor(mnf, desc, size);
 		if (desc_size < 0)
-			return false;
+			goto err_free_index;
+
+		if (manifest_index_descriptor(mnf, desc) < 0)
+			goto err_free_index;
 
 		desc = (struct greybus_descriptor *)((char *)desc + desc_size);
 		size -= desc_size;
 	}
 
 	return true;
+
+err_free_index:
+	manifest_free_index(mnf);
+	return false;
 }
 
-struct greybus_descriptor *manifest_get_descriptor(struct gbsim_interface *intf,
-				   enum greybus_descriptor_type desc_type,
-				   int skip)
+struct greybus_descriptor_cport *manifest_get_cport(struct gbsim_interface *intf,
+						   uint16_t cport_id)
 {
-	struct greybus_manifest *manifest = intf->manifest;
-	struct greybus_manifest_header *header = &manifest->header;
-	struct greybus_descriptor_header *desc_header;
-	struct greybus_descriptor *desc;
-	__u16 size = intf->manifest_size;
-	int desc_size;
-	int offset = 0;
+	struct gbsim_manifest *mnf = intf->mnf;
 
-	desc = (struct greybus_descriptor *)(header + 1);
-	size -= sizeof(*header);
+	if (!mnf || cport_id >= mnf->num_cports)
+		return NULL;
 
-	while (size) {
-		desc_header = &desc->header;
-		desc_size = (int)le16toh(desc_header->size);
+	return mnf->cports[cport_id];
+}
 
-		if (desc_header->type == desc_type && offset == skip)
-			return desc;
+struct greybus_descriptor_bundle *manifest_get_bundle(struct gbsim_interface *intf,
+						     uint8_t bundle_id)
+{
+	struct gbsim_manifest *mnf = intf->mnf;
 
-		if (desc_header->type == desc_type)
-			offset++;
+	if (!mnf || bundle_id >= mnf->num_bundles)
+		return NULL;
 
-		/* Descriptor needs to at least have a header */
-		desc = (struct greybus_descriptor *)((char *)desc + desc_size);
-		size -= desc_size;
-	}
+	return mnf->bundles[bundle_id];
+}
 
-	return NULL;
+struct greybus_descriptor_string *manifest_get_string(struct gbsim_interface *intf,
+						     uint8_t string_id)
+{
+	struct gbsim_manifest *mnf = intf->mnf;
+
+	if (!mnf || string_id >= mnf->num_strings)
+		return NULL;
+
+	return mnf->strings[string_id];
 }
 
 int cport_get_protocol(struct gbsim_interface *intf, uint16_t cport_id)
 {
-	struct greybus_descriptor *desc;
-	int skip = 0;
+	struct greybus_descriptor_cport *cport;
 
 	if (intf->interface_id == 0 && cport_id == GB_SVC_CPORT_ID)
 		return GREYBUS_PROTOCOL_SVC;
@@ -208,14 +299,265 @@ int cport_get_protocol(struct gbsim_interface *intf, uint16_t cport_id)
 	if (cport_id == GB_CONTROL_CPORT_ID)
 		return GREYBUS_PROTOCOL_CONTROL;
 
-	do {
-		desc = manifest_get_descriptor(intf, GREYBUS_TYPE_CPORT, skip);
-		if (!desc)
-			return -EINVAL;
-		if (desc->cport.id == cport_id)
-			return desc->cport.protocol_id;
-		skip++;
-	} while (desc);
+	cport = manifest_get_cport(intf, cport_id);
+	if (!cport)
+		return -EINVAL;
+
+	return cport->protocol_id;
+}
+
+/*
+ * Manifests are cached by content so that a module inserted again, or a
+ * second module with the same manifest, reuses the validated and indexed
+ * copy. The bytes live in their own read-only mapping. A file whose
+ * device, inode, size and mtime match the last load of an entry is not
+ * read at all. Unreferenced entries are kept, and the least recently used
+ * ones are dropped beyond MANIFEST_CACHE_MAX.
+ */
+#define MANIFEST_CACHE_MAX	32
+
+static TAILQ_HEAD(gbsim_manifest_head, gbsim_manifest) manifest_cache =
+	TAILQ_HEAD_INITIALIZER(manifest_cache);
+static pthread_mutex_t manifest_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long manifest_cache_hits;
+static unsigned long manifest_cache_misses;
+
+/* 64-bit FNV-1a */
+uint64_t manifest_hash(const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (size--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
 
-	return -EINVAL;
+	return hash;
+}
+
+static void manifest_free(struct gbsim_manifest *mnf)
+{
+	manifest_free_index(mnf);
+	munmap(mnf->data, mnf->size);
+	free(mnf);
+}
+
+/* Called with the cache lock held */
+static void manifest_cache_trim(void)
+{
+	struct gbsim_manifest *mnf, *prev;
+	int unused = 0;
+
+	TAILQ_FOREACH(mnf, &manifest_cache, node)
+		if (!mnf->refcount)
+			unused++;
+
+	for (mnf = TAILQ_LAST(&manifest_cache, gbsim_manifest_head);
+	     mnf && unused > MANIFEST_CACHE_MAX; mnf = prev) {
+		prev = TAILQ_PREV(mnf, gbsim_manifest_head, node);
+		if (mnf->refcount)
+			continue;
+		TAILQ_REMOVE(&manifest_cache, mnf, node);
+		manifest_free(mnf);
+		unused--;
+	}
+}
+
+/* Called with the cache lock held, takes a reference on a hit */
+static struct gbsim_manifest *manifest_cache_hit(struct gbsim_manifest *mnf)
+{
+	TAILQ_REMOVE(&manifest_cache, mnf, node);
+	TAILQ_INSERT_HEAD(&manifest_cache, mnf, node);
+	mnf->refcount++;
+	manifest_cache_hits++;
+
+	return mnf;
+}
+
+/*
+ * Look up a manifest by content, or validate and cache it. The mapping
+ * is taken over by the new entry, and unmapped otherwise.
+ */
+static struct gbsim_manifest *manifest_cache_add(void *map, size_t size,
+						 const struct stat *st)
+{
+	struct gbsim_manifest *mnf;
+	uint64_t hash;
+
+	hash = manifest_hash(map, size);
+
+	pthread_mutex_lock(&manifest_cache_lock);
+	TAILQ_FOREACH(mnf, &manifest_cache, node) {
+		if (mnf->hash != hash || mnf->size != size ||
+		    memcmp(mnf->data, map, size))
+			continue;
+		munmap(map, size);
+		goto out_hit;
+	}
+
+	mnf = calloc(1, sizeof(*mnf));
+	if (!mnf)
+		goto err_unlock;
+	mnf->data = map;
+	mnf->size = size;
+	mnf->hash = hash;
+
+	if (!manifest_parse(mnf)) {
+		free(mnf);
+		goto err_unlock;
+	}
+	mprotect(map, size, PROT_READ);
+
+	TAILQ_INSERT_HEAD(&manifest_cache, mnf, node);
+	manifest_cache_misses++;
+	mnf->refcount++;
+	manifest_cache_trim();
+	goto out;
+
+out_hit:
+	manifest_cache_hit(mnf);
+out:
+	if (st) {
+		mnf->dev = st->st_dev;
+		mnf->ino = st->st_ino;
+		mnf->file_size = st->st_size;
+		mnf->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 +
+				st->st_mtim.tv_nsec;
+	}
+	pthread_mutex_unlock(&manifest_cache_lock);
+
+	return mnf;
+
+err_unlock:
+	pthread_mutex_unlock(&manifest_cache_lock);
+	munmap(map, size);
+	return NULL;
+}
+
+static void *manifest_map(size_t size)
+{
+	void *map;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	return map == MAP_FAILED ? NULL : map;
+}
+
+/*
+ * Get a reference to the manifest in the blob file at path, reading and
+ * validating it only when its content isn't cached yet.
+ */
+struct gbsim_manifest *manifest_get(const char *path)
+{
+	struct gbsim_manifest *mnf;
+	__le16 file_size;
+	struct stat st;
+	uint16_t size;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		gbsim_error("failed to open manifest blob %s\n", path);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		gbsim_error("failed to stat manifest blob %s\n", path);
+		goto out;
+	}
+
+	pthread_mutex_lock(&manifest_cache_lock);
+	TAILQ_FOREACH(mnf, &manifest_cache, node) {
+		if (mnf->dev == st.st_dev && mnf->ino == st.st_ino &&
+		    mnf->file_size == st.st_size &&
+		    mnf->mtime_ns == (int64_t)st.st_mtim.tv_sec * 1000000000 +
+				     st.st_mtim.tv_nsec) {
+			manifest_cache_hit(mnf);
+			pthread_mutex_unlock(&manifest_cache_lock);
+			close(fd);
+			return mnf;
+		}
+	}
+	pthread_mutex_unlock(&manifest_cache_lock);
+
+	/* The size field leads the blob and has to cover at least itself */
+	if (pread(fd, &file_size, 2, 0) != 2) {
+		gbsim_error("failed to read manifest size\n");
+		goto out;
+	}
+	size = le16toh(file_size);
+	if (size < 2 || size > st.st_size) {
+		gbsim_error("bad manifest size %hu\n", size);
+		goto out;
+	}
+
+	map = manifest_map(size);
+	if (!map) {
+		gbsim_error("failed to allocate manifest buffer\n");
+		goto out;
+	}
+	if (pread(fd, map, size, 0) != size) {
+		gbsim_error("failed to read manifest\n");
+		munmap(map, size);
+		goto out;
+	}
+	close(fd);
+
+	return manifest_cache_add(map, size, &st);
+out:
+	close(fd);
+
+	return NULL;
+}
+
+/* As manifest_get(), for a manifest built in memory */
+struct gbsim_manifest *manifest_get_data(const void *data, size_t size)
+{
+	void *map;
+
+	map = manifest_map(size);
+	if (!map)
+		return NULL;
+	memcpy(map, data, size);
+
+	return manifest_cache_add(map, size, NULL);
+}
+
+void manifest_put(struct gbsim_manifest *mnf)
+{
+	pthread_mutex_lock(&manifest_cache_lock);
+	if (!--mnf->refcount)
+		manifest_cache_trim();
+	pthread_mutex_unlock(&manifest_cache_lock);
+}
+
+/* Point the interface at mnf, dropping its previous manifest if any */
+void manifest_attach(struct gbsim_interface *intf, struct gbsim_manifest *mnf)
+{
+	if (intf->mnf)
+		manifest_put(intf->mnf);
+
+	intf->mnf = mnf;
+	intf->manifest = mnf ? mnf->data : NULL;
+	intf->manifest_size = mnf ? mnf->size : 0;
+}
+
+void manifest_cache_cleanup(void)
+{
+	struct gbsim_manifest *mnf, *next;
+
+	pthread_mutex_lock(&manifest_cache_lock);
+	gbsim_info("manifest cache: %lu hits, %lu misses\n",
+		   manifest_cache_hits, manifest_cache_misses);
+	for (mnf = TAILQ_FIRST(&manifest_cache); mnf; mnf = next) {
+		next = TAILQ_NEXT(mnf, node);
+		if (mnf->refcount)
+			continue;
+		TAILQ_REMOVE(&manifest_cache, mnf, node);
+		manifest_free(mnf);
+	}
+	pthread_mutex_unlock(&manifest_cache_lock);
 }
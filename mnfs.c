@@ -0,0 +1,517 @@
+/*
+ * Greybus Simulator: manifest source compiler
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/types.h>
+
+#include "gbsim.h"
+
+#define MNFS_MAX_SIZE		UINT16_MAX
+#define MNFS_CACHE_MAX		32
+
+/*
+ * Compiles the INI-style manifest sources read by the manifesto tool:
+ *
+ *   [manifest-header]
+ *   version-major = 0
+ *   version-minor = 1
+ *
+ *   [interface-descriptor]
+ *   vendor-string-id = 1
+ *   product-string-id = 2
+ *
+ *   [string-descriptor 1]
+ *   string = Project Ara
+ *
+ *   [bundle-descriptor 1]
+ *   class = 0x0a
+ *
+ *   [cport-descriptor 1]
+ *   bundle = 1
+ *   protocol = 0x02
+ *
+ * Lines starting with ';' or '#' are comments, and "key: value" is
+ * accepted as well as "key = value".
+ */
+struct mnfs_section {
+	int type;		/* GREYBUS_TYPE_*, or -1 for the header */
+	unsigned long id;
+	unsigned long vals[3];
+	const char *string;
+	int line;
+};
+
+struct mnfs_out {
+	uint8_t *buf;
+	size_t len;
+	size_t max;
+	const char *name;
+	bool have_header;
+	bool have_intf;
+};
+
+static const struct {
+	const char *name;
+	int type;
+	bool has_id;
+	const char *keys[3];
+} mnfs_sections[] = {
+	{ "manifest-header", -1, false,
+	  { "version-major", "version-minor" } },
+	{ "interface-descriptor", GREYBUS_TYPE_INTERFACE, false,
+	  { "vendor-string-id", "product-string-id", "features" } },
+	{ "string-descriptor", GREYBUS_TYPE_STRING, true, { NULL } },
+	{ "bundle-descriptor", GREYBUS_TYPE_BUNDLE, true, { "class" } },
+	{ "cport-descriptor", GREYBUS_TYPE_CPORT, true,
+	  { "bundle", "protocol" } },
+};
+
+static int mnfs_section_find(int type)
+{
+	int i;
+
+	for (i = 0; i < sizeof(mnfs_sections) / sizeof(mnfs_sections[0]); i++)
+		if (mnfs_sections[i].type == type)
+			return i;
+
+	return -1;
+}
+
+static void *mnfs_reserve(struct mnfs_out *out, size_t len)
+{
+	uint8_t *buf;
+	size_t max;
+
+	if (out->len + len > MNFS_MAX_SIZE) {
+		gbsim_error("%s: manifest too big\n", out->name);
+		return NULL;
+	}
+
+	if (out->len + len > out->max) {
+		max = out->max ? out->max * 2 : 256;
+		while (max < out->len + len)
+			max *= 2;
+		buf = realloc(out->buf, max);
+		if (!buf)
+			return NULL;
+		out->buf = buf;
+		out->max = max;
+	}
+
+	buf = out->buf + out->len;
+	memset(buf, 0, len);
+	out->len += len;
+
+	return buf;
+}
+
+/* Emit the descriptor for a completed section */
+static int mnfs_emit(struct mnfs_out *out, struct mnfs_section *sec)
+{
+	struct greybus_manifest_header *mh;
+	struct greybus_descriptor *desc;
+	size_t size, len = 0;
+
+	if (sec->type < 0) {
+		if (out->have_header) {
+			gbsim_error("%s:%d: duplicate manifest-header\n",
+				    out->name, sec->line);
+			return -EINVAL;
+		}
+		mh = (struct greybus_manifest_header *)out->buf;
+		mh->version_major = sec->vals[0];
+		mh->version_minor = sec->vals[1];
+		out->have_header = true;
+		return 0;
+	}
+
+	size = sizeof(desc->header);
+	switch (sec->type) {
+	case GREYBUS_TYPE_INTERFACE:
+		if (out->have_intf) {
+			gbsim_error("%s:%d: duplicate interface-descriptor\n",
+				    out->name, sec->line);
+			return -EINVAL;
+		}
+		out->have_intf = true;
+		size += sizeof(desc->interface);
+		break;
+	case GREYBUS_TYPE_STRING:
+		len = sec->string ? strlen(sec->string) : 0;
+		if (len > UINT8_MAX) {
+			gbsim_error("%s:%d: string too long\n", out->name,
+				    sec->line);
+			return -EINVAL;
+		}
+		size = ALIGN(size + sizeof(desc->string) + len);
+		break;
+	case GREYBUS_TYPE_BUNDLE:
+		size += sizeof(desc->bundle);
+		break;
+	case GREYBUS_TYPE_CPORT:
+		size += sizeof(desc->cport);
+		break;
+	}
+
+	desc = mnfs_reserve(out, size);
+	if (!desc)
+		return -ENOMEM;
+
+	desc->header.size = htole16(size);
+	desc->header.type = sec->type;
+
+	switch (sec->type) {
+	case GREYBUS_TYPE_INTERFACE:
+		desc->interface.vendor_stringid = sec->vals[0];
+		desc->interface.product_stringid = sec->vals[1];
+		desc->interface.features = sec->vals[2];
+		break;
+	case GREYBUS_TYPE_STRING:
+		desc->string.length = len;
+		desc->string.id = sec->id;
+		memcpy(desc->string.string, sec->string, len);
+		break;
+	case GREYBUS_TYPE_BUNDLE:
+		desc->bundle.id = sec->id;
+		desc->bundle.class = sec->vals[0];
+		break;
+	case GREYBUS_TYPE_CPORT:
+		desc->cport.id = htole16(sec->id);
+		desc->cport.bundle = sec->vals[0];
+		desc->cport.protocol_id = sec->vals[1];
+		break;
+	}
+
+	return 0;
+}
+
+static char *mnfs_strip(char *s)
+{
+	char *end;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+
+	return s;
+}
+
+static int mnfs_parse_number(struct mnfs_out *out, int line, const char *s,
+			     unsigned long max, unsigned long *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoul(s, &end, 0);
+	if (errno || end == s || *end || *val > max) {
+		gbsim_error("%s:%d: bad value %s\n", out->name, line, s);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int mnfs_section_start(struct mnfs_out *out, struct mnfs_section *sec,
+			      char *p, int line)
+{
+	char *end, *id;
+	int i, n;
+
+	end = strchr(p, ']');
+	if (!end || *mnfs_strip(end + 1)) {
+		gbsim_error("%s:%d: bad section\n", out->name, line);
+		return -EINVAL;
+	}
+	*end = '\0';
+	p = mnfs_strip(p + 1);
+
+	id = p + strcspn(p, " \t");
+	if (*id)
+		*id++ = '\0';
+	id = mnfs_strip(id);
+
+	n = sizeof(mnfs_sections) / sizeof(mnfs_sections[0]);
+	for (i = 0; i < n; i++)
+		if (!strcmp(mnfs_sections[i].name, p))
+			break;
+	if (i == n) {
+		gbsim_error("%s:%d: unsupported section %s\n", out->name,
+			    line, p);
+		return -EINVAL;
+	}
+
+	memset(sec, 0, sizeof(*sec));
+	sec->type = mnfs_sections[i].type;
+	sec->line = line;
+
+	if (!mnfs_sections[i].has_id) {
+		if (*id) {
+			gbsim_error("%s:%d: unexpected id\n", out->name, line);
+			return -EINVAL;
+		}
+		return 0;
+	}
+
+	if (!*id) {
+		gbsim_error("%s:%d: missing id\n", out->name, line);
+		return -EINVAL;
+	}
+
+	return mnfs_parse_number(out, line, id,
+				 sec->type == GREYBUS_TYPE_CPORT ?
+				 UINT16_MAX : UINT8_MAX, &sec->id);
+}
+
+static int mnfs_key(struct mnfs_out *out, struct mnfs_section *sec,
+		    char *key, char *val, int line)
+{
+	int s = mnfs_section_find(sec->type);
+	int i;
+
+	if (sec->type == GREYBUS_TYPE_STRING) {
+		if (strcmp(key, "string"))
+			goto unknown;
+		sec->string = val;
+		return 0;
+	}
+
+	for (i = 0; i < 3 && mnfs_sections[s].keys[i]; i++)
+		if (!strcmp(mnfs_sections[s].keys[i], key))
+			return mnfs_parse_number(out, line, val, UINT8_MAX,
+						 &sec->vals[i]);
+
+unknown:
+	gbsim_error("%s:%d: unknown key %s\n", out->name, line, key);
+	return -EINVAL;
+}
+
+/*
+ * Compile the manifest source in src, which is modified in place.
+ * Returns the malloced binary manifest, or NULL on error.
+ */
+static void *mnfs_compile(const char *name, char *src, size_t *size)
+{
+	struct greybus_manifest_header *mh;
+	struct mnfs_out out = { .name = name };
+	struct mnfs_section sec;
+	bool in_section = false;
+	char *next, *p, *val;
+	int line = 0;
+
+	mh = mnfs_reserve(&out, sizeof(*mh));
+	if (!mh)
+		return NULL;
+	mh->version_major = GREYBUS_VERSION_MAJOR;
+	mh->version_minor = GREYBUS_VERSION_MINOR;
+
+	for (p = src; p; p = next) {
+		next = strchr(p, '\n');
+		if (next)
+			*next++ = '\0';
+		line++;
+
+		p = mnfs_strip(p);
+		if (!*p || *p == ';' || *p == '#')
+			continue;
+
+		if (*p == '[') {
+			if (in_section && mnfs_emit(&out, &sec) < 0)
+				goto err;
+			if (mnfs_section_start(&out, &sec, p, line) < 0)
+				goto err;
+			in_section = true;
+			continue;
+		}
+
+		val = p + strcspn(p, "=:");
+		if (!in_section || !*val) {
+			gbsim_error("%s:%d: syntax error\n", name, line);
+			goto err;
+		}
+		*val++ = '\0';
+		if (mnfs_key(&out, &sec, mnfs_strip(p), mnfs_strip(val),
+			     line) < 0)
+			goto err;
+	}
+
+	if (in_section && mnfs_emit(&out, &sec) < 0)
+		goto err;
+
+	if (!out.have_intf) {
+		gbsim_error("%s: no interface-descriptor\n", name);
+		goto err;
+	}
+
+	mh = (struct greybus_manifest_header *)out.buf;
+	mh->size = htole16(out.len);
+	*size = out.len;
+
+	return out.buf;
+err:
+	free(out.buf);
+	return NULL;
+}
+
+/*
+ * Compiled manifests, keyed by a hash of their source, so a source
+ * dropped in again is not recompiled. Dropped least recently used first.
+ */
+struct mnfs_cache_entry {
+	uint64_t hash;
+	char *src;
+	size_t src_len;
+	void *blob;
+	size_t size;
+	struct mnfs_cache_entry *next;
+};
+
+static struct mnfs_cache_entry *mnfs_cache;
+static pthread_mutex_t mnfs_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long mnfs_cache_hits;
+static unsigned long mnfs_cache_misses;
+
+/* Takes over src and blob */
+static void mnfs_cache_insert(uint64_t hash, char *src, size_t src_len,
+			      void *blob, size_t size)
+{
+	struct mnfs_cache_entry *entry, **pp;
+	int n = 0;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		free(src);
+		free(blob);
+		return;
+	}
+	entry->hash = hash;
+	entry->src = src;
+	entry->src_len = src_len;
+	entry->blob = blob;
+	entry->size = size;
+
+	pthread_mutex_lock(&mnfs_cache_lock);
+	entry->next = mnfs_cache;
+	mnfs_cache = entry;
+	for (pp = &mnfs_cache; *pp; pp = &(*pp)->next) {
+		if (++n > MNFS_CACHE_MAX) {
+			entry = *pp;
+			*pp = NULL;
+			free(entry->src);
+			free(entry->blob);
+			free(entry);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mnfs_cache_lock);
+}
+
+/*
+ * Get a reference to the manifest compiled from the source file at
+ * path. The compiled blob goes through the manifest cache like any
+ * other, see manifest_get().
+ */
+struct gbsim_manifest *mnfs_get(const char *path)
+{
+	struct mnfs_cache_entry *entry, **pp;
+	struct gbsim_manifest *mnf = NULL;
+	struct stat st;
+	uint64_t hash;
+	size_t size;
+	char *src, *tmp;
+	void *blob;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		gbsim_error("failed to open manifest source %s\n", path);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size > 16 * MNFS_MAX_SIZE) {
+		gbsim_error("bad manifest source %s\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	src = malloc(st.st_size + 1);
+	if (!src) {
+		close(fd);
+		return NULL;
+	}
+	if (read(fd, src, st.st_size) != st.st_size) {
+		gbsim_error("failed to read manifest source %s\n", path);
+		goto out;
+	}
+	src[st.st_size] = '\0';
+	hash = manifest_hash(src, st.st_size);
+
+	pthread_mutex_lock(&mnfs_cache_lock);
+	for (pp = &mnfs_cache; (entry = *pp); pp = &entry->next) {
+		if (entry->hash != hash || entry->src_len != st.st_size ||
+		    memcmp(entry->src, src, st.st_size))
+			continue;
+		/* Move to the front */
+		*pp = entry->next;
+		entry->next = mnfs_cache;
+		mnfs_cache = entry;
+		mnfs_cache_hits++;
+		mnf = manifest_get_data(entry->blob, entry->size);
+		pthread_mutex_unlock(&mnfs_cache_lock);
+		goto out;
+	}
+	mnfs_cache_misses++;
+	pthread_mutex_unlock(&mnfs_cache_lock);
+
+	/* Compiling modifies the source, keep the original for the cache */
+	tmp = strdup(src);
+	if (!tmp)
+		goto out;
+	blob = mnfs_compile(path, tmp, &size);
+	free(tmp);
+	if (!blob)
+		goto out;
+
+	mnf = manifest_get_data(blob, size);
+	if (mnf) {
+		mnfs_cache_insert(hash, src, st.st_size, blob, size);
+		src = NULL;
+	} else {
+		free(blob);
+	}
+out:
+	free(src);
+	close(fd);
+
+	return mnf;
+}
+
+void mnfs_cleanup(void)
+{
+	struct mnfs_cache_entry *entry;
+
+	pthread_mutex_lock(&mnfs_cache_lock);
+	if (mnfs_cache_hits || mnfs_cache_misses)
+		gbsim_info("manifest source cache: %lu hits, %lu misses\n",
+			   mnfs_cache_hits, mnfs_cache_misses);
+	while ((entry = mnfs_cache)) {
+		mnfs_cache = entry->next;
+		free(entry->src);
+		free(entry->blob);
+		free(entry);
+	}
+	pthread_mutex_unlock(&mnfs_cache_lock);
+}
@@ -0,0 +1,323 @@
+/*
+ * Greybus Simulator: module-initiated operations
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/*
+ * Requests sent to the AP that expect a response are kept here until
+ * the response with their operation id comes back on their CPort. A
+ * request not answered by its deadline is sent again while it has
+ * retries left, and is then completed with -ETIMEDOUT. Operation ids
+ * are allocated per connection and skip ids still in flight.
+ */
+struct gbsim_operation {
+	TAILQ_ENTRY(gbsim_operation) node;
+	uint16_t hd_cport_id;
+	uint16_t operation_id;
+	uint8_t type;
+	unsigned int timeout_ms;
+	int retries;
+	uint64_t deadline_us;
+	struct op_msg *msg;	/* copy kept for retries */
+	uint16_t msg_size;
+	gbsim_op_callback callback;
+	void *data;
+};
+
+static TAILQ_HEAD(operation_head, gbsim_operation) operations =
+	TAILQ_HEAD_INITIALIZER(operations);
+static pthread_mutex_t operation_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t operation_cond;
+static pthread_once_t operation_once = PTHREAD_ONCE_INIT;
+static pthread_t operation_pthread;
+
+/* Used for requests sent before their connection is set up */
+static uint16_t operation_orphan_id;
+
+static uint64_t operation_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Called with operation_lock held */
+static struct gbsim_operation *operation_find(uint16_t hd_cport_id,
+					      uint16_t operation_id)
+{
+	struct gbsim_operation *op;
+
+	TAILQ_FOREACH(op, &operations, node)
+		if (op->hd_cport_id == hd_cport_id &&
+		    op->operation_id == operation_id)
+			return op;
+
+	return NULL;
+}
+
+/* Called with operation_lock held. Id 0 is for unidirectional requests. */
+static int operation_id_alloc(uint16_t hd_cport_id)
+{
+	struct gbsim_connection *connection;
+	uint16_t *last;
+	int i;
+
+	connection = connection_find(hd_cport_id);
+	last = connection ? &connection->operation_id : &operation_orphan_id;
+
+	for (i = 0; i < UINT16_MAX; i++) {
+		if (!++*last)
+			*last = 1;
+		if (!operation_find(hd_cport_id, *last))
+			return *last;
+	}
+
+	return -EBUSY;
+}
+
+static void operation_free(struct gbsim_operation *op)
+{
+	free(op->msg);
+	free(op);
+}
+
+static void *operation_thread(void *arg)
+{
+	struct gbsim_operation *op, *next;
+	struct timespec ts;
+	uint64_t now, earliest;
+	uint16_t hd_cport_id, operation_id, msg_size;
+	struct op_msg *msg;
+	uint8_t type;
+
+	pthread_mutex_lock(&operation_lock);
+	while (1) {
+		now = operation_now_us();
+		earliest = 0;
+
+		for (op = TAILQ_FIRST(&operations); op; op = next) {
+			next = TAILQ_NEXT(op, node);
+
+			if (op->deadline_us > now) {
+				if (!earliest || op->deadline_us < earliest)
+					earliest = op->deadline_us;
+				continue;
+			}
+
+			if (op->retries > 0) {
+				op->retries--;
+				op->deadline_us = now + op->timeout_ms * 1000;
+				if (!earliest || op->deadline_us < earliest)
+					earliest = op->deadline_us;
+
+				/*
+				 * Sending may block, and meanwhile the response
+				 * can complete op, so send a copy unlocked.
+				 */
+				msg = malloc(op->msg_size);
+				if (!msg)
+					continue;
+				memcpy(msg, op->msg, op->msg_size);
+				msg_size = op->msg_size;
+				hd_cport_id = op->hd_cport_id;
+				operation_id = op->operation_id;
+				type = op->type;
+				pthread_mutex_unlock(&operation_lock);
+
+				gbsim_debug("CPort %hu operation %hu (%02x) retried\n",
+					    hd_cport_id, operation_id, type);
+				send_request(hd_cport_id, msg, msg_size,
+					     htole16(operation_id), type);
+				free(msg);
+
+				pthread_mutex_lock(&operation_lock);
+				now = operation_now_us();
+				earliest = 0;
+				next = TAILQ_FIRST(&operations);
+				continue;
+			}
+
+			TAILQ_REMOVE(&operations, op, node);
+			pthread_mutex_unlock(&operation_lock);
+
+			gbsim_error("CPort %hu operation %hu (%02x) timed out\n",
+				    op->hd_cport_id, op->operation_id, op->type);
+			if (op->callback)
+				op->callback(op->data, NULL, 0, -ETIMEDOUT);
+			operation_free(op);
+
+			/* The list may have changed meanwhile */
+			pthread_mutex_lock(&operation_lock);
+			now = operation_now_us();
+			earliest = 0;
+			next = TAILQ_FIRST(&operations);
+		}
+
+		if (!earliest) {
+			pthread_cond_wait(&operation_cond, &operation_lock);
+			continue;
+		}
+
+		ts.tv_sec = earliest / 1000000;
+		ts.tv_nsec = (earliest % 1000000) * 1000;
+		pthread_cond_timedwait(&operation_cond, &operation_lock, &ts);
+	}
+
+	return NULL;
+}
+
+static void operation_thread_start(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&operation_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&operation_pthread, NULL, operation_thread, NULL))
+		gbsim_error("can't create operation thread\n");
+}
+
+/*
+ * Send a request to the AP on hd_cport_id. With a timeout_ms of 0 the
+ * request is unidirectional: it goes out with operation id 0 and is not
+ * tracked. Otherwise callback, if any, is called once with the response
+ * and its result, or with a NULL response and a negative errno.
+ *
+ * Returns the operation id used, or a negative errno. callback is never
+ * called for a request that returns an error.
+ */
+int send_request_async(uint16_t hd_cport_id, struct op_msg *message,
+		       uint16_t message_size, uint8_t type,
+		       unsigned int timeout_ms, int retries,
+		       gbsim_op_callback callback, void *data)
+{
+	struct gbsim_operation *op;
+	int operation_id;
+	int ret;
+
+	if (!timeout_ms)
+		return send_request(hd_cport_id, message, message_size, 0,
+				    type);
+
+	pthread_once(&operation_once, operation_thread_start);
+
+	op = calloc(1, sizeof(*op));
+	if (!op)
+		return -ENOMEM;
+	op->hd_cport_id = hd_cport_id;
+	op->type = type;
+	op->timeout_ms = timeout_ms;
+	op->callback = callback;
+	op->data = data;
+	if (retries > 0) {
+		op->msg = malloc(message_size);
+		if (!op->msg) {
+			free(op);
+			return -ENOMEM;
+		}
+		memcpy(op->msg, message, message_size);
+		op->msg_size = message_size;
+		op->retries = retries;
+	}
+
+	pthread_mutex_lock(&operation_lock);
+	operation_id = operation_id_alloc(hd_cport_id);
+	if (operation_id < 0) {
+		pthread_mutex_unlock(&operation_lock);
+		operation_free(op);
+		return operation_id;
+	}
+	op->operation_id = operation_id;
+	op->deadline_us = operation_now_us() + timeout_ms * 1000;
+	TAILQ_INSERT_TAIL(&operations, op, node);
+	pthread_cond_signal(&operation_cond);
+	pthread_mutex_unlock(&operation_lock);
+
+	ret = send_request(hd_cport_id, message, message_size,
+			   htole16(operation_id), type);
+	if (ret < 0) {
+		/*
+		 * No response can come, but op may have timed out or been
+		 * cancelled while sending, and its callback already run.
+		 */
+		pthread_mutex_lock(&operation_lock);
+		op = operation_find(hd_cport_id, operation_id);
+		if (op)
+			TAILQ_REMOVE(&operations, op, node);
+		pthread_mutex_unlock(&operation_lock);
+		if (!op)
+			return operation_id;
+		operation_free(op);
+		return ret;
+	}
+
+	return operation_id;
+}
+
+/*
+ * Match a response from the AP with its request. Returns 1 if a callback
+ * consumed it, 0 if the protocol handler should see it, or -ENOENT if
+ * no request is waiting for it.
+ */
+int operation_response(uint16_t hd_cport_id, struct op_msg *rsp,
+		       size_t rsize)
+{
+	struct gb_operation_msg_hdr *oph = &rsp->header;
+	struct gbsim_operation *op;
+
+	pthread_mutex_lock(&operation_lock);
+	op = operation_find(hd_cport_id, le16toh(oph->operation_id));
+	if (op)
+		TAILQ_REMOVE(&operations, op, node);
+	pthread_mutex_unlock(&operation_lock);
+
+	if (!op)
+		return -ENOENT;
+
+	if (!op->callback) {
+		operation_free(op);
+		return 0;
+	}
+
+	op->callback(op->data, rsp, rsize, oph->result);
+	operation_free(op);
+
+	return 1;
+}
+
+/* Complete every request waiting on hd_cport_id with -ESHUTDOWN */
+void operation_cancel(uint16_t hd_cport_id)
+{
+	struct gbsim_operation *op, *next;
+	struct operation_head cancelled = TAILQ_HEAD_INITIALIZER(cancelled);
+
+	pthread_mutex_lock(&operation_lock);
+	for (op = TAILQ_FIRST(&operations); op; op = next) {
+		next = TAILQ_NEXT(op, node);
+		if (op->hd_cport_id != hd_cport_id)
+			continue;
+		TAILQ_REMOVE(&operations, op, node);
+		TAILQ_INSERT_TAIL(&cancelled, op, node);
+	}
+	pthread_mutex_unlock(&operation_lock);
+
+	while ((op = TAILQ_FIRST(&cancelled))) {
+		TAILQ_REMOVE(&cancelled, op, node);
+		if (op->callback)
+			op->callback(op->data, NULL, 0, -ESHUTDOWN);
+		operation_free(op);
+	}
+}
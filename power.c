@@ -0,0 +1,235 @@
+/*
+ * Greybus Simulator: SVC power monitor model
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/*
+ * The current drawn by a module is an idle floor plus a share per rail
+ * driven by what the module is doing: the bytes moved on each protocol,
+ * GPIO value writes and edges, the duty cycle of enabled PWMs and the
+ * baud rate of its UART. Activity rates are averaged over at least
+ * POWER_WINDOW_US. All rails hang off VSYS, whose voltage sags with the
+ * total current of the modules.
+ */
+#define POWER_WINDOW_US		100000
+#define POWER_VSYS_UV		3300000
+#define POWER_VSYS_MOHM		50
+#define POWER_IDLE_UA		2000
+#define POWER_TOGGLE_UA		20	/* per GPIO toggle per second */
+#define POWER_PWM_UA		20000	/* per PWM fully on */
+#define POWER_UART_UA_PER_KBAUD	1
+
+static const char * const power_rail_name[POWER_NR_RAILS] = {
+	[POWER_RAIL_VSYS]	= "VSYS",
+	[POWER_RAIL_GPIO]	= "GPIO",
+	[POWER_RAIL_I2C]	= "I2C",
+	[POWER_RAIL_UART]	= "UART",
+	[POWER_RAIL_PWM]	= "PWM",
+	[POWER_RAIL_SPI]	= "SPI",
+};
+
+/* nA per byte/s; VSYS counts the traffic of the other protocols */
+static const uint32_t power_byte_na[POWER_NR_RAILS] = {
+	[POWER_RAIL_VSYS]	= 20,
+	[POWER_RAIL_GPIO]	= 50,
+	[POWER_RAIL_I2C]	= 80,
+	[POWER_RAIL_UART]	= 100,
+	[POWER_RAIL_PWM]	= 50,
+	[POWER_RAIL_SPI]	= 5,
+};
+
+static uint64_t power_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int power_rail(int protocol)
+{
+	switch (protocol) {
+	case GREYBUS_PROTOCOL_GPIO:
+		return POWER_RAIL_GPIO;
+	case GREYBUS_PROTOCOL_I2C:
+		return POWER_RAIL_I2C;
+	case GREYBUS_PROTOCOL_UART:
+		return POWER_RAIL_UART;
+	case GREYBUS_PROTOCOL_PWM:
+		return POWER_RAIL_PWM;
+	case GREYBUS_PROTOCOL_SPI:
+		return POWER_RAIL_SPI;
+	default:
+		return POWER_RAIL_VSYS;
+	}
+}
+
+/* Account a message of size bytes to or from the AP on connection */
+void power_count(struct gbsim_connection *connection, uint8_t type,
+		 size_t size)
+{
+	struct gbsim_interface *intf = connection->intf;
+	struct gbsim_power *pw;
+
+	/* The AP's own interface carries the SVC */
+	if (!intf || !intf->interface_id)
+		return;
+
+	pw = &intf->power;
+	__atomic_add_fetch(&pw->bytes[power_rail(connection->protocol)], size,
+			   __ATOMIC_RELAXED);
+
+	if (connection->protocol == GREYBUS_PROTOCOL_GPIO &&
+	    (type == GB_GPIO_TYPE_SET_VALUE || type == GB_GPIO_TYPE_IRQ_EVENT))
+		__atomic_add_fetch(&pw->toggles, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t power_rate(uint64_t *last, uint64_t *counter, uint64_t dt)
+{
+	uint64_t now = __atomic_load_n(counter, __ATOMIC_RELAXED);
+	uint64_t rate = dt ? (now - *last) * 1000000 / dt : 0;
+
+	*last = now;
+	return rate;
+}
+
+/* Called from the SVC handler only */
+static void power_update(struct gbsim_interface *intf, uint64_t now)
+{
+	struct gbsim_power *pw = &intf->power;
+	struct gbsim_connection *connection;
+	uint64_t ua[POWER_NR_RAILS];
+	uint64_t dt, total = POWER_IDLE_UA;
+	bool pwm = false;
+	int i;
+
+	if (pw->last_us && now - pw->last_us < POWER_WINDOW_US)
+		return;
+	dt = pw->last_us ? now - pw->last_us : 0;
+	pw->last_us = now;
+
+	for (i = 0; i < POWER_NR_RAILS; i++)
+		ua[i] = power_rate(&pw->last_bytes[i], &pw->bytes[i], dt) *
+			power_byte_na[i] / 1000;
+	ua[POWER_RAIL_GPIO] += power_rate(&pw->last_toggles, &pw->toggles,
+					  dt) * POWER_TOGGLE_UA;
+
+	TAILQ_FOREACH(connection, &intf->connections, cnode) {
+		if (connection->protocol == GREYBUS_PROTOCOL_PWM && !pwm) {
+			/* The PWM channels are shared by the connections */
+			ua[POWER_RAIL_PWM] += (uint64_t)pwm_load_ppm() *
+					      POWER_PWM_UA / 1000000;
+			pwm = true;
+		} else if (connection->protocol == GREYBUS_PROTOCOL_UART) {
+			ua[POWER_RAIL_UART] +=
+				uart_rate(connection->hd_cport_id) / 1000 *
+				POWER_UART_UA_PER_KBAUD;
+		}
+	}
+
+	for (i = 0; i < POWER_NR_RAILS; i++)
+		total += ua[i];
+	ua[POWER_RAIL_VSYS] = total;
+
+	for (i = 0; i < POWER_NR_RAILS; i++)
+		__atomic_store_n(&pw->rail_ua[i],
+				 ua[i] > UINT32_MAX ? UINT32_MAX : ua[i],
+				 __ATOMIC_RELAXED);
+}
+
+static uint8_t power_measure(uint8_t type, uint64_t ua, uint64_t total_ua,
+			     uint32_t *measurement)
+{
+	uint64_t sag = total_ua * POWER_VSYS_MOHM / 1000;
+	uint64_t uv = sag < POWER_VSYS_UV ? POWER_VSYS_UV - sag : 0;
+	uint64_t val;
+
+	switch (type) {
+	case GB_SVC_PWRMON_TYPE_CURR:
+		val = ua;
+		break;
+	case GB_SVC_PWRMON_TYPE_VOL:
+		val = uv;
+		break;
+	case GB_SVC_PWRMON_TYPE_PWR:
+		val = uv * ua / 1000000;
+		break;
+	default:
+		return GB_SVC_PWRMON_GET_SAMPLE_INVAL;
+	}
+
+	*measurement = val > UINT32_MAX ? UINT32_MAX : val;
+	return GB_SVC_PWRMON_GET_SAMPLE_OK;
+}
+
+uint8_t power_rail_count(void)
+{
+	return POWER_NR_RAILS;
+}
+
+/* Fill names with GB_SVC_PWRMON_RAIL_NAME_BUFSIZE bytes per rail */
+size_t power_rail_names(uint8_t *names, size_t size)
+{
+	size_t len = POWER_NR_RAILS * GB_SVC_PWRMON_RAIL_NAME_BUFSIZE;
+	int i;
+
+	if (len > size)
+		return 0;
+
+	memset(names, 0, len);
+	for (i = 0; i < POWER_NR_RAILS; i++)
+		strncpy((char *)names + i * GB_SVC_PWRMON_RAIL_NAME_BUFSIZE,
+			power_rail_name[i], GB_SVC_PWRMON_RAIL_NAME_BUFSIZE - 1);
+
+	return len;
+}
+
+/* A rail, summed over the modules; returns a GB_SVC_PWRMON_GET_SAMPLE_* */
+uint8_t power_sample(struct gbsim_svc *svc, uint8_t rail_id, uint8_t type,
+		     uint32_t *measurement)
+{
+	struct gbsim_interface *intf;
+	uint64_t now = power_now_us();
+	uint64_t ua = 0, total = 0;
+
+	if (rail_id >= POWER_NR_RAILS)
+		return GB_SVC_PWRMON_GET_SAMPLE_INVAL;
+
+	pthread_mutex_lock(&svc->intf_lock);
+	TAILQ_FOREACH(intf, &svc->intfs, intf_node) {
+		if (!intf->interface_id)
+			continue;
+		power_update(intf, now);
+		ua += __atomic_load_n(&intf->power.rail_ua[rail_id],
+				      __ATOMIC_RELAXED);
+		total += __atomic_load_n(&intf->power.rail_ua[POWER_RAIL_VSYS],
+					 __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&svc->intf_lock);
+
+	return power_measure(type, ua, total, measurement);
+}
+
+/* The VSYS share of one module */
+uint8_t power_intf_sample(struct gbsim_svc *svc, uint8_t intf_id,
+			  uint8_t type, uint32_t *measurement)
+{
+	struct gbsim_interface *intf;
+	uint64_t ua;
+
+	intf = interface_get_by_id(svc, intf_id);
+	if (!intf || !intf_id)
+		return GB_SVC_PWRMON_GET_SAMPLE_INVAL;
+
+	power_update(intf, power_now_us());
+	ua = __atomic_load_n(&intf->power.rail_ua[POWER_RAIL_VSYS],
+			     __ATOMIC_RELAXED);
+
+	return power_measure(type, ua, ua, measurement);
+}
@@ -1,4 +1,3 @@
-
 /*
  * Greybus Simulator
  *
@@ -8,20 +7,527 @@
  * Provided under the three clause BSD license found in the LICENSE file.
  */
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <libsoc_pwm.h>
 #include <linux/fs.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 
 #include "gbsim.h"
 
-static int pwm_on[2];
-static pwm *pwms[2];
+#define PWM_MAX_CHANNELS	32
+#define PWM_MAX_CHIPS		16
+#define PWM_MODEL_EVENTS	1024
+
+#define PWM_PERIOD	0
+#define PWM_DUTY	1
+#define PWM_POLARITY	2
+#define PWM_ENABLE	3
+#define PWM_NR_ATTRS	4
+
+static const char * const pwm_attr_names[PWM_NR_ATTRS] = {
+	[PWM_PERIOD]	= "period",
+	[PWM_DUTY]	= "duty_cycle",
+	[PWM_POLARITY]	= "polarity",
+	[PWM_ENABLE]	= "enable",
+};
+
+struct pwm_chan;
+
+struct pwm_backend {
+	const char *name;
+	int (*open)(struct pwm_chan *chan, const char *arg,
+		    char **opts, int num_opts);
+	int (*write)(struct pwm_chan *chan, int attr, uint32_t val);
+	void (*close)(struct pwm_chan *chan);
+};
+
+/*
+ * Shadow of a PWM channel. An attribute is only handed to the backend
+ * when the requested value differs from the last one written, or read
+ * back at open. A failed write makes the attribute unknown so the next
+ * request writes it again.
+ */
+struct pwm_chan {
+	const struct pwm_backend *backend;
+	int		index;
+	unsigned int	chip;
+	unsigned int	channel;
+	pwm		*pwm;
+	int		fd[PWM_NR_ATTRS];
+	uint32_t	val[PWM_NR_ATTRS];
+	uint32_t	known;
+	int		on;
+	unsigned long	writes;
+	unsigned long	skipped;
+	void		*priv;
+};
+
+struct pwm_chip {
+	unsigned int	num;
+	unsigned int	npwm;
+};
+
+struct pwm_event {
+	uint64_t	time_us;
+	uint32_t	val[PWM_NR_ATTRS];
+};
+
+/* Timeline of a model channel, the oldest events are overwritten */
+struct pwm_model {
+	struct pwm_event	events[PWM_MODEL_EVENTS];
+	unsigned long		count;
+	uint64_t		start_us;
+	char			*log;
+};
+
+static struct pwm_chan *pwm_chans[PWM_MAX_CHANNELS];
+static int pwm_num_chans;
+static struct pwm_chip pwm_chips[PWM_MAX_CHIPS];
+static int pwm_num_chips;
+
+static uint64_t pwm_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int pwm_attr_write(struct pwm_chan *chan, int attr, uint32_t val)
+{
+	int ret;
+
+	if ((chan->known & (1 << attr)) && chan->val[attr] == val) {
+		chan->skipped++;
+		return 0;
+	}
+
+	chan->writes++;
+	ret = chan->backend->write(chan, attr, val);
+	if (ret < 0) {
+		chan->known &= ~(1 << attr);
+		gbsim_error("PWM %d %s write %u failed: %s\n", chan->index,
+			    pwm_attr_names[attr], val, strerror(-ret));
+		return ret;
+	}
+
+	chan->val[attr] = val;
+	chan->known |= 1 << attr;
+	return 0;
+}
+
+/*
+ * The kernel rejects a period shorter than the current duty cycle and a
+ * duty cycle longer than the current period, so shrink whichever has to
+ * make room first.
+ */
+static int pwm_chan_config(struct pwm_chan *chan, uint32_t duty,
+			   uint32_t period)
+{
+	int ret;
+
+	if (!(chan->known & (1 << PWM_DUTY)) || period < chan->val[PWM_DUTY]) {
+		ret = pwm_attr_write(chan, PWM_DUTY, duty);
+		if (ret < 0)
+			return ret;
+		return pwm_attr_write(chan, PWM_PERIOD, period);
+	}
+
+	ret = pwm_attr_write(chan, PWM_PERIOD, period);
+	if (ret < 0)
+		return ret;
+	return pwm_attr_write(chan, PWM_DUTY, duty);
+}
+
+static int pwm_chip_cmp(const void *a, const void *b)
+{
+	const struct pwm_chip *ca = a, *cb = b;
+
+	return (int)ca->num - (int)cb->num;
+}
+
+static void pwm_chips_scan(void)
+{
+	struct pwm_chip *chip;
+	struct dirent *de;
+	char path[64];
+	char buf[16];
+	unsigned int num;
+	ssize_t len;
+	DIR *dir;
+	int fd;
+
+	dir = opendir("/sys/class/pwm");
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir)) && pwm_num_chips < PWM_MAX_CHIPS) {
+		if (sscanf(de->d_name, "pwmchip%u", &num) != 1)
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/class/pwm/pwmchip%u/npwm",
+			 num);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		len = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (len <= 0)
+			continue;
+		buf[len] = '\0';
+
+		chip = &pwm_chips[pwm_num_chips++];
+		chip->num = num;
+		chip->npwm = strtoul(buf, NULL, 10);
+	}
+	closedir(dir);
+
+	qsort(pwm_chips, pwm_num_chips, sizeof(pwm_chips[0]), pwm_chip_cmp);
+	for (chip = pwm_chips; chip < pwm_chips + pwm_num_chips; chip++)
+		gbsim_info("PWM chip %u: %u channels\n", chip->num, chip->npwm);
+}
+
+static struct pwm_chip *pwm_chip_find(unsigned int num)
+{
+	int i;
+
+	for (i = 0; i < pwm_num_chips; i++)
+		if (pwm_chips[i].num == num)
+			return &pwm_chips[i];
+
+	return NULL;
+}
+
+static int sysfs_write(struct pwm_chan *chan, int attr, uint32_t val)
+{
+	char buf[16];
+	int len;
+
+	if (attr == PWM_POLARITY)
+		len = snprintf(buf, sizeof(buf), "%s",
+			       val ? "inversed" : "normal");
+	else
+		len = snprintf(buf, sizeof(buf), "%u", val);
+
+	if (pwrite(chan->fd[attr], buf, len, 0) != len)
+		return -errno;
+
+	return 0;
+}
+
+/* pwmchipN/pwmM or N/M */
+static int sysfs_parse(const char *arg, unsigned int *chip,
+		       unsigned int *channel)
+{
+	char *end;
+
+	if (!arg)
+		return -EINVAL;
+	if (!strncmp(arg, "pwmchip", 7))
+		arg += 7;
+	*chip = strtoul(arg, &end, 10);
+	if (end == arg || *end != '/')
+		return -EINVAL;
+	arg = end + 1;
+	if (!strncmp(arg, "pwm", 3))
+		arg += 3;
+	*channel = strtoul(arg, &end, 10);
+	if (end == arg || *end)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int sysfs_open(struct pwm_chan *chan, const char *arg,
+		      char **opts, int num_opts)
+{
+	shared_mode mode = LS_PWM_WEAK;
+	struct pwm_chip *chip;
+	const char *opt;
+	char path[80];
+	char buf[16];
+	ssize_t len;
+	int i, ret;
+
+	if (sysfs_parse(arg, &chan->chip, &chan->channel) < 0) {
+		gbsim_error("PWM %d: bad sysfs channel %s\n", chan->index,
+			    arg ? arg : "(none)");
+		return -EINVAL;
+	}
+
+	chip = pwm_chip_find(chan->chip);
+	if (!chip || chan->channel >= chip->npwm) {
+		gbsim_error("PWM %d: no pwmchip%u/pwm%u\n", chan->index,
+			    chan->chip, chan->channel);
+		return -ENODEV;
+	}
+
+	for (i = 0; i < PWM_MAX_CHANNELS; i++) {
+		if (pwm_chans[i] && pwm_chans[i]->pwm &&
+		    pwm_chans[i]->chip == chan->chip &&
+		    pwm_chans[i]->channel == chan->channel) {
+			gbsim_error("PWM %d: pwmchip%u/pwm%u already used by PWM %d\n",
+				    chan->index, chan->chip, chan->channel, i);
+			return -EBUSY;
+		}
+	}
+
+	/* Refuse a channel exported by someone else unless told otherwise */
+	opt = conf_opt(opts, num_opts, "mode");
+	if (opt && !strcmp(opt, "shared"))
+		mode = LS_PWM_SHARED;
+	else if (opt && !strcmp(opt, "greedy"))
+		mode = LS_PWM_GREEDY;
+
+	chan->pwm = libsoc_pwm_request(chan->chip, chan->channel, mode);
+	if (!chan->pwm) {
+		gbsim_error("PWM %d: pwmchip%u/pwm%u busy\n", chan->index,
+			    chan->chip, chan->channel);
+		return -EBUSY;
+	}
+
+	for (i = 0; i < PWM_NR_ATTRS; i++) {
+		snprintf(path, sizeof(path), "/sys/class/pwm/pwmchip%u/pwm%u/%s",
+			 chan->chip, chan->channel, pwm_attr_names[i]);
+		chan->fd[i] = open(path, O_RDWR | O_CLOEXEC);
+		if (chan->fd[i] < 0) {
+			ret = -errno;
+			gbsim_error("failed opening %s\n", path);
+			return ret;
+		}
+
+		len = pread(chan->fd[i], buf, sizeof(buf) - 1, 0);
+		if (len <= 0)
+			continue;
+		buf[len] = '\0';
+		if (i == PWM_POLARITY)
+			chan->val[i] = !strncmp(buf, "inversed", 8);
+		else
+			chan->val[i] = strtoul(buf, NULL, 0);
+		chan->known |= 1 << i;
+	}
+
+	return 0;
+}
+
+static void sysfs_close(struct pwm_chan *chan)
+{
+	int i;
+
+	for (i = 0; i < PWM_NR_ATTRS; i++)
+		if (chan->fd[i] >= 0)
+			close(chan->fd[i]);
+	if (chan->pwm)
+		libsoc_pwm_free(chan->pwm);
+}
+
+/*
+ * In-memory PWM with the same duty/period rule as the kernel, so an AP
+ * driver ordering its updates wrongly fails here as it would on a board.
+ * Every change is stamped and kept; the timeline is written as CSV to
+ * the log option on exit.
+ */
+static int model_open(struct pwm_chan *chan, const char *arg,
+		      char **opts, int num_opts)
+{
+	struct pwm_model *model;
+	const char *log;
+
+	model = calloc(1, sizeof(*model));
+	if (!model)
+		return -ENOMEM;
+
+	log = conf_opt(opts, num_opts, "log");
+	if (log)
+		model->log = strdup(log);
+	model->start_us = pwm_now_us();
+
+	chan->known = (1 << PWM_NR_ATTRS) - 1;
+	chan->priv = model;
+
+	return 0;
+}
+
+static int model_write(struct pwm_chan *chan, int attr, uint32_t val)
+{
+	struct pwm_model *model = chan->priv;
+	struct pwm_event *ev;
+
+	if (attr == PWM_PERIOD && val < chan->val[PWM_DUTY])
+		return -EINVAL;
+	if (attr == PWM_DUTY && val > chan->val[PWM_PERIOD])
+		return -EINVAL;
+
+	ev = &model->events[model->count++ % PWM_MODEL_EVENTS];
+	ev->time_us = pwm_now_us() - model->start_us;
+	memcpy(ev->val, chan->val, sizeof(ev->val));
+	ev->val[attr] = val;
+
+	return 0;
+}
+
+static void model_close(struct pwm_chan *chan)
+{
+	struct pwm_model *model = chan->priv;
+	struct pwm_event *ev;
+	unsigned long i;
+	FILE *f;
+
+	if (!model)
+		return;
+
+	gbsim_info("PWM %d model: %lu changes, %u/%u ns %s %s\n",
+		   chan->index, model->count, chan->val[PWM_DUTY],
+		   chan->val[PWM_PERIOD],
+		   chan->val[PWM_POLARITY] ? "inversed" : "normal",
+		   chan->val[PWM_ENABLE] ? "enabled" : "disabled");
+
+	if (model->log) {
+		f = fopen(model->log, "w");
+		if (!f) {
+			gbsim_error("failed opening PWM log %s\n", model->log);
+		} else {
+			fprintf(f, "time_us,period_ns,duty_ns,polarity,enable\n");
+			i = model->count > PWM_MODEL_EVENTS ?
+			    model->count - PWM_MODEL_EVENTS : 0;
+			for (; i < model->count; i++) {
+				ev = &model->events[i % PWM_MODEL_EVENTS];
+				fprintf(f, "%llu,%u,%u,%u,%u\n",
+					(unsigned long long)ev->time_us,
+					ev->val[PWM_PERIOD], ev->val[PWM_DUTY],
+					ev->val[PWM_POLARITY],
+					ev->val[PWM_ENABLE]);
+			}
+			fclose(f);
+		}
+	}
+
+	free(model->log);
+	free(model);
+}
+
+static const struct pwm_backend pwm_backends[] = {
+	{
+		.name	= "sysfs",
+		.open	= sysfs_open,
+		.write	= sysfs_write,
+		.close	= sysfs_close,
+	}, {
+		.name	= "model",
+		.open	= model_open,
+		.write	= model_write,
+		.close	= model_close,
+	},
+};
+
+static const struct pwm_backend *pwm_backend_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(pwm_backends) / sizeof(pwm_backends[0]); i++)
+		if (!strcmp(pwm_backends[i].name, name))
+			return &pwm_backends[i];
+
+	return NULL;
+}
+
+static int pwm_chan_add(int index, const struct pwm_backend *backend,
+			const char *arg, char **opts, int num_opts)
+{
+	struct pwm_chan *chan;
+	int i, ret;
+
+	if (index < 0 || index >= PWM_MAX_CHANNELS) {
+		gbsim_error("PWM %d out of range\n", index);
+		return -EINVAL;
+	}
+	if (pwm_chans[index]) {
+		gbsim_error("PWM %d already configured\n", index);
+		return -EBUSY;
+	}
+
+	chan = calloc(1, sizeof(*chan));
+	if (!chan)
+		return -ENOMEM;
+	chan->index = index;
+	chan->backend = backend;
+	for (i = 0; i < PWM_NR_ATTRS; i++)
+		chan->fd[i] = -1;
+
+	ret = backend->open(chan, arg, opts, num_opts);
+	if (ret < 0) {
+		backend->close(chan);
+		free(chan);
+		return ret;
+	}
+
+	pwm_chans[index] = chan;
+	if (index >= pwm_num_chans)
+		pwm_num_chans = index + 1;
+
+	gbsim_info("PWM %d %s %s\n", index, backend->name, arg ? arg : "");
+
+	return 0;
+}
+
+/* <index> <backend> [arg] [key=value ...] */
+static int pwm_config_line(char *line, void *data)
+{
+	const struct pwm_backend *backend;
+	char *opts[CONF_MAX_OPTS];
+	char *tok, *save;
+	char who[16];
+	char *arg;
+	int num_opts;
+	long index;
+
+	tok = strtok_r(line, " \t\r\n", &save);
+	if (!tok)
+		return 0;
+	index = strtol(tok, NULL, 0);
+
+	tok = strtok_r(NULL, " \t\r\n", &save);
+	backend = tok ? pwm_backend_find(tok) : NULL;
+	if (!backend) {
+		gbsim_error("PWM %ld: unknown backend %s\n", index,
+			    tok ? tok : "(none)");
+		return -EINVAL;
+	}
+
+	snprintf(who, sizeof(who), "PWM %ld", index);
+	num_opts = conf_args(NULL, &save, &arg, opts, CONF_MAX_OPTS, who);
+
+	return pwm_chan_add(index, backend, arg, opts, num_opts);
+}
+
+/* Without a config, every channel of every chip in pwmchip order */
+static void pwm_chips_map(void)
+{
+	const struct pwm_backend *sysfs = pwm_backend_find("sysfs");
+	char arg[32];
+	unsigned int i;
+	int c;
+
+	for (c = 0; c < pwm_num_chips; c++) {
+		for (i = 0; i < pwm_chips[c].npwm; i++) {
+			if (pwm_num_chans >= PWM_MAX_CHANNELS)
+				return;
+			snprintf(arg, sizeof(arg), "pwmchip%u/pwm%u",
+				 pwm_chips[c].num, i);
+			/* A busy channel keeps its index so the map is stable */
+			if (pwm_chan_add(pwm_num_chans, sysfs, arg, NULL, 0) < 0)
+				pwm_num_chans++;
+		}
+	}
+}
 
 int pwm_handler(struct gbsim_connection *connection, void *rbuf,
 		size_t rsize, void *tbuf, size_t tsize)
@@ -34,15 +540,30 @@ int pwm_handler(struct gbsim_connection *connection, void *rbuf,
 	size_t payload_size;
 	uint16_t message_size;
 	uint16_t hd_cport_id = connection->hd_cport_id;
-	uint8_t result = PROTOCOL_STATUS_SUCCESS;
+	uint8_t result = GB_OP_SUCCESS;
+	struct pwm_chan *chan = NULL;
+	int ret = 0;
 
 	op_rsp = (struct op_msg *)tbuf;
 	oph = (struct gb_operation_msg_hdr *)&op_req->header;
 
+	/* Every request but PWM_COUNT starts with the channel number */
+	if (oph->type != GB_PWM_TYPE_PWM_COUNT) {
+		if (op_req->pwm_act_req.which >= pwm_num_chans) {
+			gbsim_error("PWM %d out of range\n",
+				    op_req->pwm_act_req.which);
+			payload_size = 0;
+			result = GB_OP_INVALID;
+			goto out;
+		}
+		chan = pwm_chans[op_req->pwm_act_req.which];
+	}
+
 	switch (oph->type) {
 	case GB_PWM_TYPE_PWM_COUNT:
 		payload_size = sizeof(struct gb_pwm_count_response);
-		op_rsp->pwm_cnt_rsp.count = 1; /* Something arbitrary, but useful */
+		/* The AP reads the highest index, not the number of PWMs */
+		op_rsp->pwm_cnt_rsp.count = pwm_num_chans - 1;
 		break;
 	case GB_PWM_TYPE_ACTIVATE:
 		payload_size = 0;
@@ -58,38 +579,32 @@ int pwm_handler(struct gbsim_connection *connection, void *rbuf,
 		payload_size = 0;
 		duty = le32toh(op_req->pwm_cfg_req.duty);
 		period = le32toh(op_req->pwm_cfg_req.period);
-		if (bbb_backend) {
-			libsoc_pwm_set_duty_cycle(pwms[op_req->pwm_cfg_req.which], duty);
-			libsoc_pwm_set_period(pwms[op_req->pwm_cfg_req.which], period);
-		}
+		ret = pwm_chan_config(chan, duty, period);
 		gbsim_debug("PWM %d config (%dns/%dns) request\n  ",
 			    op_req->pwm_cfg_req.which, duty, period);
 		break;
 	case GB_PWM_TYPE_POLARITY:
 		payload_size = 0;
-		if (pwm_on[op_req->pwm_pol_req.which]) {
-			result = PROTOCOL_STATUS_BUSY;
-		} else if (bbb_backend) {
-			libsoc_pwm_set_polarity(pwms[op_req->pwm_pol_req.which],
-						    op_req->pwm_pol_req.polarity);
-		}
+		if (chan->on)
+			result = GB_OP_RETRY;
+		else
+			ret = pwm_attr_write(chan, PWM_POLARITY,
+					     op_req->pwm_pol_req.polarity);
 		gbsim_debug("PWM %d polarity (%s) request\n  ",
 			    op_req->pwm_cfg_req.which,
 			    op_req->pwm_pol_req.polarity ? "inverse" : "normal");
 		break;
 	case GB_PWM_TYPE_ENABLE:
 		payload_size = 0;
-		pwm_on[op_req->pwm_enb_req.which] = 1;
-		if (bbb_backend)
-			libsoc_pwm_set_enabled(pwms[op_req->pwm_enb_req.which], ENABLED);
+		chan->on = 1;
+		ret = pwm_attr_write(chan, PWM_ENABLE, 1);
 		gbsim_debug("PWM %d enable request\n  ",
 			    op_req->pwm_enb_req.which);
 		break;
 	case GB_PWM_TYPE_DISABLE:
 		payload_size = 0;
-		pwm_on[op_req->pwm_dis_req.which] = 0;
-		if (bbb_backend)
-			libsoc_pwm_set_enabled(pwms[op_req->pwm_dis_req.which], DISABLED);
+		chan->on = 0;
+		ret = pwm_attr_write(chan, PWM_ENABLE, 0);
 		gbsim_debug("PWM %d disable request\n  ",
 			    op_req->pwm_dis_req.which);
 		break;
@@ -98,6 +613,10 @@ int pwm_handler(struct gbsim_connection *connection, void *rbuf,
 		return -EINVAL;
 	}
 
+	if (ret < 0)
+		result = ret == -EINVAL ? GB_OP_INVALID : GB_OP_UNKNOWN_ERROR;
+
+out:
 	message_size = sizeof(struct gb_operation_msg_hdr) + payload_size;
 	return send_response(hd_cport_id, op_rsp, message_size,
 				oph->operation_id, oph->type, result);
@@ -127,11 +646,66 @@ char *pwm_get_operation(uint8_t type)
 	}
 }
 
+/* Sum of the duty cycles of the enabled channels, in parts per million */
+uint32_t pwm_load_ppm(void)
+{
+	struct pwm_chan *chan;
+	uint64_t ppm = 0;
+	int i;
+
+	for (i = 0; i < pwm_num_chans; i++) {
+		chan = pwm_chans[i];
+		if (!chan || !chan->val[PWM_ENABLE] || !chan->val[PWM_PERIOD])
+			continue;
+		ppm += (uint64_t)chan->val[PWM_DUTY] * 1000000 /
+		       chan->val[PWM_PERIOD];
+	}
+
+	return ppm > UINT32_MAX ? UINT32_MAX : ppm;
+}
+
+void pwm_cleanup(void)
+{
+	struct pwm_chan *chan;
+	int i;
+
+	for (i = 0; i < PWM_MAX_CHANNELS; i++) {
+		chan = pwm_chans[i];
+		if (!chan)
+			continue;
+		if (chan->writes || chan->skipped)
+			gbsim_info("PWM %d %lu writes, %lu skipped\n",
+				   i, chan->writes, chan->skipped);
+		chan->backend->close(chan);
+		free(chan);
+		pwm_chans[i] = NULL;
+	}
+	pwm_num_chans = 0;
+	pwm_num_chips = 0;
+}
+
 void pwm_init(void)
 {
-	if (bbb_backend) {
-		/* Grab PWM0A and PWM0B found on P9-31 and P9-29 */
-		pwms[0] = libsoc_pwm_request(0, 0, LS_PWM_GREEDY);
-		pwms[1] = libsoc_pwm_request(0, 1, LS_PWM_GREEDY);
+	const struct pwm_backend *model = pwm_backend_find("model");
+	int i;
+
+	pwm_chips_scan();
+
+	if (pwm_config)
+		conf_file(pwm_config, pwm_config_line, NULL);
+	else if (bbb_backend)
+		pwm_chips_map();
+
+	/* Two PWMs were always offered, keep doing so without hardware */
+	if (!pwm_num_chans) {
+		pwm_chan_add(0, model, NULL, NULL, 0);
+		pwm_chan_add(1, model, NULL, NULL, 0);
+	}
+
+	for (i = 0; i < pwm_num_chans; i++) {
+		if (pwm_chans[i])
+			continue;
+		gbsim_error("PWM %d not available, using a model\n", i);
+		pwm_chan_add(i, model, NULL, NULL, 0);
 	}
 }
@@ -7,37 +7,97 @@
  * Provided under the three clause BSD license found in the LICENSE file.
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <time.h>
 #include <linux/spi/spidev.h>
 #include "gbsim.h"
 
 #define SPI_BPW_MASK(bits) BIT((bits) - 1)
-#define SPIDEV_TYPE	0x00
-#define SPINOR_TYPE	0x01
-#define SPIMOD_TYPE	0x02
 
 /*
- * this control the number of devices that will be created, for even chipselect
- * spidev for odd spinor
+ * Upper bound of chip selects, each one is backed by a device model from
+ * spi_models[] and configured from the -S file, one line per chip select:
+ *
+ *	<cs> <model> [<arg>] [mode=<n>] [bpw=<n>] [speed=<hz>]
+ *				[type=dev|nor|modalias] [name=<modalias>]
+ *
+ * Without a file CS0 is a modalias device on /dev/spidev<bus>.<cs> and CS1
+ * a spidev device on the same node, or the -N NOR image.
  */
-#define SPI_NUM_CS	2
+#define SPI_MAX_CS	8
+#define SPI_MAXLINE	256
+
+#define SPI_LOOPBACK_SIZE	4096
+
+/*
+ * Upper bound of transfers in one Greybus request, a request carries at
+ * least 13 bytes per transfer so this is well above what fits in a message,
+ * and below the 16KiB SPI_IOC_MESSAGE() size limit.
+ */
+#define SPI_MAX_XFERS	256
 
 /* use the following spi to emulate */
 /* "w25q256",     0xef4019,      0,  64 << 10, 512, ER_4K) }, */
 #define SPI_NOR_JEDEC	0xef4019
 #define SPI_NOR_SIZE	(32 * 1024 * 1024)
+#define SPI_NOR_PAGE_SIZE	256
 
+/* Progress of the command in flight while chip select is asserted */
 #define SPI_NOR_IDLE	0
-#define SPI_NOR_CMD	1
-#define SPI_NOR_PP	2
-#define SPI_NOR_READ	3
+#define SPI_NOR_ADDR	1
+#define SPI_NOR_DUMMY	2
+#define SPI_NOR_DATA	3
+
+/*
+ * Flash contents live in a sparse image file mapped into memory. Bytes are
+ * stored complemented, so erased (0xff) flash is a hole in the file and
+ * only programmed pages are backed by disk and memory; erasing punches the
+ * hole again.
+ */
+struct spinor_flash {
+	int		fd;
+	uint8_t		*map;
+	size_t		size;
+	uint8_t		sr;
+	bool		addr4;
+	int		state;
+	uint8_t		cmd;
+	int		addr_left;
+	int		dummy_left;
+	uint32_t	addr;
+	size_t		count;
+};
+
+/* Echoes full-duplex data and replays the last write on read-only transfers */
+struct spi_loopback {
+	uint8_t		buf[SPI_LOOPBACK_SIZE];
+	size_t		len;
+	size_t		pos;
+};
+
+/*
+ * Register file addressed by the first byte of each chip select cycle, the
+ * register address auto-increments. A register can be scripted with a list
+ * of values that successive reads cycle through until it is written.
+ */
+struct spi_regmap {
+	uint8_t		rd_bit;
+	bool		active;
+	bool		read;
+	uint8_t		addr;
+	struct gbsim_regs regs;
+};
 
 struct gb_spi_dev_config {
 	uint16_t	mode;
@@ -47,19 +107,29 @@ struct gb_spi_dev_config {
 	uint8_t		name[32];
 };
 
+struct gb_spi_dev;
+
+struct spi_model {
+	const char	*name;
+	const struct gb_spi_dev_config *conf;
+	int	(*open)(struct gb_spi_dev *dev, const char *arg);
+	void	(*close)(struct gb_spi_dev *dev);
+	/* Either handle the whole request, or one transfer at a time */
+	int	(*xfer_req_recv)(struct gb_spi_dev *dev,
+				 struct gb_spi_transfer *xfers, int count,
+				 uint8_t *tx_data, uint8_t *rx_data);
+	void	(*xfer_one)(struct gb_spi_dev *dev, uint8_t *tx, uint8_t *rx,
+			    size_t len);
+	void	(*cs_release)(struct gb_spi_dev *dev);
+};
+
 struct gb_spi_dev {
 	uint8_t	cs;
-	uint8_t	*buf;
-	size_t	buf_size;
-	uint8_t	*buf_resp;
-	uint8_t	cmd_resp[6];
-	size_t	resp_size;
-	int	state;
-	int	cmd;
-	int	(*xfer_req_recv)(struct gb_spi_dev *dev,
-				 struct gb_spi_transfer *xfer,
-				 uint8_t *xfer_data);
-	struct gb_spi_dev_config *conf;
+	const struct spi_model *model;
+	int	fd;
+	void	*priv;
+	char	arg[SPI_MAXLINE];
+	struct gb_spi_dev_config conf;
 };
 
 struct gb_spi_master {
@@ -72,9 +142,18 @@ struct gb_spi_master {
 	struct gb_spi_dev	*devices;
 };
 
-static struct gb_spi_master *master;
+/* Responses built once per connection, dropped on connection teardown */
+struct spi_connection {
+	struct gb_spi_master_config_response	mc_rsp;
+	struct gb_spi_device_config_response	dc_rsp[SPI_MAX_CS];
+	uint32_t				dc_valid;
+};
+
+static struct gb_spi_master master;
+static struct gb_spi_dev spi_devs[SPI_MAX_CS];
+static int spi_num_cs;
 
-static struct gb_spi_dev_config spidev_config = {
+static const struct gb_spi_dev_config spidev_config = {
 	.mode		= GB_SPI_MODE_MODE_3,
 	.bits_per_word	= 8,
 	.max_speed_hz	= 10000000,
@@ -82,23 +161,15 @@ static struct gb_spi_dev_config spidev_config = {
 	.device_type	= GB_SPI_SPI_DEV,
 };
 
-static struct gb_spi_dev_config spimod_config = {
-	.mode		= GB_SPI_MODE_MODE_0,
-	.bits_per_word	= 8,
-	.max_speed_hz	= 6000000,
-	.name		= "custom",
-	.device_type	= GB_SPI_SPI_MODALIAS ,
-};
-
-static struct gb_spi_dev_config spinor_config = {
+static const struct gb_spi_dev_config spinor_config = {
 	.mode		= GB_SPI_MODE_MODE_3,
-	.bits_per_word	= 32,
+	.bits_per_word	= 8,
 	.max_speed_hz	= 10000000,
 	.name		= "nor",
 	.device_type	= GB_SPI_SPI_NOR,
 };
 
-static int ifd1;
+static struct spi_ioc_transfer spi_tr[SPI_MAX_XFERS];
 /* Flash opcodes. */
 #define SPINOR_OP_WREN		0x06	/* Write enable */
 #define SPINOR_OP_RDSR		0x05	/* Read status register */
@@ -168,134 +239,773 @@ enum read_mode {
 	SPI_NOR_QUAD,
 };
 
+/*
+ * Submit every transfer of a Greybus request as one spidev message, so the
+ * chip select stays asserted between segments unless cs_change asks
+ * otherwise and the whole request costs a single syscall.
+ */
 static int spidev_xfer_req_recv(struct gb_spi_dev *dev,
-				struct gb_spi_transfer *xfer,
-				uint8_t *xfer_data)
+				struct gb_spi_transfer *xfers, int count,
+				uint8_t *tx_data, uint8_t *rx_data)
 {
+	struct spi_ioc_transfer *tr;
+	struct gb_spi_transfer *xfer;
+	uint32_t len;
 	int ret;
-	struct spi_ioc_transfer tr = {
-		.tx_buf = (unsigned long)xfer_data,
-		.rx_buf = (unsigned long)dev->buf_resp,
-		.len = xfer->len,
-		.delay_usecs = xfer->delay_usecs,
-		.speed_hz = xfer->speed_hz,
-		.bits_per_word = xfer->bits_per_word,
-	};
-	ret = ioctl(ifd1, SPI_IOC_MESSAGE(1), &tr);
-	if (ret < 1)
-		gbsim_error("can't send spi message");
-	dev->resp_size = xfer->len;
+	int i;
+
+	if (count > SPI_MAX_XFERS)
+		return -EINVAL;
+
+	memset(spi_tr, 0, count * sizeof(*spi_tr));
+
+	for (i = 0; i < count; i++) {
+		xfer = &xfers[i];
+		tr = &spi_tr[i];
+		len = le32toh(xfer->len);
+
+		tr->len = len;
+		tr->speed_hz = le32toh(xfer->speed_hz);
+		tr->delay_usecs = le16toh(xfer->delay_usecs);
+		tr->bits_per_word = xfer->bits_per_word;
+		tr->cs_change = xfer->cs_change;
+
+		if (xfer->xfer_flags & GB_SPI_XFER_WRITE) {
+			tr->tx_buf = (unsigned long)tx_data;
+			tx_data += len;
+		}
+		if (xfer->xfer_flags & GB_SPI_XFER_READ) {
+			tr->rx_buf = (unsigned long)rx_data;
+			rx_data += len;
+		}
+	}
+
+	/*
+	 * The message continues in the next Greybus request, on the last
+	 * transfer cs_change means keep the chip select asserted.
+	 */
+	if (xfers[count - 1].xfer_flags & GB_SPI_XFER_INPROGRESS)
+		spi_tr[count - 1].cs_change = 1;
+
+	ret = ioctl(dev->fd, SPI_IOC_MESSAGE(count), spi_tr);
+	if (ret < 0) {
+		gbsim_error("can't send spi message (%d transfers): %d\n",
+			    count, errno);
+		return -errno;
+	}
+
 	return 0;
 }
 
+static int spidev_open(struct gb_spi_dev *dev, const char *arg)
+{
+	dev->fd = open(arg, O_RDWR);
+	if (dev->fd < 0) {
+		gbsim_error("failed opening spi node %s read/write\n", arg);
+		return -errno;
+	}
+
+	return 0;
+}
 
-static void spinor_handle_cmd(struct gb_spi_dev *dev, uint8_t cmd_op)
+static void spidev_close(struct gb_spi_dev *dev)
 {
-	dev->cmd = cmd_op;
+	close(dev->fd);
+}
+
+static void spinor_start_cmd(struct spinor_flash *nor, uint8_t cmd_op)
+{
+	int addr_len = nor->addr4 ? 4 : 3;
+
+	nor->cmd = cmd_op;
+	nor->addr = 0;
+	nor->count = 0;
+	nor->addr_left = 0;
+	nor->dummy_left = 0;
 
-	/*
-	 * basic operations, for discovery over jedec, need to be extend for
-	 * other operations
-	 */
 	switch (cmd_op) {
-	case SPINOR_OP_RDID:
-		dev->resp_size = 3;
-		dev->buf_resp[0] = (SPI_NOR_JEDEC >> 16) & 0xff;
-		dev->buf_resp[1] = (SPI_NOR_JEDEC >> 8) & 0xff;
-		dev->buf_resp[2] = SPI_NOR_JEDEC & 0xff;
+	case SPINOR_OP_READ_FAST:
+	case SPINOR_OP_READ_1_1_2:
+	case SPINOR_OP_READ_1_1_4:
+		nor->dummy_left = 1;
+		/* fallthrough */
+	case SPINOR_OP_READ:
+	case SPINOR_OP_PP:
+	case SPINOR_OP_BE_4K:
+	case SPINOR_OP_BE_4K_PMC:
+	case SPINOR_OP_BE_32K:
+	case SPINOR_OP_SE:
+		nor->addr_left = addr_len;
+		break;
+	case SPINOR_OP_READ4_FAST:
+	case SPINOR_OP_READ4_1_1_2:
+	case SPINOR_OP_READ4_1_1_4:
+		nor->dummy_left = 1;
+		/* fallthrough */
+	case SPINOR_OP_READ4:
+	case SPINOR_OP_PP_4B:
+	case SPINOR_OP_SE_4B:
+		nor->addr_left = 4;
+		break;
+	case SPINOR_OP_WREN:
+		nor->sr |= SR_WEL;
+		break;
+	case SPINOR_OP_WRDI:
+		nor->sr &= ~SR_WEL;
 		break;
 	case SPINOR_OP_EN4B:
-		dev->resp_size = 0;
+		nor->addr4 = true;
+		break;
+	case SPINOR_OP_EX4B:
+		nor->addr4 = false;
 		break;
 	default:
 		break;
 	}
 
+	nor->state = nor->addr_left ? SPI_NOR_ADDR : SPI_NOR_DATA;
+}
+
+static void spinor_erase(struct spinor_flash *nor, uint32_t addr, size_t len)
+{
+	addr &= ~(len - 1);
+	if (fallocate(nor->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      addr, len) < 0)
+		memset(nor->map + addr, 0, len);
+	gbsim_debug("SPI NOR erase 0x%08x size 0x%zx\n", addr, len);
 }
 
-static int spinor_xfer_req_recv(struct gb_spi_dev *dev,
-				struct gb_spi_transfer *xfer,
-				uint8_t *xfer_data)
+/* Chip select released: commit program/erase commands */
+static void spinor_cs_release(struct gb_spi_dev *dev)
 {
-	switch (dev->state) {
-	case SPI_NOR_IDLE:
-		spinor_handle_cmd(dev, *xfer_data);
-		dev->state = SPI_NOR_CMD;
+	struct spinor_flash *nor = dev->priv;
+	bool wel;
+	bool addressed = nor->state == SPI_NOR_DATA;
+	bool busy = false;
+
+	if (nor->state == SPI_NOR_IDLE)
+		return;
+
+	wel = nor->sr & SR_WEL;
+
+	switch (nor->cmd) {
+	case SPINOR_OP_PP:
+	case SPINOR_OP_PP_4B:
+		busy = wel && nor->count;
+		break;
+	case SPINOR_OP_WRSR:
+		busy = wel;
+		break;
+	case SPINOR_OP_BE_4K:
+	case SPINOR_OP_BE_4K_PMC:
+		if (wel && addressed)
+			spinor_erase(nor, nor->addr, 4 * 1024);
+		busy = wel;
+		break;
+	case SPINOR_OP_BE_32K:
+		if (wel && addressed)
+			spinor_erase(nor, nor->addr, 32 * 1024);
+		busy = wel;
+		break;
+	case SPINOR_OP_SE:
+	case SPINOR_OP_SE_4B:
+		if (wel && addressed)
+			spinor_erase(nor, nor->addr, 64 * 1024);
+		busy = wel;
 		break;
-	case SPI_NOR_CMD:
-		/* just force the resp_size to the expected length */
-		if (dev->cmd)
-			dev->resp_size = xfer->len;
-		dev->state = SPI_NOR_IDLE;
+	case SPINOR_OP_CHIP_ERASE:
+		if (wel)
+			spinor_erase(nor, 0, nor->size);
+		busy = wel;
 		break;
 	default:
 		break;
 	}
 
+	/*
+	 * Program and erase complete at memory speed; report WIP for one
+	 * status poll so the AP still walks its wait-till-ready path.
+	 */
+	if (busy)
+		nor->sr = (nor->sr | SR_WIP) & ~SR_WEL;
 
-	return 0;
+	nor->state = SPI_NOR_IDLE;
 }
 
-static int spi_set_device(uint8_t cs, int spi_type)
+/* Data phase of the command, consumes all of 'len' */
+static void spinor_data(struct spinor_flash *nor, uint8_t *tx, uint8_t *rx,
+			size_t len)
 {
-	struct gb_spi_dev *spi_dev = &master->devices[cs];
+	uint32_t mask = nor->size - 1;
+	uint32_t page, addr;
+	size_t i;
 
-	switch (spi_type) {
-		case SPINOR_TYPE:
-			spi_dev->xfer_req_recv = spinor_xfer_req_recv;
-			spi_dev->buf_size = SPI_NOR_SIZE;
-			spi_dev->conf = &spinor_config;
+	switch (nor->cmd) {
+	case SPINOR_OP_READ:
+	case SPINOR_OP_READ_FAST:
+	case SPINOR_OP_READ_1_1_2:
+	case SPINOR_OP_READ_1_1_4:
+	case SPINOR_OP_READ4:
+	case SPINOR_OP_READ4_FAST:
+	case SPINOR_OP_READ4_1_1_2:
+	case SPINOR_OP_READ4_1_1_4:
+		if (!rx)
 			break;
-		case SPIDEV_TYPE:
-			spi_dev->xfer_req_recv = spidev_xfer_req_recv;
-			spi_dev->buf_size = 0;
-			spi_dev->conf = &spidev_config;
+		addr = nor->addr + nor->count;
+		for (i = 0; i < len; i++)
+			rx[i] = ~nor->map[(addr + i) & mask];
+		break;
+	case SPINOR_OP_PP:
+	case SPINOR_OP_PP_4B:
+		if (!tx || !(nor->sr & SR_WEL))
 			break;
-		case SPIMOD_TYPE:
-			spi_dev->xfer_req_recv = spidev_xfer_req_recv;
-			spi_dev->buf_size = 0;
-			spi_dev->conf = &spimod_config;
+		/* Programming only clears bits and wraps within the page */
+		page = nor->addr & mask & ~(SPI_NOR_PAGE_SIZE - 1);
+		addr = nor->addr + nor->count;
+		for (i = 0; i < len; i++)
+			if (tx[i] != 0xff)
+				nor->map[page | ((addr + i) &
+					 (SPI_NOR_PAGE_SIZE - 1))] |= ~tx[i];
+		break;
+	case SPINOR_OP_RDSR:
+		if (rx)
+			memset(rx, nor->sr, len);
+		nor->sr &= ~SR_WIP;
+		break;
+	case SPINOR_OP_WRSR:
+		if (tx && !nor->count && (nor->sr & SR_WEL))
+			nor->sr = (nor->sr & (SR_WIP | SR_WEL)) |
+				  (tx[0] & ~(SR_WIP | SR_WEL));
+		break;
+	case SPINOR_OP_RDID:
+		for (i = 0; rx && i < len; i++) {
+			switch (nor->count + i) {
+			case 0:
+				rx[i] = (SPI_NOR_JEDEC >> 16) & 0xff;
+				break;
+			case 1:
+				rx[i] = (SPI_NOR_JEDEC >> 8) & 0xff;
+				break;
+			case 2:
+				rx[i] = SPI_NOR_JEDEC & 0xff;
+				break;
+			default:
+				rx[i] = 0;
+			}
+		}
+		break;
+	case SPINOR_OP_RDFSR:
+		if (rx)
+			memset(rx, FSR_READY, len);
+		break;
+	case SPINOR_OP_RDCR:
+	case SPINOR_OP_RD_EVCR:
+		if (rx)
+			memset(rx, 0, len);
+		break;
+	default:
+		if (rx)
+			memset(rx, 0xff, len);
+		break;
+	}
+
+	nor->count += len;
+}
+
+/* Feed one full-duplex transfer through the flash state machine */
+static void spinor_xfer_one(struct gb_spi_dev *dev, uint8_t *tx,
+			    uint8_t *rx, size_t len)
+{
+	struct spinor_flash *nor = dev->priv;
+	uint8_t b;
+
+	while (len) {
+		if (nor->state == SPI_NOR_DATA) {
+			spinor_data(nor, tx, rx, len);
+			return;
+		}
+
+		b = tx ? *tx++ : 0xff;
+		if (rx)
+			*rx++ = 0xff;
+		len--;
+
+		switch (nor->state) {
+		case SPI_NOR_IDLE:
+			spinor_start_cmd(nor, b);
+			break;
+		case SPI_NOR_ADDR:
+			nor->addr = (nor->addr << 8) | b;
+			if (--nor->addr_left)
+				break;
+			nor->addr &= nor->size - 1;
+			nor->state = nor->dummy_left ? SPI_NOR_DUMMY :
+						       SPI_NOR_DATA;
 			break;
+		case SPI_NOR_DUMMY:
+			if (!--nor->dummy_left)
+				nor->state = SPI_NOR_DATA;
+			break;
+		}
+	}
+}
+
+static int spinor_open(struct gb_spi_dev *dev, const char *path)
+{
+	struct spinor_flash *nor;
+	struct stat st;
+
+	nor = calloc(1, sizeof(*nor));
+	if (!nor)
+		return -ENOMEM;
+	dev->priv = nor;
+
+	nor->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (nor->fd < 0) {
+		gbsim_error("failed opening spi nor image %s\n", path);
+		free(nor);
+		dev->priv = NULL;
+		return -EIO;
 	}
 
-	spi_dev->state = SPI_NOR_IDLE;
-	spi_dev->cs = cs;
+	if (fstat(nor->fd, &st) < 0)
+		goto err_close;
 
-	if (!spi_dev->buf_size)
-		return 0;
+	/* A new or short image is extended as a hole, i.e. erased flash */
+	nor->size = SPI_NOR_SIZE;
+	if (st.st_size < nor->size && ftruncate(nor->fd, nor->size) < 0)
+		goto err_close;
 
-	spi_dev->buf = calloc(1, spi_dev->buf_size);
-	if (!spi_dev->buf) {
-		free(spi_dev);
-		return 0;
+	nor->map = mmap(NULL, nor->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			nor->fd, 0);
+	if (nor->map == MAP_FAILED) {
+		nor->map = NULL;
+		goto err_close;
 	}
 
+	nor->state = SPI_NOR_IDLE;
+	gbsim_info("SPI NOR %s, %zu bytes\n", path, nor->size);
+
 	return 0;
+
+err_close:
+	gbsim_error("failed mapping spi nor image %s\n", path);
+	close(nor->fd);
+	free(nor);
+	dev->priv = NULL;
+	return -EIO;
 }
 
-static int spi_master_setup(void)
+static void spinor_close(struct gb_spi_dev *dev)
 {
-	master = calloc(1, sizeof(struct gb_spi_master));
-	if (!master)
-		return 0;
+	struct spinor_flash *nor = dev->priv;
 
-	master->mode = GB_SPI_MODE_MODE_3;
-	master->flags = 0;
-	master->bpwm = SPI_BPW_MASK(8) | SPI_BPW_MASK(16) | SPI_BPW_MASK(32);
-	master->min_speed_hz = 400000;
-	master->max_speed_hz = 48000000;
-	master->num_chipselect = SPI_NUM_CS;
+	munmap(nor->map, nor->size);
+	close(nor->fd);
+	free(nor);
+}
+
+static int loopback_open(struct gb_spi_dev *dev, const char *arg)
+{
+	dev->priv = calloc(1, sizeof(struct spi_loopback));
+	if (!dev->priv)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void loopback_xfer_one(struct gb_spi_dev *dev, uint8_t *tx,
+			      uint8_t *rx, size_t len)
+{
+	struct spi_loopback *lb = dev->priv;
+	size_t i;
+
+	if (tx) {
+		if (rx)
+			memcpy(rx, tx, len);
+		lb->len = len < SPI_LOOPBACK_SIZE ? len : SPI_LOOPBACK_SIZE;
+		memcpy(lb->buf, tx, lb->len);
+		lb->pos = 0;
+		return;
+	}
+
+	for (i = 0; i < len; i++)
+		rx[i] = lb->pos < lb->len ? lb->buf[lb->pos++] : 0xff;
+}
+
+static int regmap_open(struct gb_spi_dev *dev, const char *arg)
+{
+	struct spi_regmap *map;
+
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return -ENOMEM;
+	map->rd_bit = 0x80;
+	dev->priv = map;
+
+	if (arg && regs_load(&map->regs, arg) < 0) {
+		free(map);
+		dev->priv = NULL;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static void regmap_close(struct gb_spi_dev *dev)
+{
+	struct spi_regmap *map = dev->priv;
+
+	regs_free(&map->regs);
+	free(map);
+}
 
-	master->devices = calloc(master->num_chipselect,
-				 sizeof(struct gb_spi_dev));
-	if (!master->devices)
+static void regmap_xfer_one(struct gb_spi_dev *dev, uint8_t *tx,
+			    uint8_t *rx, size_t len)
+{
+	struct spi_regmap *map = dev->priv;
+	uint8_t reg;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (!map->active) {
+			/* First byte of the cycle: address and direction */
+			map->active = true;
+			map->read = tx ? tx[i] & map->rd_bit : true;
+			map->addr = tx ? tx[i] & ~map->rd_bit : 0;
+			if (rx)
+				rx[i] = 0xff;
+			continue;
+		}
+
+		reg = map->addr++;
+		if (map->read) {
+			if (rx)
+				rx[i] = regs_read(&map->regs, reg);
+		} else {
+			if (tx)
+				regs_write(&map->regs, reg, tx[i]);
+			if (rx)
+				rx[i] = 0xff;
+		}
+	}
+}
+
+static void regmap_cs_release(struct gb_spi_dev *dev)
+{
+	struct spi_regmap *map = dev->priv;
+
+	map->active = false;
+}
+
+static const struct spi_model spi_models[] = {
+	{
+		.name		= "spidev",
+		.conf		= &spidev_config,
+		.open		= spidev_open,
+		.close		= spidev_close,
+		.xfer_req_recv	= spidev_xfer_req_recv,
+	},
+	{
+		.name		= "nor",
+		.conf		= &spinor_config,
+		.open		= spinor_open,
+		.close		= spinor_close,
+		.xfer_one	= spinor_xfer_one,
+		.cs_release	= spinor_cs_release,
+	},
+	{
+		.name		= "loopback",
+		.conf		= &spidev_config,
+		.open		= loopback_open,
+		.xfer_one	= loopback_xfer_one,
+	},
+	{
+		.name		= "regmap",
+		.conf		= &spidev_config,
+		.open		= regmap_open,
+		.close		= regmap_close,
+		.xfer_one	= regmap_xfer_one,
+		.cs_release	= regmap_cs_release,
+	},
+};
+
+/*
+ * Run an emulated device through the transfers of a request, tracking the
+ * chip select the way the SPI core would drive it.
+ */
+static int spi_model_xfer_req_recv(struct gb_spi_dev *dev,
+				   struct gb_spi_transfer *xfers, int count,
+				   uint8_t *tx_data, uint8_t *rx_data)
+{
+	const struct spi_model *model = dev->model;
+	struct gb_spi_transfer *xfer;
+	uint8_t *tx, *rx;
+	uint32_t len;
+	int i;
+
+	for (i = 0, xfer = xfers; i < count; i++, xfer++) {
+		len = le32toh(xfer->len);
+		tx = NULL;
+		rx = NULL;
+		if (xfer->xfer_flags & GB_SPI_XFER_WRITE) {
+			tx = tx_data;
+			tx_data += len;
+		}
+		if (xfer->xfer_flags & GB_SPI_XFER_READ) {
+			rx = rx_data;
+			rx_data += len;
+		}
+
+		if (tx || rx)
+			model->xfer_one(dev, tx, rx, len);
+
+		if (!model->cs_release)
+			continue;
+
+		/*
+		 * Chip select drops after the message and wherever cs_change
+		 * asks for it, except that a cs_change or INPROGRESS flag on
+		 * the last transfer keeps it asserted for the next request.
+		 */
+		if (i < count - 1) {
+			if (xfer->cs_change)
+				model->cs_release(dev);
+		} else if (!xfer->cs_change &&
+			   !(xfer->xfer_flags & GB_SPI_XFER_INPROGRESS)) {
+			model->cs_release(dev);
+		}
+	}
+
+	return 0;
+}
+
+static int spi_dev_xfer(struct gb_spi_dev *dev, struct gb_spi_transfer *xfers,
+			int count, uint8_t *tx_data, uint8_t *rx_data)
+{
+	if (!dev->model)
+		return -ENODEV;
+
+	if (dev->model->xfer_req_recv)
+		return dev->model->xfer_req_recv(dev, xfers, count, tx_data,
+						 rx_data);
+
+	return spi_model_xfer_req_recv(dev, xfers, count, tx_data, rx_data);
+}
+
+static const struct spi_model *spi_model_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(spi_models) / sizeof(spi_models[0]); i++)
+		if (!strcmp(spi_models[i].name, name))
+			return &spi_models[i];
+
+	return NULL;
+}
+
+static int spi_conf_set(struct gb_spi_dev *dev, const char *key,
+			const char *val)
+{
+	struct gb_spi_dev_config *conf = &dev->conf;
+
+	if (!strcmp(key, "mode")) {
+		conf->mode = strtoul(val, NULL, 0);
+	} else if (!strcmp(key, "bpw")) {
+		conf->bits_per_word = strtoul(val, NULL, 0);
+	} else if (!strcmp(key, "speed")) {
+		conf->max_speed_hz = strtoul(val, NULL, 0);
+	} else if (!strcmp(key, "name")) {
+		memset(conf->name, 0, sizeof(conf->name));
+		strncpy((char *)conf->name, val, sizeof(conf->name) - 1);
+	} else if (!strcmp(key, "type")) {
+		if (!strcmp(val, "dev"))
+			conf->device_type = GB_SPI_SPI_DEV;
+		else if (!strcmp(val, "nor"))
+			conf->device_type = GB_SPI_SPI_NOR;
+		else if (!strcmp(val, "modalias"))
+			conf->device_type = GB_SPI_SPI_MODALIAS;
+		else
+			return -EINVAL;
+	} else if (!strcmp(key, "rdbit") && dev->model->open == regmap_open) {
+		((struct spi_regmap *)dev->priv)->rd_bit =
+			strtoul(val, NULL, 0);
+	} else {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Parse one configuration line and bring up its chip select */
+static int spi_dev_config_line(char *line, void *data)
+{
+	const struct spi_model *model;
+	struct gb_spi_dev *dev;
+	char *opts[CONF_MAX_OPTS];
+	char *tok, *save, *val;
+	char who[32];
+	char *arg;
+	unsigned long cs;
+	int num_opts, ret, i;
+
+	tok = strtok_r(line, " \t\r\n", &save);
+	if (!tok)
 		return 0;
-	
-  	spi_set_device(0,  SPIMOD_TYPE );
-  	spi_set_device(1,  SPIDEV_TYPE );
+
+	cs = strtoul(tok, NULL, 0);
+	if (cs >= SPI_MAX_CS) {
+		gbsim_error("spi chip select %lu out of range\n", cs);
+		return -EINVAL;
+	}
+
+	dev = &spi_devs[cs];
+	if (dev->model) {
+		gbsim_error("spi chip select %lu configured twice\n", cs);
+		return -EINVAL;
+	}
+
+	tok = strtok_r(NULL, " \t\r\n", &save);
+	model = tok ? spi_model_find(tok) : NULL;
+	if (!model) {
+		gbsim_error("spi chip select %lu: unknown model %s\n", cs,
+			    tok ? tok : "(none)");
+		return -EINVAL;
+	}
+
+	snprintf(who, sizeof(who), "spi chip select %lu", cs);
+	num_opts = conf_args(NULL, &save, &arg, opts, CONF_MAX_OPTS, who);
+	if (arg) {
+		strncpy(dev->arg, arg, sizeof(dev->arg) - 1);
+		arg = dev->arg;
+	}
+
+	dev->cs = cs;
+	dev->fd = -1;
+	dev->conf = *model->conf;
+	if (model->open) {
+		ret = model->open(dev, arg);
+		if (ret < 0)
+			return ret;
+	}
+	dev->model = model;
+
+	for (i = 0; i < num_opts; i++) {
+		val = strchr(opts[i], '=');
+		*val++ = '\0';
+		if (spi_conf_set(dev, opts[i], val) < 0)
+			gbsim_error("%s: bad option %s\n", who, opts[i]);
+	}
+
+	if (cs + 1 > spi_num_cs)
+		spi_num_cs = cs + 1;
+
+	gbsim_info("SPI CS%lu %s %s\n", cs, model->name, arg ? arg : "");
+
 	return 0;
 }
 
+static void spi_dev_config_default(void)
+{
+	char line[SPI_MAXLINE];
+	const char *model = bbb_backend ? "spidev" : "loopback";
+
+	snprintf(line, sizeof(line),
+		 "0 %s /dev/spidev%d.%d type=modalias mode=0 speed=6000000 name=",
+		 model, spi_busno, spi_csno);
+	spi_dev_config_line(line, NULL);
+
+	if (spi_nor_image)
+		snprintf(line, sizeof(line), "1 nor %s", spi_nor_image);
+	else
+		snprintf(line, sizeof(line), "1 %s /dev/spidev%d.%d",
+			 model, spi_busno, spi_csno);
+	spi_dev_config_line(line, NULL);
+}
+
+static void spi_master_setup(void)
+{
+	master.mode = GB_SPI_MODE_MODE_3;
+	master.flags = 0;
+	master.bpwm = SPI_BPW_MASK(8) | SPI_BPW_MASK(16) | SPI_BPW_MASK(32);
+	master.min_speed_hz = 400000;
+	master.max_speed_hz = 48000000;
+	master.num_chipselect = spi_num_cs;
+	master.devices = spi_devs;
+}
+
+static struct spi_connection *spi_connection_get(struct gbsim_connection *connection)
+{
+	struct gb_spi_master_config_response *mc_rsp;
+	struct spi_connection *spi_conn = connection->priv;
+
+	if (spi_conn)
+		return spi_conn;
+
+	spi_conn = calloc(1, sizeof(*spi_conn));
+	if (!spi_conn)
+		return NULL;
+
+	mc_rsp = &spi_conn->mc_rsp;
+	mc_rsp->mode = htole16(master.mode);
+	mc_rsp->flags = htole16(master.flags);
+	mc_rsp->bits_per_word_mask = htole32(master.bpwm);
+	mc_rsp->num_chipselect = htole16(master.num_chipselect);
+	mc_rsp->min_speed_hz = htole32(master.min_speed_hz);
+	mc_rsp->max_speed_hz = htole32(master.max_speed_hz);
+
+	connection->priv = spi_conn;
+
+	return spi_conn;
+}
+
+void spi_connection_exit(struct gbsim_connection *connection)
+{
+	free(connection->priv);
+	connection->priv = NULL;
+}
+
+/* An unnamed modalias device binds by the board's product string */
+static void spi_product_string(struct gbsim_connection *connection,
+			       uint8_t *name, size_t size)
+{
+	char path[80];
+	char fmt[16];
+	FILE *f;
+
+	snprintf(path, sizeof(path),
+		 "/sys/bus/greybus/devices/%d-%d.%d.ctrl/product_string",
+		 connection->cport_id, connection->intf->interface_id,
+		 connection->intf->interface_id);
+	f = fopen(path, "r");
+	if (!f) {
+		gbsim_error("failed opening %s\n", path);
+		return;
+	}
+
+	snprintf(fmt, sizeof(fmt), "%%%zus", size - 1);
+	if (fscanf(f, fmt, (char *)name) != 1)
+		name[0] = '\0';
+	fclose(f);
+}
+
+static void spi_device_config_build(struct gbsim_connection *connection,
+				    struct gb_spi_dev *spi_dev,
+				    struct gb_spi_device_config_response *dc_rsp)
+{
+	struct gb_spi_dev_config *conf = &spi_dev->conf;
+
+	dc_rsp->mode = htole16(conf->mode);
+	dc_rsp->bits_per_word = conf->bits_per_word;
+	dc_rsp->max_speed_hz = htole32(conf->max_speed_hz);
+	dc_rsp->device_type = conf->device_type;
+	memcpy(dc_rsp->name, conf->name, sizeof(dc_rsp->name));
+
+	if (conf->device_type == GB_SPI_SPI_MODALIAS && !conf->name[0])
+		spi_product_string(connection, dc_rsp->name,
+				   sizeof(dc_rsp->name));
+}
+
 int spi_handler(struct gbsim_connection *connection, void *rbuf,
 		   size_t rsize, void *tbuf, size_t tsize)
 {
@@ -307,11 +1017,14 @@ int spi_handler(struct gbsim_connection *connection, void *rbuf,
 	uint16_t hd_cport_id = connection->hd_cport_id;
 	struct gb_spi_transfer *xfer;
 	struct gb_spi_dev *spi_dev;
-	struct gb_spi_dev_config *conf;
+	struct spi_connection *spi_conn;
+	struct timespec ts_start, ts_end;
+	uint8_t result = GB_OP_SUCCESS;
 	void *xfer_data;
 	int xfer_cs, cs;
 	int xfer_count;
-	int xfer_rx = 0;
+	size_t xfer_tx = 0;
+	size_t xfer_rx = 0;
 	int ret;
 	int i;
 
@@ -320,55 +1033,89 @@ int spi_handler(struct gbsim_connection *connection, void *rbuf,
 
 	switch (oph->type) {
 	case GB_SPI_TYPE_MASTER_CONFIG:
-		spi_master_setup();
-		payload_size = sizeof(struct gb_spi_master_config_response);
+		spi_conn = spi_connection_get(connection);
+		if (!spi_conn)
+			return -ENOMEM;
 
-		op_rsp->spi_mc_rsp.mode = htole16(master->mode);
-		op_rsp->spi_mc_rsp.flags = htole16(master->flags);
-		op_rsp->spi_mc_rsp.bits_per_word_mask = htole32(master->bpwm);
-		op_rsp->spi_mc_rsp.num_chipselect = htole16(master->num_chipselect);
-		op_rsp->spi_mc_rsp.min_speed_hz = htole32(master->min_speed_hz);
-		op_rsp->spi_mc_rsp.max_speed_hz = htole32(master->max_speed_hz);
+		payload_size = sizeof(struct gb_spi_master_config_response);
+		op_rsp->spi_mc_rsp = spi_conn->mc_rsp;
 		break;
 	case GB_SPI_TYPE_DEVICE_CONFIG:
-		payload_size = sizeof(struct gb_spi_device_config_response);
-
 		cs = op_req->spi_dc_req.chip_select;
-		spi_dev = &master->devices[cs];
-		conf = spi_dev->conf;
-
-		op_rsp->spi_dc_rsp.mode = htole16(conf->mode);
-		op_rsp->spi_dc_rsp.bits_per_word = conf->bits_per_word;
-		op_rsp->spi_dc_rsp.max_speed_hz = htole32(conf->max_speed_hz);
-		op_rsp->spi_dc_rsp.device_type = conf->device_type;
-		char channelfilename[60];
-		char devicename[20];
-		FILE* channelfile;
-		snprintf(channelfilename, 59, "/sys/bus/greybus/devices/%d-%d.%d.ctrl/product_string", connection->cport_id,connection->intf->interface_id,connection->intf->interface_id);
-		channelfile = fopen(channelfilename,"r");
-		fscanf (channelfile,"%s",devicename);	
-	    memcpy(op_rsp->spi_dc_rsp.name, devicename, sizeof(devicename));
+		if (cs >= master.num_chipselect) {
+			result = GB_OP_INVALID;
+			break;
+		}
+
+		spi_conn = spi_connection_get(connection);
+		if (!spi_conn)
+			return -ENOMEM;
+
+		if (!(spi_conn->dc_valid & BIT(cs))) {
+			spi_device_config_build(connection, &master.devices[cs],
+						&spi_conn->dc_rsp[cs]);
+			spi_conn->dc_valid |= BIT(cs);
+		}
+
+		payload_size = sizeof(struct gb_spi_device_config_response);
+		op_rsp->spi_dc_rsp = spi_conn->dc_rsp[cs];
 		break;
 	case GB_SPI_TYPE_TRANSFER:
 		xfer_cs = op_req->spi_xfer_req.chip_select;
-		xfer_count = op_req->spi_xfer_req.count;
+		xfer_count = le16toh(op_req->spi_xfer_req.count);
 
 		xfer = &op_req->spi_xfer_req.transfers[0];
+
+		if (xfer_cs >= master.num_chipselect ||
+		    !xfer_count) {
+			result = GB_OP_INVALID;
+			break;
+		}
+
+		/* The count comes from the AP, the descriptors must be there */
+		if (rsize < offsetof(struct op_msg, spi_xfer_req.transfers) ||
+		    xfer_count * sizeof(*xfer) >
+		    rsize - offsetof(struct op_msg, spi_xfer_req.transfers)) {
+			gbsim_error("spi transfer count %d too big\n",
+				    xfer_count);
+			result = GB_OP_INVALID;
+			break;
+		}
 		xfer_data = xfer + xfer_count;
 
-		spi_dev = &master->devices[xfer_cs];
+		for (i = 0; i < xfer_count; i++) {
+			if (xfer[i].xfer_flags & GB_SPI_XFER_WRITE)
+				xfer_tx += le32toh(xfer[i].len);
+			if (xfer[i].xfer_flags & GB_SPI_XFER_READ)
+				xfer_rx += le32toh(xfer[i].len);
+		}
+
+		/* Both the outbound data and the response must fit */
+		if (xfer_tx > (uint8_t *)rbuf + rsize - (uint8_t *)xfer_data ||
+		    sizeof(*oph) + xfer_rx > tsize) {
+			gbsim_error("spi transfer too big (tx %zu rx %zu)\n",
+				    xfer_tx, xfer_rx);
+			xfer_rx = 0;
+			result = GB_OP_INVALID;
+			break;
+		}
 
-		spi_dev->buf_resp = op_rsp->spi_xfer_rsp.data;
+		spi_dev = &master.devices[xfer_cs];
 
-		for (i = 0; i < xfer_count; i++, xfer++) {
-			spi_dev->xfer_req_recv(spi_dev, xfer, xfer_data);
-			/* we only increment if transfer is write */
-			if (xfer->xfer_flags & GB_SPI_XFER_WRITE)
-				xfer_data += xfer->len;
-			if (xfer->xfer_flags & GB_SPI_XFER_READ)
-				xfer_rx += xfer->len;
+		clock_gettime(CLOCK_MONOTONIC, &ts_start);
+		ret = spi_dev_xfer(spi_dev, xfer, xfer_count, xfer_data,
+				   op_rsp->spi_xfer_rsp.data);
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		if (ret < 0) {
+			xfer_rx = 0;
+			result = gbsim_errno_to_result(-ret);
 		}
 
+		gbsim_debug("SPI cs %d %d transfers tx %zu rx %zu in %ld us\n",
+			    xfer_cs, xfer_count, xfer_tx, xfer_rx,
+			    (ts_end.tv_sec - ts_start.tv_sec) * 1000000 +
+			    (ts_end.tv_nsec - ts_start.tv_nsec) / 1000);
+
 		payload_size = sizeof(struct gb_spi_transfer_response) + xfer_rx;
 		break;
 	//default: //Gives Unknown Operation Error, Needs to find origin
@@ -377,8 +1124,7 @@ int spi_handler(struct gbsim_connection *connection, void *rbuf,
 
 	message_size = sizeof(struct gb_operation_msg_hdr) + payload_size;
 	ret = send_response(hd_cport_id, op_rsp, message_size,
-			    oph->operation_id, oph->type,
-			    PROTOCOL_STATUS_SUCCESS);
+			    oph->operation_id, oph->type, result);
 	return ret;
 }
 
@@ -399,13 +1145,40 @@ char *spi_get_operation(uint8_t type)
 }
 void spi_init(void)	
 {	
-	char filename[30];
+	int cs;
 
-	if(bbb_backend)
-	{
-		snprintf(filename, 29, "/dev/spidev%d.%d", spi_busno,spi_csno);
-		ifd1 = open(filename, O_RDWR);
-		if (ifd1 < 0)	
-			gbsim_error("failed opening spi node read/write\n");
-	}	
+	if (spi_config)
+		conf_file(spi_config, spi_dev_config_line, NULL);
+	else
+		spi_dev_config_default();
+
+	/* The AP probes every chip select up to the highest one configured */
+	for (cs = 0; cs < spi_num_cs; cs++) {
+		if (spi_devs[cs].model)
+			continue;
+		gbsim_error("spi chip select %d not configured, using loopback\n",
+			    cs);
+		spi_devs[cs].cs = cs;
+		spi_devs[cs].fd = -1;
+		spi_devs[cs].model = spi_model_find("loopback");
+		spi_devs[cs].conf = *spi_devs[cs].model->conf;
+		loopback_open(&spi_devs[cs], NULL);
+	}
+
+	spi_master_setup();
+}
+
+void spi_cleanup(void)
+{
+	int cs;
+
+	for (cs = 0; cs < spi_num_cs; cs++) {
+		if (spi_devs[cs].model && spi_devs[cs].model->close)
+			spi_devs[cs].model->close(&spi_devs[cs]);
+		else
+			free(spi_devs[cs].priv);
+		spi_devs[cs].model = NULL;
+		spi_devs[cs].priv = NULL;
+	}
+	spi_num_cs = 0;
 }
@@ -0,0 +1,708 @@
+/*
+ * Greybus Simulator: virtual module stress mode
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+#define STRESS_MAX_MODULES	(GBSIM_MAX_INTERFACES - 1)
+#define STRESS_MAX_MIXES	16
+#define STRESS_REPORT_MS	5000
+#define STRESS_HIST_BUCKETS	32
+
+/*
+ * Instead of watching the hotplug directory, insert and remove up to
+ * STRESS_MAX_MODULES virtual modules built in memory from a template
+ * manifest. The config file holds one setting per line:
+ *
+ *   template  FILE        manifest blob or .mnfs source (required)
+ *   modules   N           virtual modules (16)
+ *   rate      N           MODULE_INSERTED/REMOVED requests per second (10)
+ *   time      SECONDS     stop churning after this long (0: never)
+ *   inflight  N           requests waiting for the AP at most (8)
+ *   seed      N           seed of the module picks, for repeatable runs
+ *   mix       PROTO[,PROTO...]
+ *
+ * Each module gets its own product string, so its manifest is unique.
+ * With mix lines, module n keeps only the template CPorts of protocols
+ * in the (n % mixes)th mix, and the bundles still having CPorts.
+ *
+ * Modules are inserted until all are in, then one is removed and one
+ * inserted in turn. The SVC round trip of each request, the delay from
+ * MODULE_INSERTED to the AP reading the manifest, and the time taken to
+ * answer control requests are reported every STRESS_REPORT_MS and on
+ * exit.
+ */
+enum stress_state {
+	STRESS_OUT,
+	STRESS_INSERTING,
+	STRESS_IN,
+	STRESS_REMOVING,
+};
+
+struct stress_module {
+	unsigned int index;
+	enum stress_state state;
+	uint8_t intf_id;
+	bool enumerated;
+	uint64_t insert_us;
+	uint64_t sent_us;	/* last MODULE_INSERTED/REMOVED */
+	void *blob;
+	size_t size;
+};
+
+struct stress_stat {
+	const char *name;
+	unsigned long count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	unsigned long hist[STRESS_HIST_BUCKETS];	/* log2 of us */
+};
+
+static struct {
+	char *template;
+	unsigned int modules;
+	unsigned int rate;
+	unsigned int time;
+	unsigned int inflight;
+	unsigned int seed;
+	uint32_t mixes[STRESS_MAX_MIXES][256 / 32];
+	unsigned int num_mixes;
+} stress_cfg = {
+	.modules = 16,
+	.rate = 10,
+	.inflight = 8,
+	.seed = 1,
+};
+
+static struct stress_module stress_modules[STRESS_MAX_MODULES];
+static struct stress_module *stress_by_id[GBSIM_MAX_INTERFACES];
+static struct gbsim_svc *stress_svc;
+static bool stress_active;
+static bool stress_stop;
+static pthread_t stress_pthread;
+static pthread_mutex_t stress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stress_cond;
+
+static unsigned int stress_in, stress_inflight;
+static unsigned long stress_inserts, stress_removes, stress_enums;
+static unsigned long stress_failed;
+static uint64_t stress_start_us, stress_end_us;
+
+static struct stress_stat stress_svc_rtt = { .name = "svc round trip" };
+static struct stress_stat stress_enum_time = { .name = "enumeration" };
+static struct stress_stat stress_control_time = { .name = "control" };
+
+static const struct {
+	const char *name;
+	uint8_t protocol;
+} stress_protocols[] = {
+	{ "gpio", GREYBUS_PROTOCOL_GPIO },
+	{ "i2c", GREYBUS_PROTOCOL_I2C },
+	{ "uart", GREYBUS_PROTOCOL_UART },
+	{ "hid", GREYBUS_PROTOCOL_HID },
+	{ "usb", GREYBUS_PROTOCOL_USB },
+	{ "sdio", GREYBUS_PROTOCOL_SDIO },
+	{ "pwm", GREYBUS_PROTOCOL_PWM },
+	{ "spi", GREYBUS_PROTOCOL_SPI },
+	{ "lights", GREYBUS_PROTOCOL_LIGHTS },
+	{ "loopback", GREYBUS_PROTOCOL_LOOPBACK },
+	{ "raw", GREYBUS_PROTOCOL_RAW },
+	{ "vendor", GREYBUS_PROTOCOL_VENDOR },
+};
+
+static uint64_t stress_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Called with stress_lock held */
+static void stress_stat_add(struct stress_stat *stat, uint64_t us)
+{
+	int bucket = 0;
+
+	while (bucket < STRESS_HIST_BUCKETS - 1 && (us >> bucket) > 1)
+		bucket++;
+
+	stat->hist[bucket]++;
+	stat->sum += us;
+	if (!stat->count || us < stat->min)
+		stat->min = us;
+	if (us > stat->max)
+		stat->max = us;
+	stat->count++;
+}
+
+/* Upper bound of the histogram bucket holding the pct percentile */
+static uint64_t stress_stat_pct(struct stress_stat *stat, unsigned int pct)
+{
+	unsigned long seen = 0;
+	int bucket;
+
+	for (bucket = 0; bucket < STRESS_HIST_BUCKETS; bucket++) {
+		seen += stat->hist[bucket];
+		if (seen * 100 >= stat->count * pct)
+			break;
+	}
+
+	return 2ULL << bucket;
+}
+
+static void stress_stat_report(struct stress_stat *stat)
+{
+	if (!stat->count)
+		return;
+
+	gbsim_info("stress: %-15s %lu, us min %llu avg %llu p50 <%llu p99 <%llu max %llu\n",
+		   stat->name, stat->count, (unsigned long long)stat->min,
+		   (unsigned long long)(stat->sum / stat->count),
+		   (unsigned long long)stress_stat_pct(stat, 50),
+		   (unsigned long long)stress_stat_pct(stat, 99),
+		   (unsigned long long)stat->max);
+}
+
+/* Called with stress_lock held */
+static void stress_report(void)
+{
+	uint64_t end_us = stress_end_us ? stress_end_us : stress_now_us();
+	double secs = (end_us - stress_start_us) / 1e6;
+
+	if (secs <= 0)
+		return;
+
+	gbsim_info("stress: %.1f s, %u of %u in, %lu inserted (%.1f/s), %lu removed, %lu enumerated (%.1f/s), %lu failed\n",
+		   secs, stress_in, stress_cfg.modules, stress_inserts,
+		   stress_inserts / secs, stress_removes, stress_enums,
+		   stress_enums / secs, stress_failed);
+	stress_stat_report(&stress_svc_rtt);
+	stress_stat_report(&stress_enum_time);
+	stress_stat_report(&stress_control_time);
+}
+
+static int stress_protocol(const char *name)
+{
+	char *end;
+	long val;
+	int i;
+
+	for (i = 0; i < sizeof(stress_protocols) / sizeof(stress_protocols[0]);
+	     i++)
+		if (!strcmp(stress_protocols[i].name, name))
+			return stress_protocols[i].protocol;
+
+	val = strtol(name, &end, 0);
+	if (*end || val < 0 || val > UINT8_MAX)
+		return -EINVAL;
+
+	return val;
+}
+
+static int stress_config_mix(char *arg)
+{
+	uint32_t *mix = stress_cfg.mixes[stress_cfg.num_mixes];
+	char *tok, *save;
+	int protocol;
+
+	if (stress_cfg.num_mixes == STRESS_MAX_MIXES) {
+		gbsim_error("stress: too many mixes\n");
+		return -EINVAL;
+	}
+
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		protocol = stress_protocol(tok);
+		if (protocol < 0) {
+			gbsim_error("stress: unknown protocol %s\n", tok);
+			return protocol;
+		}
+		mix[protocol / 32] |= 1U << (protocol % 32);
+	}
+
+	stress_cfg.num_mixes++;
+	return 0;
+}
+
+/* <key> <value> */
+static int stress_config_line(char *line, void *data)
+{
+	char *key, *val, *save;
+	unsigned long num;
+
+	key = strtok_r(line, " \t\r\n", &save);
+	if (!key)
+		return 0;
+
+	val = strtok_r(NULL, " \t\r\n", &save);
+	if (!val) {
+		gbsim_error("stress: %s needs a value\n", key);
+		return -EINVAL;
+	}
+
+	if (!strcmp(key, "template")) {
+		free(stress_cfg.template);
+		stress_cfg.template = strdup(val);
+		return stress_cfg.template ? 0 : -ENOMEM;
+	}
+	if (!strcmp(key, "mix"))
+		return stress_config_mix(val);
+
+	num = strtoul(val, NULL, 0);
+	if (!strcmp(key, "modules")) {
+		if (!num || num > STRESS_MAX_MODULES) {
+			gbsim_error("stress: modules must be 1 to %d\n",
+				    STRESS_MAX_MODULES);
+			return -EINVAL;
+		}
+		stress_cfg.modules = num;
+	} else if (!strcmp(key, "rate")) {
+		stress_cfg.rate = num ? num : 1;
+	} else if (!strcmp(key, "time")) {
+		stress_cfg.time = num;
+	} else if (!strcmp(key, "inflight")) {
+		stress_cfg.inflight = num ? num : 1;
+	} else if (!strcmp(key, "seed")) {
+		stress_cfg.seed = num;
+	} else {
+		gbsim_error("stress: unknown setting %s\n", key);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static bool stress_mix_has(const uint32_t *mix, uint8_t protocol)
+{
+	return mix[protocol / 32] & (1U << (protocol % 32));
+}
+
+/* Build module m from the template, see the comment at the top */
+static int stress_module_build(struct stress_module *m,
+			       struct gbsim_manifest *tmpl)
+{
+	const uint32_t *mix = NULL;
+	struct greybus_manifest_header *mh;
+	struct greybus_descriptor *desc, *out;
+	struct greybus_descriptor_string *product = NULL;
+	bool bundle_used[256] = { false };
+	char name[UINT8_MAX + 1];
+	size_t off, dsize, len = 0;
+	uint8_t *blob;
+	int n;
+
+	if (stress_cfg.num_mixes)
+		mix = stress_cfg.mixes[m->index % stress_cfg.num_mixes];
+
+	if (tmpl->intf_desc)
+		product = tmpl->num_strings > tmpl->intf_desc->product_stringid ?
+			  tmpl->strings[tmpl->intf_desc->product_stringid] :
+			  NULL;
+	if (product) {
+		n = snprintf(name, sizeof(name), "%.*s %03u",
+			     product->length > UINT8_MAX - 4 ?
+			     UINT8_MAX - 4 : product->length,
+			     (char *)product->string, m->index);
+		len = n;
+	}
+
+	/* Room for the template plus the longer product string */
+	blob = calloc(1, tmpl->size + sizeof(desc->header) + sizeof(*product) +
+			  len + 4);
+	if (!blob)
+		return -ENOMEM;
+
+	for (off = sizeof(*mh); off < tmpl->size; off += dsize) {
+		desc = (struct greybus_descriptor *)((uint8_t *)tmpl->data + off);
+		dsize = le16toh(desc->header.size);
+		if (desc->header.type == GREYBUS_TYPE_CPORT &&
+		    (!mix || stress_mix_has(mix, desc->cport.protocol_id) ||
+		     desc->cport.protocol_id == GREYBUS_PROTOCOL_CONTROL))
+			bundle_used[desc->cport.bundle] = true;
+	}
+
+	mh = (struct greybus_manifest_header *)blob;
+	memcpy(mh, tmpl->data, sizeof(*mh));
+	m->size = sizeof(*mh);
+
+	for (off = sizeof(*mh); off < tmpl->size; off += dsize) {
+		desc = (struct greybus_descriptor *)((uint8_t *)tmpl->data + off);
+		dsize = le16toh(desc->header.size);
+		out = (struct greybus_descriptor *)(blob + m->size);
+
+		switch (desc->header.type) {
+		case GREYBUS_TYPE_STRING:
+			if (&desc->string != product)
+				break;
+			out->header.size = htole16(ALIGN(sizeof(desc->header) +
+							 sizeof(desc->string) +
+							 len));
+			out->header.type = GREYBUS_TYPE_STRING;
+			out->string.length = len;
+			out->string.id = product->id;
+			memcpy(out->string.string, name, len);
+			m->size += le16toh(out->header.size);
+			continue;
+		case GREYBUS_TYPE_BUNDLE:
+			if (!bundle_used[desc->bundle.id] &&
+			    desc->bundle.class != GREYBUS_CLASS_CONTROL)
+				continue;
+			break;
+		case GREYBUS_TYPE_CPORT:
+			if (!bundle_used[desc->cport.bundle] ||
+			    (mix && !stress_mix_has(mix,
+						    desc->cport.protocol_id) &&
+			     desc->cport.protocol_id != GREYBUS_PROTOCOL_CONTROL))
+				continue;
+			break;
+		}
+
+		memcpy(out, desc, dsize);
+		m->size += dsize;
+	}
+
+	mh->size = htole16(m->size);
+	m->blob = blob;
+
+	return 0;
+}
+
+static int stress_modules_build(void)
+{
+	struct gbsim_manifest *tmpl;
+	size_t len = strlen(stress_cfg.template);
+	unsigned int i;
+	int ret = 0;
+
+	if (len > 5 && !strcmp(stress_cfg.template + len - 5, ".mnfs"))
+		tmpl = mnfs_get(stress_cfg.template);
+	else
+		tmpl = manifest_get(stress_cfg.template);
+	if (!tmpl) {
+		gbsim_error("stress: invalid template %s\n",
+			    stress_cfg.template);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < stress_cfg.modules && !ret; i++) {
+		stress_modules[i].index = i;
+		ret = stress_module_build(&stress_modules[i], tmpl);
+	}
+
+	manifest_put(tmpl);
+	return ret;
+}
+
+static void stress_done(void *data, struct op_msg *rsp, size_t rsize,
+			int status)
+{
+	struct stress_module *m = data;
+
+	pthread_mutex_lock(&stress_lock);
+	stress_stat_add(&stress_svc_rtt, stress_now_us() - m->sent_us);
+	if (status)
+		stress_failed++;
+
+	/*
+	 * Interfaces are freed on the receive thread when the AP disables
+	 * them, never here. A module that failed to go in keeps its
+	 * interface for the next insert, one that failed to go out stays in
+	 * to be removed again.
+	 */
+	if (m->state == STRESS_INSERTING) {
+		if (status) {
+			gbsim_error("stress: module %u insert failed (%d)\n",
+				    m->index, status);
+			m->state = STRESS_OUT;
+		} else {
+			m->state = STRESS_IN;
+			stress_in++;
+		}
+	} else if (status) {
+		gbsim_error("stress: module %u remove failed (%d)\n",
+			    m->index, status);
+		m->state = STRESS_IN;
+		stress_in++;
+	} else {
+		if (stress_by_id[m->intf_id] == m)
+			stress_by_id[m->intf_id] = NULL;
+		m->state = STRESS_OUT;
+	}
+
+	stress_inflight--;
+	pthread_cond_broadcast(&stress_cond);
+	pthread_mutex_unlock(&stress_lock);
+}
+
+/* Called with stress_lock held, drops it over the request */
+static void stress_insert(struct stress_module *m)
+{
+	struct gbsim_interface *intf;
+	struct gbsim_manifest *mnf;
+	int intf_id, ret;
+
+	/* The interface of an earlier failed insert, unless the AP freed it */
+	if (stress_by_id[m->intf_id] == m &&
+	    interface_get_by_id(stress_svc, m->intf_id)) {
+		intf_id = m->intf_id;
+		goto send;
+	}
+
+	intf_id = svc_get_next_intf_id(stress_svc);
+	if (intf_id < 0) {
+		gbsim_error("stress: no free interface id\n");
+		stress_failed++;
+		return;
+	}
+
+	mnf = manifest_get_data(m->blob, m->size);
+	if (!mnf) {
+		stress_failed++;
+		return;
+	}
+
+	intf = interface_alloc(stress_svc, intf_id);
+	if (!intf) {
+		manifest_put(mnf);
+		stress_failed++;
+		return;
+	}
+	manifest_attach(intf, mnf);
+	intf->serial_number = m->index + 1;
+
+send:
+	m->state = STRESS_INSERTING;
+	m->intf_id = intf_id;
+	m->enumerated = false;
+	m->insert_us = stress_now_us();
+	m->sent_us = m->insert_us;
+	stress_by_id[intf_id] = m;
+	stress_inserts++;
+	stress_inflight++;
+
+	pthread_mutex_unlock(&stress_lock);
+	ret = svc_request_send_cb(GB_SVC_TYPE_MODULE_INSERTED, intf_id,
+				  stress_done, m);
+	pthread_mutex_lock(&stress_lock);
+
+	if (ret < 0) {
+		gbsim_error("stress: module %u insert: send failed (%d)\n",
+			    m->index, ret);
+		m->state = STRESS_OUT;
+		stress_inflight--;
+		stress_failed++;
+	}
+}
+
+/* Called with stress_lock held, drops it over the request */
+static void stress_remove(struct stress_module *m)
+{
+	int ret;
+
+	m->state = STRESS_REMOVING;
+	m->sent_us = stress_now_us();
+	stress_in--;
+	stress_removes++;
+	stress_inflight++;
+
+	pthread_mutex_unlock(&stress_lock);
+	ret = svc_request_send_cb(GB_SVC_TYPE_MODULE_REMOVED, m->intf_id,
+				  stress_done, m);
+	pthread_mutex_lock(&stress_lock);
+
+	if (ret < 0) {
+		gbsim_error("stress: module %u remove: send failed (%d)\n",
+			    m->index, ret);
+		m->state = STRESS_IN;
+		stress_in++;
+		stress_inflight--;
+		stress_failed++;
+	}
+}
+
+/* A module in the given state, picked at random */
+static struct stress_module *stress_pick(enum stress_state state,
+					 unsigned int *seed)
+{
+	unsigned int i, start = rand_r(seed) % stress_cfg.modules;
+	struct stress_module *m;
+
+	for (i = 0; i < stress_cfg.modules; i++) {
+		m = &stress_modules[(start + i) % stress_cfg.modules];
+		if (m->state == state)
+			return m;
+	}
+
+	return NULL;
+}
+
+static void stress_abstime(uint64_t us, struct timespec *ts)
+{
+	ts->tv_sec = us / 1000000;
+	ts->tv_nsec = (us % 1000000) * 1000;
+}
+
+static void *stress_thread(void *arg)
+{
+	uint64_t period_us = 1000000 / stress_cfg.rate;
+	uint64_t next_us, report_us, end_us = 0;
+	unsigned int seed = stress_cfg.seed;
+	struct stress_module *m;
+	struct timespec ts;
+
+	pthread_mutex_lock(&stress_lock);
+	stress_start_us = stress_now_us();
+	next_us = stress_start_us;
+	report_us = stress_start_us + STRESS_REPORT_MS * 1000;
+	if (stress_cfg.time)
+		end_us = stress_start_us + stress_cfg.time * 1000000ULL;
+
+	while (!stress_stop) {
+		if (stress_now_us() < next_us) {
+			stress_abstime(next_us, &ts);
+			pthread_cond_timedwait(&stress_cond, &stress_lock, &ts);
+			continue;
+		}
+		if (stress_inflight >= stress_cfg.inflight) {
+			pthread_cond_wait(&stress_cond, &stress_lock);
+			continue;
+		}
+
+		if (next_us >= report_us) {
+			stress_report();
+			report_us += STRESS_REPORT_MS * 1000;
+		}
+		if (end_us && next_us >= end_us) {
+			stress_end_us = stress_now_us();
+			gbsim_info("stress: run complete\n");
+			stress_report();
+			break;
+		}
+
+		/* A late request doesn't make the next ones early */
+		next_us += period_us;
+		if (next_us < stress_now_us())
+			next_us = stress_now_us();
+
+		m = NULL;
+		if (stress_in < stress_cfg.modules)
+			m = stress_pick(STRESS_OUT, &seed);
+		if (m) {
+			stress_insert(m);
+			continue;
+		}
+
+		m = stress_pick(STRESS_IN, &seed);
+		if (m)
+			stress_remove(m);
+	}
+	pthread_mutex_unlock(&stress_lock);
+
+	return NULL;
+}
+
+/* Zero unless stress mode is running, for stress_control() */
+uint64_t stress_time_us(void)
+{
+	return stress_active ? stress_now_us() : 0;
+}
+
+/* A control request of intf answered, received at start_us */
+void stress_control(struct gbsim_interface *intf, uint8_t type,
+		    uint64_t start_us)
+{
+	struct stress_module *m;
+	uint64_t now;
+
+	if (!start_us)
+		return;
+
+	now = stress_now_us();
+	pthread_mutex_lock(&stress_lock);
+	stress_stat_add(&stress_control_time, now - start_us);
+
+	/* The AP has enumerated the module once it read the manifest */
+	m = stress_by_id[intf->interface_id];
+	if (type == GB_CONTROL_TYPE_GET_MANIFEST && m && !m->enumerated &&
+	    (m->state == STRESS_INSERTING || m->state == STRESS_IN)) {
+		m->enumerated = true;
+		stress_enums++;
+		stress_stat_add(&stress_enum_time, now - m->insert_us);
+	}
+	pthread_mutex_unlock(&stress_lock);
+}
+
+int stress_start(struct gbsim_svc *svc, const char *config)
+{
+	pthread_condattr_t attr;
+	int ret;
+
+	ret = conf_file(config, stress_config_line, NULL);
+	if (ret < 0)
+		return ret;
+
+	if (!stress_cfg.template) {
+		gbsim_error("stress: no template manifest\n");
+		return -EINVAL;
+	}
+
+	ret = stress_modules_build();
+	if (ret < 0)
+		return ret;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&stress_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	stress_svc = svc;
+	stress_active = true;
+
+	ret = pthread_create(&stress_pthread, NULL, stress_thread, NULL);
+	if (ret) {
+		stress_active = false;
+		return -ret;
+	}
+
+	gbsim_info("stress: %u modules from %s, %u requests/s\n",
+		   stress_cfg.modules, stress_cfg.template, stress_cfg.rate);
+
+	return 0;
+}
+
+void stress_cleanup(void)
+{
+	unsigned int i;
+
+	if (!stress_active)
+		return;
+
+	pthread_mutex_lock(&stress_lock);
+	stress_stop = true;
+	pthread_cond_broadcast(&stress_cond);
+	pthread_mutex_unlock(&stress_lock);
+	pthread_join(stress_pthread, NULL);
+
+	pthread_mutex_lock(&stress_lock);
+	stress_active = false;
+	stress_report();
+	pthread_mutex_unlock(&stress_lock);
+
+	for (i = 0; i < stress_cfg.modules; i++) {
+		free(stress_modules[i].blob);
+		stress_modules[i].blob = NULL;
+	}
+	free(stress_cfg.template);
+	stress_cfg.template = NULL;
+}
@@ -22,20 +22,33 @@
 
 struct gbsim_svc *svc;
 
+#define SVC_TIMEOUT_MS	2000
+#define SVC_RETRIES	2
+
+/* Interface DME attributes, any other reads as the Toshiba MIPI id */
+#define DME_TOSHIBA_MFR_ID	0x0126
+#define DME_TOSHIBA_GMP_SN0	0x6002
+#define DME_TOSHIBA_GMP_SN1	0x6003
+
+/* Lowest free interface id, or -ENOSPC; id 0 is the AP's */
 int svc_get_next_intf_id(struct gbsim_svc *s)
 {
-	struct gbsim_interface *intf;
-	int intf_id = 1;
-
-start_again:
-	TAILQ_FOREACH(intf, &s->intfs, intf_node) {
-		if (intf_id == intf->interface_id) {
-			intf_id++;
-			goto start_again;
+	uint32_t free_ids;
+	int i, id = -ENOSPC;
+
+	pthread_mutex_lock(&s->intf_lock);
+	for (i = 0; i < GBSIM_MAX_INTERFACES / 32; i++) {
+		free_ids = ~s->intf_id_map[i];
+		if (!i)
+			free_ids &= ~1U;
+		if (free_ids) {
+			id = i * 32 + __builtin_ctz(free_ids);
+			break;
 		}
 	}
+	pthread_mutex_unlock(&s->intf_lock);
 
-	return intf_id;
+	return id;
 }
 
 static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
@@ -56,6 +69,18 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 	struct gb_svc_route_destroy_request *svc_route_destroy;
 	struct gb_svc_intf_set_pwrm_request *svc_intf_set_pwrm;
 	struct gb_svc_pwrmon_rail_count_get_response *svc_pwrmon_rail_count_get_response;
+	struct gb_svc_pwrmon_rail_names_get_response *svc_pwrmon_rail_names_get_response;
+	struct gb_svc_pwrmon_sample_get_request *svc_pwrmon_sample_get_request;
+	struct gb_svc_pwrmon_sample_get_response *svc_pwrmon_sample_get_response;
+	struct gb_svc_pwrmon_intf_sample_get_request *svc_pwrmon_intf_sample_get_request;
+	struct gb_svc_pwrmon_intf_sample_get_response *svc_pwrmon_intf_sample_get_response;
+	struct gb_svc_timesync_enable_request *svc_timesync_enable;
+	uint64_t frame_time[GB_TIMESYNC_MAX_STROBES];
+	uint32_t measurement = 0;
+	uint32_t val;
+	uint8_t result;
+	uint8_t status = GB_OP_SUCCESS;
+	int i;
 	struct gb_svc_intf_vsys_response *svc_intf_vsys_response;
 	struct gb_svc_intf_refclk_response *svc_intf_refclk_response;
 	struct gb_svc_intf_unipro_response *svc_intf_unipro_response;
@@ -121,6 +146,11 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 			    ap_intf_id, ap_cport_id, mod_intf_id, mod_cport_id);
 
 		connection = connection_find(ap_cport_id);
+		if (!connection) {
+			gbsim_error("SVC No connection for AP cport %hu\n",
+				    ap_cport_id);
+			break;
+		}
 
 		free_connection(connection);
 		break;
@@ -129,7 +159,20 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 		dme_get_request = &op_req->svc_dme_peer_get_request;
 		dme_get_response = &op_rsp->svc_dme_peer_get_response;
 		dme_get_response->result_code = 0;
-		dme_get_response->attr_value = 0x0126;
+
+		intf = interface_get_by_id(svc, dme_get_request->intf_id);
+		switch (le16toh(dme_get_request->attr)) {
+		case DME_TOSHIBA_GMP_SN0:
+			val = intf ? intf->serial_number : 0;
+			break;
+		case DME_TOSHIBA_GMP_SN1:
+			val = 0;
+			break;
+		default:
+			val = DME_TOSHIBA_MFR_ID;
+			break;
+		}
+		dme_get_response->attr_value = htole32(val);
 
 		gbsim_debug("SVC dme peer get (%hhu %hu %hu) request\n",
 			    dme_get_request->intf_id, dme_get_request->attr,
@@ -170,7 +213,38 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 	case GB_SVC_TYPE_PWRMON_RAIL_COUNT_GET:
 		payload_size = sizeof(*svc_pwrmon_rail_count_get_response);
 		svc_pwrmon_rail_count_get_response = &op_rsp->svc_pwrmon_rail_count_get_response;
-		svc_pwrmon_rail_count_get_response->rail_count = 0;
+		svc_pwrmon_rail_count_get_response->rail_count = power_rail_count();
+		break;
+	case GB_SVC_TYPE_PWRMON_RAIL_NAMES_GET:
+		svc_pwrmon_rail_names_get_response = &op_rsp->svc_pwrmon_rail_names_get_response;
+		svc_pwrmon_rail_names_get_response->status = GB_SVC_OP_SUCCESS;
+		payload_size = sizeof(*svc_pwrmon_rail_names_get_response) +
+			power_rail_names(svc_pwrmon_rail_names_get_response->name[0],
+					 tsize - message_size -
+					 sizeof(*svc_pwrmon_rail_names_get_response));
+		break;
+	case GB_SVC_TYPE_PWRMON_SAMPLE_GET:
+		payload_size = sizeof(*svc_pwrmon_sample_get_response);
+		svc_pwrmon_sample_get_request = &op_req->svc_pwrmon_sample_get_request;
+		svc_pwrmon_sample_get_response = &op_rsp->svc_pwrmon_sample_get_response;
+
+		result = power_sample(svc, svc_pwrmon_sample_get_request->rail_id,
+				      svc_pwrmon_sample_get_request->measurement_type,
+				      &measurement);
+		svc_pwrmon_sample_get_response->result = result;
+		svc_pwrmon_sample_get_response->measurement = htole32(measurement);
+		break;
+	case GB_SVC_TYPE_PWRMON_INTF_SAMPLE_GET:
+		payload_size = sizeof(*svc_pwrmon_intf_sample_get_response);
+		svc_pwrmon_intf_sample_get_request = &op_req->svc_pwrmon_intf_sample_get_request;
+		svc_pwrmon_intf_sample_get_response = &op_rsp->svc_pwrmon_intf_sample_get_response;
+
+		result = power_intf_sample(svc,
+					   svc_pwrmon_intf_sample_get_request->intf_id,
+					   svc_pwrmon_intf_sample_get_request->measurement_type,
+					   &measurement);
+		svc_pwrmon_intf_sample_get_response->result = result;
+		svc_pwrmon_intf_sample_get_response->measurement = htole32(measurement);
 		break;
 	case GB_SVC_TYPE_INTF_VSYS_ENABLE:
 		payload_size = sizeof(*svc_intf_vsys_response);
@@ -232,6 +306,40 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
         svc_intf_set_pwrm_response->result_code = GB_SVC_SETPWRM_PWR_OK;
 
 		break;
+	case GB_SVC_TYPE_TIMESYNC_ENABLE:
+		svc_timesync_enable = &op_req->svc_timesync_enable_request;
+		if (timesync_svc_enable(svc_timesync_enable->count,
+					le64toh(svc_timesync_enable->frame_time),
+					le32toh(svc_timesync_enable->strobe_delay),
+					le32toh(svc_timesync_enable->refclk)))
+			status = GB_OP_INVALID;
+		break;
+	case GB_SVC_TYPE_TIMESYNC_DISABLE:
+		timesync_svc_disable();
+		break;
+	case GB_SVC_TYPE_TIMESYNC_AUTHORITATIVE:
+		payload_size = sizeof(op_rsp->svc_timesync_authoritative_response);
+		if (timesync_svc_authoritative(frame_time)) {
+			status = GB_OP_INVALID;
+			memset(frame_time, 0, sizeof(frame_time));
+		}
+		for (i = 0; i < GB_TIMESYNC_MAX_STROBES; i++)
+			op_rsp->svc_timesync_authoritative_response.frame_time[i] =
+				htole64(frame_time[i]);
+		break;
+	case GB_SVC_TYPE_TIMESYNC_WAKE_PINS_ACQUIRE:
+		timesync_svc_wake_pins_acquire(le32toh(op_req->svc_timesync_wake_pins_acquire_request.strobe_mask));
+		break;
+	case GB_SVC_TYPE_TIMESYNC_WAKE_PINS_RELEASE:
+		timesync_svc_wake_pins_release();
+		break;
+	case GB_SVC_TYPE_TIMESYNC_PING:
+		payload_size = sizeof(op_rsp->svc_timesync_ping_response);
+		if (timesync_svc_ping(frame_time))
+			status = GB_OP_INVALID;
+		op_rsp->svc_timesync_ping_response.frame_time =
+			htole64(status ? 0 : frame_time[0]);
+		break;
 	case GB_SVC_TYPE_MODULE_INSERTED:
 	case GB_SVC_TYPE_MODULE_REMOVED:
 	case GB_SVC_TYPE_INTF_RESET:
@@ -243,8 +351,7 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 
 	message_size += payload_size;
 	return send_response(hd_cport_id, op_rsp, message_size,
-				oph->operation_id, oph->type,
-				PROTOCOL_STATUS_SUCCESS);
+				oph->operation_id, oph->type, status);
 }
 
 static int svc_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
@@ -269,7 +376,7 @@ static int svc_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
 
 		/* Version request successful, send hello msg */
 		ret = svc_request_send(GB_SVC_TYPE_SVC_HELLO, AP_INTF_ID);
-		if (ret) {
+		if (ret < 0) {
 			gbsim_error("%s: Failed to send svc hello request (%d)\n",
 				    __func__, ret);
 			return ret;
@@ -278,8 +385,15 @@ static int svc_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
 	case GB_SVC_TYPE_SVC_HELLO:
 		/*
 		 * AP's SVC cport is ready now, start scanning for module
-		 * hotplug.
+		 * hotplug, or churning the virtual modules in stress mode.
 		 */
+		if (stress_config) {
+			ret = stress_start(svc, stress_config);
+			if (ret < 0)
+				gbsim_error("Failed to start stress mode (%d)\n",
+					    ret);
+			break;
+		}
 		ret = inotify_start(svc, hotplug_basedir);
 		if (ret < 0)
 			gbsim_error("Failed to start inotify thread\n");
@@ -391,7 +505,13 @@ char *svc_get_operation(uint8_t type)
 	}
 }
 
-int svc_request_send(uint8_t type, uint8_t intf_id)
+/*
+ * Returns the operation id of the request sent, or a negative errno.
+ * callback gets the response instead of svc_handler_response(), see
+ * send_request_async().
+ */
+int svc_request_send_cb(uint8_t type, uint8_t intf_id,
+			gbsim_op_callback callback, void *data)
 {
 	struct op_msg msg = { };
 	struct gb_operation_msg_hdr *oph = &msg.header;
@@ -402,6 +522,7 @@ int svc_request_send(uint8_t type, uint8_t intf_id)
 	struct gb_svc_intf_reset_request *reset;
 	uint16_t message_size = sizeof(*oph);
 	size_t payload_size;
+	int retries = 0;
 
 	switch (type) {
 	case GB_SVC_TYPE_PROTOCOL_VERSION:
@@ -409,6 +530,7 @@ int svc_request_send(uint8_t type, uint8_t intf_id)
 		version_request = &msg.svc_version_request;
 		version_request->major = GB_SVC_VERSION_MAJOR;
 		version_request->minor = GB_SVC_VERSION_MINOR;
+		retries = SVC_RETRIES;
 		break;
 	case GB_SVC_TYPE_SVC_HELLO:
 		payload_size = sizeof(*hello_request);
@@ -416,6 +538,7 @@ int svc_request_send(uint8_t type, uint8_t intf_id)
 
 		hello_request->endo_id = htole16(ENDO_ID);
 		hello_request->interface_id = AP_INTF_ID;
+		retries = SVC_RETRIES;
 		break;
 	case GB_SVC_TYPE_MODULE_INSERTED:
 		payload_size = sizeof(*inserted);
@@ -443,7 +566,13 @@ int svc_request_send(uint8_t type, uint8_t intf_id)
 	}
 
 	message_size += payload_size;
-	return send_request(GB_SVC_CPORT_ID, &msg, message_size, 1, type);
+	return send_request_async(GB_SVC_CPORT_ID, &msg, message_size, type,
+				  SVC_TIMEOUT_MS, retries, callback, data);
+}
+
+int svc_request_send(uint8_t type, uint8_t intf_id)
+{
+	return svc_request_send_cb(type, intf_id, NULL, NULL);
 }
 
 int svc_init(void)
@@ -454,6 +583,7 @@ int svc_init(void)
 	if (!svc)
 		return -ENOMEM;
 
+	pthread_mutex_init(&svc->intf_lock, NULL);
 	TAILQ_INIT(&svc->intfs);
 
 	/* init svc->ap interface */
@@ -473,7 +603,11 @@ int svc_init(void)
 
 void svc_exit(void)
 {
-	if (svc && svc->intf)
+	if (!svc)
+		return;
+
+	if (svc->intf)
 		interface_free(svc, svc->intf);
+	pthread_mutex_destroy(&svc->intf_lock);
 	free(svc);
 }
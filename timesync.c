@@ -0,0 +1,243 @@
+/*
+ * Greybus Simulator: TimeSync
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/*
+ * The SVC owns the frame time, a counter running at refclk Hz from the
+ * frame_time given at enable. Here it is derived from CLOCK_MONOTONIC_RAW,
+ * which NTP does not slew.
+ *
+ * The wake pins are virtual: TIMESYNC_ENABLE strobes them count times,
+ * strobe_delay us apart, and a PING strobes them once. Interfaces and the
+ * APB enabled before the strobes see them on their own clock, again
+ * CLOCK_MONOTONIC_RAW, until AUTHORITATIVE tells them the frame time of
+ * each strobe. From then on they convert the time of the last strobe
+ * seen to frame time for GET_LAST_EVENT.
+ */
+static pthread_mutex_t timesync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The SVC side */
+static bool timesync_svc_enabled;
+static bool timesync_pins_acquired;
+static uint32_t timesync_refclk;
+static uint64_t timesync_base_ns;
+static uint64_t timesync_base_frame_time;
+static uint8_t timesync_strobe_count;
+static uint64_t timesync_strobe_ns[GB_TIMESYNC_MAX_STROBES];
+static uint64_t timesync_last_strobe_ns;
+
+static struct gbsim_timesync timesync_apb;
+
+static uint64_t timesync_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Ticks of a refclk Hz clock in ns, without overflowing for long runs */
+static int64_t timesync_ticks(int64_t ns, uint32_t refclk)
+{
+	return ns / 1000000000 * refclk +
+	       ns % 1000000000 * refclk / 1000000000;
+}
+
+/* Called with timesync_lock held */
+static uint64_t timesync_svc_frame_time(uint64_t ns)
+{
+	return timesync_base_frame_time +
+	       timesync_ticks(ns - timesync_base_ns, timesync_refclk);
+}
+
+int timesync_svc_enable(uint8_t count, uint64_t frame_time,
+			uint32_t strobe_delay, uint32_t refclk)
+{
+	uint64_t now = timesync_now_ns();
+	int i;
+
+	if (!count || count > GB_TIMESYNC_MAX_STROBES || !refclk)
+		return -EINVAL;
+
+	pthread_mutex_lock(&timesync_lock);
+	timesync_svc_enabled = true;
+	timesync_refclk = refclk;
+	timesync_base_ns = now;
+	timesync_base_frame_time = frame_time;
+	timesync_strobe_count = count;
+	for (i = 0; i < count; i++)
+		timesync_strobe_ns[i] = now + (uint64_t)i * strobe_delay * 1000;
+	timesync_last_strobe_ns = timesync_strobe_ns[count - 1];
+	pthread_mutex_unlock(&timesync_lock);
+
+	gbsim_debug("timesync: %u strobes %u us apart, frame time %llu at %u Hz\n",
+		    count, strobe_delay, (unsigned long long)frame_time, refclk);
+
+	return 0;
+}
+
+void timesync_svc_disable(void)
+{
+	pthread_mutex_lock(&timesync_lock);
+	timesync_svc_enabled = false;
+	timesync_strobe_count = 0;
+	pthread_mutex_unlock(&timesync_lock);
+}
+
+/* The frame time of each strobe of the last enable */
+int timesync_svc_authoritative(uint64_t *frame_time)
+{
+	int i;
+
+	pthread_mutex_lock(&timesync_lock);
+	if (!timesync_svc_enabled) {
+		pthread_mutex_unlock(&timesync_lock);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < GB_TIMESYNC_MAX_STROBES; i++)
+		frame_time[i] = i < timesync_strobe_count ?
+			timesync_svc_frame_time(timesync_strobe_ns[i]) : 0;
+	pthread_mutex_unlock(&timesync_lock);
+
+	return 0;
+}
+
+int timesync_svc_wake_pins_acquire(uint32_t strobe_mask)
+{
+	pthread_mutex_lock(&timesync_lock);
+	timesync_pins_acquired = true;
+	pthread_mutex_unlock(&timesync_lock);
+
+	gbsim_debug("timesync: wake pins %08x acquired\n", strobe_mask);
+
+	return 0;
+}
+
+void timesync_svc_wake_pins_release(void)
+{
+	pthread_mutex_lock(&timesync_lock);
+	timesync_pins_acquired = false;
+	pthread_mutex_unlock(&timesync_lock);
+}
+
+/* Strobe the wake pins once, returning the SVC's frame time of it */
+int timesync_svc_ping(uint64_t *frame_time)
+{
+	uint64_t now = timesync_now_ns();
+
+	pthread_mutex_lock(&timesync_lock);
+	if (!timesync_svc_enabled || !timesync_pins_acquired) {
+		pthread_mutex_unlock(&timesync_lock);
+		return -EINVAL;
+	}
+
+	timesync_last_strobe_ns = now;
+	*frame_time = timesync_svc_frame_time(now);
+	pthread_mutex_unlock(&timesync_lock);
+
+	return 0;
+}
+
+/* Arm ts for the strobes of the next SVC enable */
+int timesync_enable(struct gbsim_timesync *ts, uint8_t count,
+		    uint64_t frame_time, uint32_t strobe_delay, uint32_t refclk)
+{
+	if (!count || count > GB_TIMESYNC_MAX_STROBES || !refclk)
+		return -EINVAL;
+
+	pthread_mutex_lock(&timesync_lock);
+	memset(ts, 0, sizeof(*ts));
+	ts->enabled = true;
+	ts->count = count;
+	ts->refclk = refclk;
+	ts->enable_ns = timesync_now_ns();
+	ts->ref_ns = ts->enable_ns;
+	ts->ref_frame_time = frame_time;
+	pthread_mutex_unlock(&timesync_lock);
+
+	return 0;
+}
+
+void timesync_disable(struct gbsim_timesync *ts)
+{
+	pthread_mutex_lock(&timesync_lock);
+	ts->enabled = false;
+	ts->authoritative = false;
+	pthread_mutex_unlock(&timesync_lock);
+}
+
+/*
+ * Take the frame time of each strobe seen. The last one anchors the
+ * clock of ts; the first and last give the offset and skew of the clock
+ * ts ran on since enable, logged for comparing participants.
+ */
+int timesync_authoritative(struct gbsim_timesync *ts, const char *name,
+			   const uint64_t *frame_time)
+{
+	int64_t local, offset, span, ticks;
+	uint8_t last;
+
+	pthread_mutex_lock(&timesync_lock);
+	if (!ts->enabled || timesync_strobe_count < ts->count ||
+	    timesync_strobe_ns[0] < ts->enable_ns) {
+		pthread_mutex_unlock(&timesync_lock);
+		gbsim_error("timesync: %s saw no strobes\n", name);
+		return -EINVAL;
+	}
+
+	last = ts->count - 1;
+	local = ts->ref_frame_time +
+		timesync_ticks(timesync_strobe_ns[last] - ts->ref_ns,
+			       ts->refclk);
+	offset = (int64_t)frame_time[last] - local;
+	span = timesync_strobe_ns[last] - timesync_strobe_ns[0];
+	ticks = frame_time[last] - frame_time[0];
+
+	ts->ref_ns = timesync_strobe_ns[last];
+	ts->ref_frame_time = frame_time[last];
+	ts->authoritative = true;
+	pthread_mutex_unlock(&timesync_lock);
+
+	if (span && ticks)
+		gbsim_debug("timesync: %s offset %lld ticks, skew %lld ppb\n",
+			    name, (long long)offset,
+			    (long long)((timesync_ticks(span, ts->refclk) -
+					 ticks) * 1000000000 / ticks));
+	else
+		gbsim_debug("timesync: %s offset %lld ticks\n", name,
+			    (long long)offset);
+
+	return 0;
+}
+
+/* The frame time of the last strobe seen by ts */
+int timesync_get_last_event(struct gbsim_timesync *ts, uint64_t *frame_time)
+{
+	pthread_mutex_lock(&timesync_lock);
+	if (!ts->authoritative) {
+		pthread_mutex_unlock(&timesync_lock);
+		return -EINVAL;
+	}
+
+	*frame_time = ts->ref_frame_time +
+		      timesync_ticks((int64_t)(timesync_last_strobe_ns -
+					       ts->ref_ns), ts->refclk);
+	pthread_mutex_unlock(&timesync_lock);
+
+	return 0;
+}
+
+struct gbsim_timesync *timesync_apb_get(void)
+{
+	return &timesync_apb;
+}
@@ -20,6 +20,7 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "gbsim.h"
@@ -35,6 +36,9 @@
 #define GB_OPERATION_DATA_SIZE_MAX		0x400	/* TODO: BOD */
 
 #define UART_MAXNAME				20
+#define UART_MAXLINK				256
+#define UART_PTY_DEFAULT_RATE			115200
+#define UART_PTY_DEFAULT_FRAME_BITS		10	/* 8N1 */
 #define UART_IDX_TX				1
 #define UART_IDX_RX				0
 #define UART_IDX_COUNT				2
@@ -52,6 +56,15 @@
  * The RX thread has a pipe file-descriptor used to signal thread termination.
  * This pipe along with the file descriptors for the open tty ports is run
  * though a timeless select() in uart_thread().
+ *
+ * With uart_pty set the /dev/ttyOx ports are replaced by pseudo-terminal
+ * pairs: 'fd' holds the master side and the slave path is published as a
+ * symlink <hotplug_basedir>/uartN for a test harness to open. With
+ * uart_pty_pace set, data in both directions is paced to the character
+ * time of the line coding last configured by the AP. Pacing never sleeps:
+ * AP data is queued for uart_thread() to write when due, and the SEND_DATA
+ * response is held until then, and a tty is not read again until the data
+ * last read from it has had time to arrive.
  */
 struct gb_uart_port {
 	uint16_t	cport_id;
@@ -64,6 +77,18 @@ struct gb_uart_port {
 	uint8_t		module_id;
 	int		tiocm_bits;
 	pthread_mutex_t	uart_port;
+	bool		pty;
+	int		slave_fd;
+	char		link[UART_MAXLINK];
+	uint32_t	rate;
+	unsigned int	frame_bits;
+	struct timespec	next_tx;
+	struct timespec	next_rx;
+	unsigned char	tx_buf[GB_UART_DATA_SIZE_MAX];
+	size_t		tx_len;		/* queued, 0 when idle */
+	uint16_t	tx_operation_id;
+	uint64_t	tx_bytes;
+	uint64_t	rx_bytes;
 };
 
 static struct gb_uart_port up[GB_UART_MAX];
@@ -75,7 +100,52 @@ static int up_count;
 static pthread_t uart_pthread;
 static pthread_barrier_t uart_barrier;
 
-/* Only used when bbb_backend is true */
+static bool uart_backend_enabled(void)
+{
+	return bbb_backend || uart_pty;
+}
+
+static bool tty_paced(int i)
+{
+	return up[i].pty && uart_pty_pace && up[i].rate;
+}
+
+/*
+ * Only used for paced ports. Advances 'next' to when 'size' characters
+ * would have left the wire at the configured rate, continuing from where
+ * the previous chunk finished so that pacing does not drift across
+ * back-to-back transfers.
+ */
+static void tty_pace(int i, struct timespec *next, size_t size)
+{
+	struct timespec now;
+	uint64_t ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (next->tv_sec < now.tv_sec ||
+	    (next->tv_sec == now.tv_sec && next->tv_nsec < now.tv_nsec))
+		*next = now;
+
+	ns = (uint64_t)size * up[i].frame_bits * 1000000000ULL / up[i].rate;
+	ns += next->tv_nsec;
+	next->tv_sec += ns / 1000000000ULL;
+	next->tv_nsec = ns % 1000000000ULL;
+}
+
+/* Microseconds from now until 'when', 0 if it has passed */
+static uint64_t tty_until_us(const struct timespec *when)
+{
+	struct timespec now;
+	int64_t us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (int64_t)(when->tv_sec - now.tv_sec) * 1000000 +
+	     (when->tv_nsec - now.tv_nsec) / 1000;
+
+	return us > 0 ? us : 0;
+}
+
+/* Only used when a UART backend is enabled */
 static int gb_uart_send(int i, void *tbuf, size_t tsize, __u8 type, __u8 flags)
 {
 	char uart_buf[GB_OPERATION_DATA_SIZE_MAX] = { };
@@ -108,7 +178,8 @@ static int gb_uart_send(int i, void *tbuf, size_t tsize, __u8 type, __u8 flags)
 
 	/* Operation id is 0 (unidirectional operation) */
 
-	return send_request(up[i].hd_cport_id, msg, message_size, 0, type);
+	return send_request_async(up[i].hd_cport_id, msg, message_size, type,
+				  0, 0, NULL, NULL);
 }
 
 static int tty_find_port(uint8_t module_id, uint16_t cport_id)
@@ -123,13 +194,16 @@ static int tty_find_port(uint8_t module_id, uint16_t cport_id)
 	return i;
 }
 
-/* Only used when bbb_backend is true */
+/* Only used when a UART backend is enabled */
 static void tty_poll_modem_state(int i)
 {
 	int ret;
 	int tiocm_bits;
 	extern int errno;
 
+	if (up[i].pty)
+		return;
+
 	pthread_mutex_lock(&up[i].uart_port);
 	ret = ioctl(up[i].fd, TIOCMGET, &tiocm_bits);
 	if (ret == 0 && up[i].tiocm_bits != tiocm_bits) {
@@ -148,7 +222,7 @@ static void tty_poll_modem_state(int i)
 	pthread_mutex_unlock(&up[i].uart_port);
 }
 
-/* Only used when bbb_backend is true */
+/* Only used when a UART backend is enabled */
 static unsigned char *gb_uart_send_escape_sequences(int i, unsigned char *data,
 						    int size)
 {
@@ -204,7 +278,7 @@ err:
 
 }
 
-/* Only used when bbb_backend is true */
+/* Only used when a UART backend is enabled */
 static int tty_read(int i)
 {
 	unsigned char data[GB_UART_DATA_SIZE_MAX];
@@ -220,6 +294,9 @@ static int tty_read(int i)
 		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
 			return ret;
 	} else {
+		if (tty_paced(i))
+			tty_pace(i, &up[i].next_rx, ret);
+		up[i].rx_bytes += ret;
 		if (up[i].esc) {
 			next_frame = data;
 			end = &data[ret];
@@ -240,7 +317,7 @@ static int tty_write(uint8_t module_id, uint16_t cport_id, void *tbuf, size_t ts
 	int ret = 0;
 	extern int errno;
 
-	if (!bbb_backend)
+	if (!uart_backend_enabled())
 		return tsize;
 
 	i = tty_find_port(module_id, cport_id);
@@ -257,6 +334,8 @@ static int tty_write(uint8_t module_id, uint16_t cport_id, void *tbuf, size_t ts
 	if (ret < 0)
 		gbsim_error("UART write -> %s failed errno=%d\n",
 			    up[i].name, errno);
+	else
+		up[i].tx_bytes += ret;
 
 	if (verbose) {
 		gbsim_debug("AP -> UART %s length %zu\n", up[i].name, tsize);
@@ -265,15 +344,86 @@ static int tty_write(uint8_t module_id, uint16_t cport_id, void *tbuf, size_t ts
 	return ret;
 }
 
+/*
+ * Only used for paced ports. Queue data for uart_thread() to write once
+ * it would have left the wire, and answer operation_id then.
+ */
+static int tty_queue(int i, void *tbuf, size_t tsize, uint16_t operation_id)
+{
+	char c = 0;
+	int ret = 0;
+
+	pthread_mutex_lock(&up[i].uart_port);
+	if (up[i].tx_len) {
+		/* The AP waits for each SEND_DATA response */
+		ret = -EBUSY;
+	} else if (tsize > sizeof(up[i].tx_buf)) {
+		ret = -EMSGSIZE;
+	} else if (tsize) {
+		memcpy(up[i].tx_buf, tbuf, tsize);
+		up[i].tx_len = tsize;
+		up[i].tx_operation_id = operation_id;
+		tty_pace(i, &up[i].next_tx, tsize);
+	}
+	pthread_mutex_unlock(&up[i].uart_port);
+
+	if (ret || !tsize)
+		return ret ? ret : 1;
+
+	if (verbose) {
+		gbsim_debug("AP -> UART %s length %zu queued\n", up[i].name, tsize);
+		gbsim_dump(tbuf, tsize);
+	}
+
+	/* Have uart_thread() pick up the new deadline */
+	if (write(uart_sig_pipe[UART_IDX_TX], &c, 1) < 0)
+		gbsim_error("Write to signal pipe fail %d\n", errno);
+
+	return 0;
+}
+
+/* Only used for paced ports, from uart_thread() */
+static void tty_flush_queue(int i)
+{
+	char rsp_buf[sizeof(struct gb_operation_msg_hdr)] = { };
+	struct op_msg *rsp = (struct op_msg *)rsp_buf;
+	uint8_t result = GB_OP_SUCCESS;
+	uint16_t operation_id;
+	int ret;
+
+	pthread_mutex_lock(&up[i].uart_port);
+	if (!up[i].tx_len || tty_until_us(&up[i].next_tx)) {
+		pthread_mutex_unlock(&up[i].uart_port);
+		return;
+	}
+
+	ret = write(up[i].fd, up[i].tx_buf, up[i].tx_len);
+	if (ret < 0) {
+		gbsim_error("UART write -> %s failed errno=%d\n",
+			    up[i].name, errno);
+		result = GB_OP_INVALID;
+	} else {
+		up[i].tx_bytes += ret;
+		if (ret < up[i].tx_len)
+			result = GB_OP_INVALID;
+	}
+	up[i].tx_len = 0;
+	operation_id = up[i].tx_operation_id;
+	pthread_mutex_unlock(&up[i].uart_port);
+
+	send_response(up[i].hd_cport_id, rsp, sizeof(rsp_buf),
+		      operation_id, GB_UART_TYPE_SEND_DATA, result);
+}
+
 static int tty_set_line_coding(int i,
 			       struct gb_uart_set_line_coding_request *slc)
 {
-	struct termios newtios;
+	struct termios newtios = { };
 	speed_t speed;
 
 	gbsim_debug("UART line coding rate %u format %u parity %u data_bits %u\n",
 		     slc->rate, slc->format, slc->parity, slc->data_bits);
-	if (bbb_backend)
+	if (uart_backend_enabled())
 		tcgetattr(up[i].fd, &newtios);
 
 	newtios.c_cflag &= ~CBAUD;
@@ -440,17 +590,22 @@ static int tty_set_line_coding(int i,
 	newtios.c_cc[VTIME] = 0;   /* inter-character timer unused */
 	newtios.c_cc[VMIN]  = 1;   /* blocking read until 1 chars received */
 
-	if (bbb_backend) {
+	if (uart_backend_enabled()) {
 		pthread_mutex_lock(&up[i].uart_port);
 		tcsetattr(up[i].fd, TCSAFLUSH, &newtios);
-		up[i].esc = newtios.c_cflag & PARENB ? true : false;
+		/* A pty never reports parity/framing errors, 0xff is data */
+		up[i].esc = !up[i].pty && (newtios.c_cflag & PARENB);
+		up[i].rate = slc->rate;
+		up[i].frame_bits = 1 + slc->data_bits +
+				   (slc->parity ? 1 : 0) +
+				   (slc->format == GB_SERIAL_2_STOP_BITS ? 2 : 1);
 		pthread_mutex_unlock(&up[i].uart_port);
 	}
 
 	return 0;
 }
 
-/* Only used when bbb_backend is true */
+/* Only used when a UART backend is enabled */
 static int tty_set_control_line_state(int i,
 				      struct gb_uart_set_control_line_state_request *sls)
 {
@@ -460,7 +615,8 @@ static int tty_set_control_line_state(int i,
 		    sls->control & GB_UART_CTRL_DTR,
 		    sls->control & GB_UART_CTRL_RTS);
 
-	if (!bbb_backend)
+	/* A pty has no modem control lines */
+	if (!uart_backend_enabled() || up[i].pty)
 		return 0;
 
 	ret = ioctl(up[i].fd, TIOCMGET, &status);
@@ -478,12 +634,12 @@ err:
 	return ret;
 }
 
-/* Only used when bbb_backend is true */
+/* Only used when a UART backend is enabled */
 static int tty_send_break(int i, struct gb_uart_set_break_request *set_break)
 {
 	int ret;
 
-	if (!bbb_backend)
+	if (!uart_backend_enabled() || up[i].pty)
 		return 0;
 
 	pthread_mutex_lock(&up[i].uart_port);
@@ -534,12 +690,12 @@ int uart_handler(struct gbsim_connection *connection, void *rbuf,
 	uint16_t cport_id = connection->cport_id;
 	uint16_t hd_cport_id = connection->hd_cport_id;
 	uint8_t module_id;
-	uint8_t result = PROTOCOL_STATUS_SUCCESS;
+	uint8_t result = GB_OP_SUCCESS;
 	struct gb_uart_set_break_request *set_break;
 	struct gb_uart_send_data_request *send_data;
 	struct gb_uart_set_line_coding_request *line_coding;
 	struct gb_uart_set_control_line_state_request *line_state;
-	int i;
+	int i, ret;
 	extern int errno;
 
 	module_id = cport_to_module_id(cport_id);
@@ -555,19 +711,28 @@ int uart_handler(struct gbsim_connection *connection, void *rbuf,
 	switch (oph->type) {
 	case GB_UART_TYPE_SEND_DATA:
 		send_data = &op_req->uart_send_data_req;
-		if (tty_write(module_id, cport_id, send_data->data, send_data->size) < send_data->size)
-			result = PROTOCOL_STATUS_INVALID;
 		gbsim_debug("UART send len %hu\n", send_data->size);
+		if (uart_backend_enabled() && tty_paced(i)) {
+			ret = tty_queue(i, send_data->data, send_data->size,
+					oph->operation_id);
+			if (!ret)
+				return 0;	/* answered by tty_flush_queue() */
+			if (ret < 0)
+				result = GB_OP_INVALID;
+			break;
+		}
+		if (tty_write(module_id, cport_id, send_data->data, send_data->size) < send_data->size)
+			result = GB_OP_INVALID;
 		break;
 	case GB_UART_TYPE_SET_LINE_CODING:
 		line_coding = &op_req->uart_slc_req;
 		if (tty_set_line_coding(i, line_coding))
-			result = PROTOCOL_STATUS_INVALID;
+			result = GB_OP_INVALID;
 		break;
 	case GB_UART_TYPE_SET_CONTROL_LINE_STATE:
 		line_state = &op_req->uart_sls_req;
 		if (tty_set_control_line_state(i, line_state))
-			result = PROTOCOL_STATUS_INVALID;
+			result = GB_OP_INVALID;
 		gbsim_debug("UART dtr=%d rts=%d\n",
 			line_state->control&GB_UART_CTRL_DTR,
 			line_state->control & GB_UART_CTRL_RTS);
@@ -575,7 +740,7 @@ int uart_handler(struct gbsim_connection *connection, void *rbuf,
 	case GB_UART_TYPE_SEND_BREAK:
 		set_break = &op_req->uart_sb_req;
 		if (tty_send_break(i, set_break))
-			result = PROTOCOL_STATUS_INVALID;
+			result = GB_OP_INVALID;
 		break;
 	case (OP_RESPONSE | GB_UART_TYPE_RECEIVE_DATA):
 	case (OP_RESPONSE | GB_UART_TYPE_SERIAL_STATE):
@@ -594,13 +759,15 @@ int uart_handler(struct gbsim_connection *connection, void *rbuf,
 			oph->operation_id, oph->type, result);
 }
 
-/* Only used when bbb_backend is true */
+/* Only used when a UART backend is enabled */
 static void *uart_thread(void *param)
 {
 	fd_set fdset;
 	int i, ret;
 	int max = uart_sig_pipe[UART_IDX_RX];
 	struct timeval tv;
+	uint64_t timeout_us, us;
+	char c;
 	extern int errno;
 
 	pthread_barrier_wait(&uart_barrier);
@@ -614,15 +781,35 @@ static void *uart_thread(void *param)
 				tty_poll_modem_state(i);
 		}
 
+		/* Wake for paced data falling due as well */
+		timeout_us = 1000000;
 		FD_ZERO(&fdset);
 		FD_SET(uart_sig_pipe[UART_IDX_RX] , &fdset);
 		for (i = 0; i < up_count; i++) {
-			if (up[i].init == true)
-				FD_SET(up[i].fd , &fdset);
+			if (up[i].init != true)
+				continue;
+			if (tty_paced(i)) {
+				tty_flush_queue(i);
+				pthread_mutex_lock(&up[i].uart_port);
+				if (up[i].tx_len) {
+					us = tty_until_us(&up[i].next_tx);
+					if (us < timeout_us)
+						timeout_us = us;
+				}
+				pthread_mutex_unlock(&up[i].uart_port);
+
+				us = tty_until_us(&up[i].next_rx);
+				if (us) {
+					if (us < timeout_us)
+						timeout_us = us;
+					continue;
+				}
+			}
+			FD_SET(up[i].fd , &fdset);
 		}
 
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
+		tv.tv_sec = timeout_us / 1000000;
+		tv.tv_usec = timeout_us % 1000000;
 		ret = select(1 + max, &fdset, 0, 0, &tv);
 		switch (ret) {
 		case -1:
@@ -633,8 +820,11 @@ static void *uart_thread(void *param)
 			break;
 		default:
 			if (FD_ISSET(uart_sig_pipe[UART_IDX_RX], &fdset)) {
-				terminate_thread = true;
-				break;
+				/* A kick from tty_queue(), or termination */
+				while (read(uart_sig_pipe[UART_IDX_RX], &c, 1) > 0)
+					;
+				if (terminate_thread)
+					break;
 			}
 			for (i = 0; i < up_count; i++) {
 				if (FD_ISSET(up[i].fd, &fdset)) {
@@ -652,6 +842,18 @@ static void *uart_thread(void *param)
 	return NULL;
 }
 
+/* Baud rate set by the AP on the port of hd_cport_id, 0 if none */
+uint32_t uart_rate(uint16_t hd_cport_id)
+{
+	int i;
+
+	for (i = 0; i < port_count; i++)
+		if (up[i].hd_cport_id == hd_cport_id)
+			return up[i].rate;
+
+	return 0;
+}
+
 void uart_cleanup(void)
 {
 	int i;
@@ -660,6 +862,7 @@ void uart_cleanup(void)
 
 	if (thread_started) {
 		/* signal termination */
+		terminate_thread = true;
 		if (write(uart_sig_pipe[UART_IDX_TX], &c, 1) < 0)
 			gbsim_error("Write to signal pipe fail %d\n", errno);
 
@@ -676,6 +879,15 @@ void uart_cleanup(void)
 
 	/* Close fds to serial ports a signal pipes for ports */
 	for (i = 0; i < GB_UART_MAX; i++) {
+		if (up[i].pty) {
+			gbsim_info("UART %s tx %llu bytes rx %llu bytes\n",
+				   up[i].name,
+				   (unsigned long long)up[i].tx_bytes,
+				   (unsigned long long)up[i].rx_bytes);
+			unlink(up[i].link);
+			close(up[i].slave_fd);
+			up[i].pty = false;
+		}
 		if (up[i].fd != -1)
 			close(up[i].fd);
 	}
@@ -698,6 +910,63 @@ static int uart_open(int idx)
 	return 0;
 }
 
+/* Only used when uart_pty is true */
+static int uart_open_pty(int idx)
+{
+	struct gb_uart_port *port = &up[up_count];
+	struct termios tios;
+	char *slave;
+
+	port->fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (port->fd < 0) {
+		gbsim_error("cannot allocate pty errno=%d\n", errno);
+		return EXIT_FAILURE;
+	}
+
+	if (grantpt(port->fd) || unlockpt(port->fd) ||
+	    !(slave = ptsname(port->fd))) {
+		gbsim_error("cannot unlock pty errno=%d\n", errno);
+		goto err_close;
+	}
+
+	/*
+	 * Keep our own handle on the slave so the master does not report
+	 * EIO/HUP to uart_thread() while no harness has the pty open.
+	 */
+	port->slave_fd = open(slave, O_RDWR | O_NOCTTY);
+	if (port->slave_fd < 0) {
+		gbsim_error("cannot open %s errno=%d\n", slave, errno);
+		goto err_close;
+	}
+
+	/* Raw until the AP sets a line coding, a cooked pty echoes data back */
+	tcgetattr(port->fd, &tios);
+	cfmakeraw(&tios);
+	tcsetattr(port->fd, TCSANOW, &tios);
+
+	snprintf(port->name, sizeof(port->name), "%s", slave);
+	snprintf(port->link, sizeof(port->link), "%s/uart%d",
+		 hotplug_basedir, idx);
+	unlink(port->link);
+	if (symlink(slave, port->link))
+		gbsim_error("cannot link %s -> %s errno=%d\n",
+			    port->link, slave, errno);
+
+	port->pty = true;
+	port->rate = UART_PTY_DEFAULT_RATE;
+	port->frame_bits = UART_PTY_DEFAULT_FRAME_BITS;
+	gbsim_info("UART pty %d slave %s (%s)\n", idx, slave, port->link);
+
+	pthread_mutex_init(&port->uart_port, 0);
+	up_count++;
+	return 0;
+
+err_close:
+	close(port->fd);
+	port->fd = -1;
+	return EXIT_FAILURE;
+}
+
 char *uart_get_operation(uint8_t type)
 {
 	switch (type) {
@@ -727,12 +996,21 @@ void uart_init(void)
 	extern int errno;
 	int i, ret;
 
-	if (!bbb_backend)
+	if (uart_pty) {
+		/* One pty pair per Greybus UART */
+		for (i = 0; i < uart_count; i++)
+			if (uart_open_pty(i)) {
+				uart_cleanup();
+				return;
+			}
+	} else if (bbb_backend) {
+		/* Loop through the /dev/tty0x entries */
+		for (i = 0; i < uart_count; i++)
+			if (uart_open(i + uart_portno))
+				return;
+	} else {
 		return;
-	/* Loop through the /dev/tty0x entries */
-	for (i = 0; i < uart_count; i++)
-		if (uart_open(i + uart_portno))
-			return;
+	}
 
 	/* Create a pipe for kicking the thread's select */
 	ret = pipe2(uart_sig_pipe, O_NONBLOCK);